@@ -6,7 +6,47 @@
 #define WEBCACHESIM_ANNOTATE_H
 
 #include <string>
+#include <cstdint>
 
-void annotate(const std::string &trace_file, const int &n_extra_fields);
+/*
+ * Offline algorithms need the position of the next request to the same object. annotate() computes it and stores it in
+ * a sidecar file next to the trace (trace_file + ".next_seq"):
+ *
+ * | magic (8 bytes) | n_req: uint64 | next_seq: uint64 x n_req |
+ *
+ * Objects that are never requested again get never_requested_again.
+ */
+const uint64_t never_requested_again = INT64_MAX;
+
+std::string next_seq_file(const std::string &trace_file);
+
+/*
+ * requests are partitioned by id hash into buckets, which are annotated in parallel. When the buckets are estimated
+ * not to fit in memory_budget bytes, they are spilled to disk next to the trace first.
+ * n_threads: 0 means hardware concurrency
+ */
+void annotate(const std::string &trace_file, const int &n_extra_fields, uint n_threads = 0,
+              uint64_t memory_budget = 8ull * 1024 * 1024 * 1024);
+
+/*
+ * read-only memory mapped next_seq sidecar
+ */
+class MappedNextSeq {
+public:
+    explicit MappedNextSeq(const std::string &file);
+
+    ~MappedNextSeq();
+
+    MappedNextSeq(const MappedNextSeq &) = delete;
+
+    MappedNextSeq &operator=(const MappedNextSeq &) = delete;
+
+    uint64_t n_req;
+    const uint64_t *next_seq;
+
+private:
+    void *addr = nullptr;
+    size_t length = 0;
+};
 
 #endif //WEBCACHESIM_ANNOTATE_H
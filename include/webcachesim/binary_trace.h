@@ -0,0 +1,75 @@
+//
+// Binary columnar trace format.
+//
+
+#ifndef WEBCACHESIM_BINARY_TRACE_H
+#define WEBCACHESIM_BINARY_TRACE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include "api.h"
+
+/*
+ * Layout of a binary trace (little endian, all columns are contiguous):
+ *
+ * | header (64 bytes) | t: int64 x n_req | id: uint64 x n_req | size: uint32 x n_req |
+ * | extra_0: uint16 x n_req | ... | extra_{n_extra_fields-1}: uint16 x n_req |
+ *
+ * The column widths are the same as the limits checked by trace_sanity_check, so a text trace passing the sanity
+ * check converts losslessly.
+ */
+namespace webcachesim {
+    static const char binary_trace_magic[8] = {'W', 'C', 'S', 'B', 'T', 'R', '\0', '\1'};
+    const uint32_t binary_trace_version = 1;
+
+    struct BinaryTraceHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t n_extra_fields;
+        uint64_t n_req;
+        uint8_t reserved[40];
+    };
+    static_assert(sizeof(BinaryTraceHeader) == 64, "binary trace header must be 64 bytes");
+
+    /*
+     * read-only memory mapped view of a binary trace
+     */
+    class MappedBinaryTrace {
+    public:
+        explicit MappedBinaryTrace(const std::string &trace_file);
+
+        ~MappedBinaryTrace();
+
+        MappedBinaryTrace(const MappedBinaryTrace &) = delete;
+
+        MappedBinaryTrace &operator=(const MappedBinaryTrace &) = delete;
+
+        uint64_t n_req() const { return header->n_req; }
+
+        uint32_t n_extra_fields() const { return header->n_extra_fields; }
+
+        const int64_t *t = nullptr;
+        const uint64_t *id = nullptr;
+        const uint32_t *size = nullptr;
+        //extra[i] is the i-th extra feature column
+        const uint16_t *extra[max_n_extra_feature] = {};
+
+    private:
+        void *addr = nullptr;
+        size_t length = 0;
+        const BinaryTraceHeader *header = nullptr;
+    };
+
+    bool is_binary_trace(const std::string &trace_file);
+
+    //number of bytes a binary trace with these dimensions occupies
+    size_t binary_trace_file_size(const uint64_t &n_req, const uint32_t &n_extra_fields);
+
+    /*
+     * convert a space-separated trace (t id size [extra_features]) into the binary format. Returns number of requests
+     */
+    uint64_t convert_to_binary_trace(const std::string &text_trace_file, const std::string &binary_trace_file);
+}
+
+#endif //WEBCACHESIM_BINARY_TRACE_H
@@ -68,6 +68,16 @@ namespace webcachesim {
             return sizeof(Cache);
         }
 
+        // checkpoint the policy state, so a later run can resume from it. Configuration comes from params and is
+        // not part of the checkpoint
+        virtual void serialize(std::ostream &os) {
+            throw runtime_error("Error: serialize() function not implemented");
+        }
+
+        virtual void deserialize(std::istream &is) {
+            throw runtime_error("Error: deserialize() function not implemented");
+        }
+
         uint64_t getCurrentSize() const {
             return (_currentSize);
         }
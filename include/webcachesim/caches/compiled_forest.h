@@ -0,0 +1,79 @@
+//
+// Flat-array evaluation of LightGBM regression forests.
+//
+
+#ifndef WEBCACHESIM_COMPILED_FOREST_H
+#define WEBCACHESIM_COMPILED_FOREST_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * A LightGBM gbdt model compiled into structure-of-arrays nodes, for scoring a few dozen rows at a time without the
+ * overhead of LGBM_BoosterPredict* (parameter parsing, thread pool, sparse conversion).
+ *
+ * Siblings are laid out next to each other and leaves are nodes pointing to themselves, so every row walks a tree
+ * for exactly its depth, and all rows of a batch advance one level together without data dependent branches.
+ * Decisions follow LightGBM's Tree::NumericalDecision and Tree::CategoricalDecision, and trees are summed in model
+ * order, so scores equal LightGBM's raw scores.
+ */
+class CompiledForest {
+public:
+    //parse a model written by LGBM_BoosterSaveModelToString. Throws on models it can not evaluate
+    void compile(const std::string &model);
+
+    bool empty() const {
+        return tree_root.empty();
+    }
+
+    //scores[i]: prediction for row i of the row-major n_row x n_col block. T is float or double
+    template<class T>
+    void predict(const T *rows, const uint32_t &n_row, const uint32_t &n_col, double *scores) const;
+
+private:
+    //decision_type bits, as in LightGBM
+    static constexpr uint8_t categorical_mask = 1;
+    static constexpr uint8_t default_left_mask = 2;
+    enum MissingType : uint8_t {
+        missing_none = 0, missing_zero = 1, missing_nan = 2
+    };
+    //flags
+    static constexpr uint8_t nan_left_flag = 1;
+    //categorical and zero-as-missing nodes take the exact LightGBM decision
+    static constexpr uint8_t slow_flag = 2;
+
+    //per node. Children of node i are left_child_of[i] and left_child_of[i] + 1
+    std::vector<int32_t> feature;
+    std::vector<double> threshold;
+    std::vector<uint32_t> left_child_of;
+    std::vector<uint8_t> flags;
+    std::vector<uint8_t> decision_type;
+    std::vector<double> value;
+    //categorical nodes: bitset of left categories in cat_threshold
+    std::vector<uint32_t> cat_begin;
+    std::vector<uint32_t> cat_n_word;
+    std::vector<uint32_t> cat_threshold;
+
+    //per tree
+    std::vector<uint32_t> tree_root;
+    std::vector<uint32_t> tree_depth;
+
+    int32_t max_feature_idx = -1;
+
+    bool slow_is_left(const uint32_t &node, double fval) const;
+
+    template<class T>
+    uint32_t next(const uint32_t &node, const T *row) const {
+        const double fval = row[feature[node]];
+        bool is_left = fval <= threshold[node];
+        //select, not branch: NaN features are rare but scattered
+        is_left = fval != fval ? (flags[node] & nan_left_flag) : is_left;
+        if (flags[node] & slow_flag) {
+            is_left = slow_is_left(node, fval);
+        }
+        return left_child_of[node] + !is_left;
+    }
+};
+
+#endif //WEBCACHESIM_COMPILED_FOREST_H
@@ -49,6 +49,10 @@ protected:
     virtual void hit(const SimpleRequest& req);
     bool has(const uint64_t& id) {return _cacheMap.find(id) != _cacheMap.end();}
 
+    //checkpoint of the state shared by all GD variants. Variants with more state extend it
+    void serialize_gd(std::ostream &os);
+    void deserialize_gd(std::istream &is);
+
 public:
     GreedyDualBase()
         : Cache(),
@@ -110,6 +114,10 @@ public:
     }
 
     virtual bool lookup(const SimpleRequest &req);
+
+    void serialize(std::ostream &os) override;
+
+    void deserialize(std::istream &is) override;
 };
 
 static Factory<GDSFCache> factoryGDSF("GDSF");
@@ -11,11 +11,18 @@
 #include "sparsepp/sparsepp/spp.h"
 #include <vector>
 #include <random>
+#include <memory>
+#include <cstdlib>
 #include <cmath>
 #include <LightGBM/c_api.h>
+#include "compiled_forest.h"
+#include "lrb_config.h"
+#include "spatial_sampler.h"
+#include "timer_wheel.h"
 #include <assert.h>
 #include <fstream>
 #include <list>
+#include <thread>
 #include "mongocxx/client.hpp"
 #include "mongocxx/uri.hpp"
 #include <bsoncxx/builder/basic/document.hpp>
@@ -27,22 +34,16 @@ using spp::sparse_hash_map;
 using bsoncxx::builder::basic::kvp;
 using bsoncxx::builder::basic::sub_array;
 
+//only constants here: the configuration lives in each LRBCache, see LRBConfig
 namespace lrb {
-    uint32_t current_seq = -1;
-    uint8_t max_n_past_timestamps = 32;
-    uint8_t max_n_past_distances = 31;
-    uint8_t base_edc_window = 10;
-    const uint8_t n_edc_feature = 10;
-    vector<uint32_t> edc_windows;
-    vector<double> hash_edc;
-    uint32_t max_hash_edc_idx;
-    uint32_t memory_window = 67108864;
-    uint32_t n_extra_fields = 0;
-    uint32_t batch_size = 131072;
-    const uint max_n_extra_feature = 4;
-    uint32_t n_feature;
+    //past distances are stored inline, so max_n_past_timestamps is at most max_n_past_distances_capacity + 1
+    const uint8_t max_n_past_distances_capacity = 31;
+    const uint8_t n_edc_feature = LRBConfig::n_edc_feature;
+    const uint max_n_extra_feature = LRBConfig::max_n_extra_feature;
     //TODO: interval clock should tick by event instead of following incoming packet time
 #ifdef EVICTION_LOGGING
+    //eviction logging supports one cache per process. current_seq of that cache
+    uint32_t logging_seq;
     unordered_map<uint64_t, uint32_t> future_timestamps;
     int n_logging_start;
     vector<float> trainings_and_predictions;
@@ -50,51 +51,84 @@ namespace lrb {
     int range_log = 1000000;
 #endif
 
+/*
+ * past distances are kept at full precision by default. With LRB_QUANTIZE_PAST_DISTANCES they are stored as 16-bit
+ * floats (5-bit exponent, 11-bit mantissa): exact below 2048, relative error < 1/2048 above
+ */
+#ifdef LRB_QUANTIZE_PAST_DISTANCES
+typedef uint16_t PastDistanceT;
+
+inline PastDistanceT encode_past_distance(const uint32_t &distance) {
+    if (distance < 2048)
+        return distance;
+    uint8_t exponent = 32 - __builtin_clz(distance) - 11;
+    return (exponent << 11) | ((distance >> (exponent - 1)) - 2048);
+}
+
+inline uint32_t decode_past_distance(const PastDistanceT &code) {
+    uint8_t exponent = code >> 11;
+    uint32_t mantissa = code & 2047;
+    if (!exponent)
+        return mantissa;
+    return (mantissa | 2048) << (exponent - 1);
+}
+#else
+typedef uint32_t PastDistanceT;
+
+inline PastDistanceT encode_past_distance(const uint32_t &distance) {
+    return distance;
+}
+
+inline uint32_t decode_past_distance(const PastDistanceT &code) {
+    return code;
+}
+#endif
+
 struct MetaExtra {
-    //vector overhead = 24 (8 pointer, 8 size, 8 allocation)
-    //40 + 24 + 4*x + 1
-    //65 byte at least
-    //189 byte at most
+    //one allocation, no vector: 40 + 31 * 4 + 1 = 168 byte with padding (104 byte if quantized)
     //not 1 hit wonder
     float _edc[10];
-    vector<uint32_t> _past_distances;
+    //ring buffer, the first min(_past_distance_idx, max_n_past_distances) entries are valid
+    PastDistanceT _past_distances[max_n_past_distances_capacity] = {};
     //the next index to put the distance
     uint8_t _past_distance_idx = 1;
 
-    MetaExtra(const uint32_t &distance) {
-        _past_distances = vector<uint32_t>(1, distance);
+    MetaExtra(const uint32_t &distance, const LRBConfig &config) {
+        _past_distances[0] = encode_past_distance(distance);
         for (uint8_t i = 0; i < n_edc_feature; ++i) {
-            uint32_t _distance_idx = min(uint32_t(distance / edc_windows[i]), max_hash_edc_idx);
-            _edc[i] = hash_edc[_distance_idx] + 1;
+            uint32_t _distance_idx = min(uint32_t(distance / config.edc_windows[i]), config.max_hash_edc_idx);
+            _edc[i] = config.hash_edc[_distance_idx] + 1;
         }
     }
 
-    void update(const uint32_t &distance) {
-        uint8_t distance_idx = _past_distance_idx % max_n_past_distances;
-        if (_past_distances.size() < max_n_past_distances)
-            _past_distances.emplace_back(distance);
-        else
-            _past_distances[distance_idx] = distance;
-        assert(_past_distances.size() <= max_n_past_distances);
+    void update(const uint32_t &distance, const LRBConfig &config) {
+        uint8_t distance_idx = _past_distance_idx % config.max_n_past_distances;
+        _past_distances[distance_idx] = encode_past_distance(distance);
         _past_distance_idx = _past_distance_idx + (uint8_t) 1;
-        if (_past_distance_idx >= max_n_past_distances * 2)
-            _past_distance_idx -= max_n_past_distances;
+        if (_past_distance_idx >= config.max_n_past_distances * 2)
+            _past_distance_idx -= config.max_n_past_distances;
         for (uint8_t i = 0; i < n_edc_feature; ++i) {
-            uint32_t _distance_idx = min(uint32_t(distance / edc_windows[i]), max_hash_edc_idx);
-            _edc[i] = _edc[i] * hash_edc[_distance_idx] + 1;
+            uint32_t _distance_idx = min(uint32_t(distance / config.edc_windows[i]), config.max_hash_edc_idx);
+            _edc[i] = _edc[i] * config.hash_edc[_distance_idx] + 1;
         }
     }
+
+    uint8_t n_past_distances(const LRBConfig &config) const {
+        return min(_past_distance_idx, config.max_n_past_distances);
+    }
 };
 
+/*
+ * no vtable and no per-object vectors: 32 byte. Pending training samples live in LRBCache::sample_times, keyed by
+ * object, as only a small fraction of the objects is sampled at any time
+ */
 class Meta {
 public:
-    //25 byte
     uint64_t _key;
     uint32_t _size;
     uint32_t _past_timestamp;
     uint16_t _extra_features[max_n_extra_feature];
     MetaExtra *_extra = nullptr;
-    vector<uint32_t> _sample_times;
 #ifdef EVICTION_LOGGING
     vector<uint32_t> _eviction_sample_times;
     uint32_t _future_timestamp;
@@ -103,32 +137,26 @@ public:
 
 #ifdef EVICTION_LOGGING
     Meta(const uint64_t &key, const uint64_t &size, const uint64_t &past_timestamp,
-            const vector<uint16_t> &extra_features, const uint64_t &future_timestamp) {
+            const vector<uint16_t> &extra_features, const uint64_t &future_timestamp, const LRBConfig &config) {
         _key = key;
         _size = size;
         _past_timestamp = past_timestamp;
-        for (int i = 0; i < n_extra_fields; ++i)
+        for (int i = 0; i < config.n_extra_fields; ++i)
             _extra_features[i] = extra_features[i];
         _future_timestamp = future_timestamp;
     }
 
 #else
     Meta(const uint64_t &key, const uint64_t &size, const uint64_t &past_timestamp,
-            const vector<uint16_t> &extra_features) {
+            const vector<uint16_t> &extra_features, const LRBConfig &config) {
         _key = key;
         _size = size;
         _past_timestamp = past_timestamp;
-        for (int i = 0; i < n_extra_fields; ++i)
+        for (int i = 0; i < config.n_extra_fields; ++i)
             _extra_features[i] = extra_features[i];
     }
 #endif
 
-    virtual ~Meta() = default;
-
-    void emplace_sample(uint32_t &sample_t) {
-        _sample_times.emplace_back(sample_t);
-    }
-
 #ifdef EVICTION_LOGGING
     void emplace_eviction_sample(uint32_t &sample_t) {
         _eviction_sample_times.emplace_back(sample_t);
@@ -141,51 +169,95 @@ public:
 
 #ifdef EVICTION_LOGGING
 
-    void update(const uint32_t &past_timestamp, const uint32_t &future_timestamp) {
+    void update(const uint32_t &past_timestamp, const uint32_t &future_timestamp, const LRBConfig &config) {
         //distance
         uint32_t _distance = past_timestamp - _past_timestamp;
         assert(_distance);
         if (!_extra) {
-            _extra = new MetaExtra(_distance);
+            _extra = new MetaExtra(_distance, config);
         } else
-            _extra->update(_distance);
+            _extra->update(_distance, config);
         //timestamp
         _past_timestamp = past_timestamp;
         _future_timestamp = future_timestamp;
     }
 
 #else
-    void update(const uint32_t &past_timestamp) {
+    void update(const uint32_t &past_timestamp, const LRBConfig &config) {
         //distance
         uint32_t _distance = past_timestamp - _past_timestamp;
         assert(_distance);
         if (!_extra) {
-            _extra = new MetaExtra(_distance);
+            _extra = new MetaExtra(_distance, config);
         } else
-            _extra->update(_distance);
+            _extra->update(_distance, config);
         //timestamp
         _past_timestamp = past_timestamp;
     }
 #endif
 
-    int feature_overhead() {
+    //exact bytes of this object's features, not counting the allocator's own overhead
+    int feature_overhead() const {
         int ret = sizeof(Meta);
         if (_extra)
-            ret += sizeof(MetaExtra) - sizeof(_sample_times) + _extra->_past_distances.capacity() * sizeof(uint32_t);
+            ret += sizeof(MetaExtra);
         return ret;
     }
 
-    int sample_overhead() {
-        return sizeof(_sample_times) + sizeof(uint32_t) * _sample_times.capacity();
+    /*
+     * dense row of n_feature features at timestamp: past interval, past distances (most recent first, NaN beyond
+     * the object's history), size, extra features, number of past distances within memory window, edc
+     */
+    void features(const uint32_t &timestamp, float *row, const LRBConfig &config) const {
+        row[0] = timestamp - _past_timestamp;
+
+        uint8_t j = 0;
+        uint32_t this_past_distance = 0;
+        uint8_t n_within = 0;
+        if (_extra) {
+            for (j = 0; j < _extra->n_past_distances(config); ++j) {
+                uint8_t past_distance_idx = (_extra->_past_distance_idx - 1 - j) % config.max_n_past_distances;
+                uint32_t past_distance = decode_past_distance(_extra->_past_distances[past_distance_idx]);
+                this_past_distance += past_distance;
+                row[j + 1] = past_distance;
+                if (this_past_distance < config.memory_window) {
+                    ++n_within;
+                }
+            }
+        }
+        for (; j < config.max_n_past_distances; ++j) {
+            row[j + 1] = NAN;
+        }
+
+        row[config.max_n_past_timestamps] = _size;
+
+        for (uint k = 0; k < config.n_extra_fields; ++k) {
+            row[config.max_n_past_timestamps + k + 1] = _extra_features[k];
+        }
+
+        row[config.max_n_past_timestamps + config.n_extra_fields + 1] = n_within;
+
+        for (uint8_t k = 0; k < n_edc_feature; ++k) {
+            uint32_t _distance_idx = min(uint32_t(timestamp - _past_timestamp) / config.edc_windows[k],
+                                         config.max_hash_edc_idx);
+            if (_extra)
+                row[config.max_n_past_timestamps + config.n_extra_fields + 2 + k] =
+                        _extra->_edc[k] * config.hash_edc[_distance_idx];
+            else
+                row[config.max_n_past_timestamps + config.n_extra_fields + 2 + k] = config.hash_edc[_distance_idx];
+        }
     }
 };
 
 
 class InCacheMeta : public Meta {
 public:
-    //pointer to lru0
-    list<int64_t>::const_iterator p_last_request;
-    //any change to functions?
+    //neighbors in the lru queue, as positions in in_cache_metas. prev is more recent, next is less recent
+    uint32_t lru_prev;
+    uint32_t lru_next;
+    //last predicted score and the seq it was predicted at, 0 if none. See LRBCache::score_cache_staleness
+    float score;
+    uint32_t score_seq = 0;
 
 #ifdef EVICTION_LOGGING
 
@@ -194,141 +266,185 @@ public:
                 const uint64_t &past_timestamp,
                 const vector<uint16_t> &extra_features,
                 const uint64_t &future_timestamp,
-                const list<KeyT>::const_iterator &it) :
-            Meta(key, size, past_timestamp, extra_features, future_timestamp) {
-        p_last_request = it;
+                const LRBConfig &config) :
+            Meta(key, size, past_timestamp, extra_features, future_timestamp, config) {
     };
 #else
     InCacheMeta(const uint64_t &key,
                 const uint64_t &size,
                 const uint64_t &past_timestamp,
-                const vector<uint16_t> &extra_features, const list<int64_t>::const_iterator &it) :
-            Meta(key, size, past_timestamp, extra_features) {
-        p_last_request = it;
+                const vector<uint16_t> &extra_features,
+                const LRBConfig &config) :
+            Meta(key, size, past_timestamp, extra_features, config) {
     };
 #endif
 
-    InCacheMeta(const Meta &meta, const list<int64_t>::const_iterator &it) : Meta(meta) {
-        p_last_request = it;
+    InCacheMeta(const Meta &meta) : Meta(meta) {
     };
 
 };
 
+/*
+ * lru queue linked through the positions in in_cache_metas, so a hit only rewrites a few links instead of
+ * allocating a list node. Whoever moves a meta inside in_cache_metas must call relocate
+ */
 class InCacheLRUQueue {
 public:
-    list<int64_t> dq;
-
-    //size?
-    //the hashtable (location information is maintained outside, and assume it is always correct)
-    list<int64_t>::const_iterator request(int64_t key) {
-        dq.emplace_front(key);
-        return dq.cbegin();
+    static const uint32_t null_pos = UINT32_MAX;
+    vector<InCacheMeta> &metas;
+    //most recent
+    uint32_t head = null_pos;
+    //least recent
+    uint32_t tail = null_pos;
+
+    explicit InCacheLRUQueue(vector<InCacheMeta> &metas) : metas(metas) {}
+
+    //put metas[pos], which is not in the queue, in the front
+    void request(const uint32_t &pos) {
+        auto &meta = metas[pos];
+        meta.lru_prev = null_pos;
+        meta.lru_next = head;
+        if (head != null_pos)
+            metas[head].lru_prev = pos;
+        else
+            tail = pos;
+        head = pos;
     }
 
-    list<int64_t>::const_iterator re_request(list<int64_t>::const_iterator it) {
-        if (it != dq.cbegin()) {
-            dq.emplace_front(*it);
-            dq.erase(it);
+    void re_request(const uint32_t &pos) {
+        if (pos != head) {
+            erase(pos);
+            request(pos);
         }
-        return dq.cbegin();
+    }
+
+    void erase(const uint32_t &pos) {
+        auto &meta = metas[pos];
+        if (meta.lru_prev != null_pos)
+            metas[meta.lru_prev].lru_next = meta.lru_next;
+        else
+            head = meta.lru_next;
+        if (meta.lru_next != null_pos)
+            metas[meta.lru_next].lru_prev = meta.lru_prev;
+        else
+            tail = meta.lru_prev;
+    }
+
+    //a meta in the queue has been moved to metas[to]: point its neighbors to the new position
+    void relocate(const uint32_t &to) {
+        auto &meta = metas[to];
+        if (meta.lru_prev != null_pos)
+            metas[meta.lru_prev].lru_next = to;
+        else
+            head = to;
+        if (meta.lru_next != null_pos)
+            metas[meta.lru_next].lru_prev = to;
+        else
+            tail = to;
     }
 };
 
-class TrainingData {
+/*
+ * buffers of one rank() call, sized once for sample_rate samples, so an eviction does not allocate. Feature rows are
+ * cache line aligned, and sampled positions are de-duplicated with a small open-addressing set that is cleared by
+ * bumping its round instead of touching its slots
+ */
+class RankWorkspace {
 public:
-    vector<float> labels;
-    vector<int32_t> indptr;
-    vector<int32_t> indices;
-    vector<double> data;
-
-    TrainingData() {
-        labels.reserve(batch_size);
-        indptr.reserve(batch_size + 1);
-        indptr.emplace_back(0);
-        indices.reserve(batch_size * n_feature);
-        data.reserve(batch_size * n_feature);
-    }
+    static const size_t cache_line = 64;
 
-    void emplace_back(Meta &meta, uint32_t &sample_timestamp, uint32_t &future_interval, const uint64_t &key) {
-        int32_t counter = indptr.back();
+    struct FreeDeleter {
+        void operator()(void *p) const { free(p); }
+    };
 
-        indices.emplace_back(0);
-        data.emplace_back(sample_timestamp - meta._past_timestamp);
-        ++counter;
+    //row-major n_sample x n_feature block, only rows to predict
+    unique_ptr<float[], FreeDeleter> data;
+    vector<uint64_t> keys;
+    vector<uint32_t> poses;
+    vector<uint32_t> sizes;
+    vector<double> scores;
+    vector<double> predictions;
+    //samples without a fresh cached score, whose rows are in data
+    vector<uint32_t> predict_rows;
+    vector<uint32_t> index;
+
+    void init(const uint32_t &n_sample, const uint32_t &n_feature) {
+        size_t data_bytes = (sizeof(float) * n_sample * n_feature + cache_line - 1) / cache_line * cache_line;
+        data.reset(static_cast<float *>(aligned_alloc(cache_line, data_bytes)));
+        if (!data) {
+            throw bad_alloc();
+        }
+        keys.resize(n_sample);
+        poses.resize(n_sample);
+        sizes.resize(n_sample);
+        scores.resize(n_sample);
+        predictions.resize(n_sample);
+        predict_rows.resize(n_sample);
+        index.resize(n_sample);
+        //load factor <= 1/2
+        n_slot_bit = 1;
+        while ((1u << n_slot_bit) < 2 * n_sample)
+            ++n_slot_bit;
+        slot_pos.assign(1u << n_slot_bit, 0);
+        slot_round.assign(1u << n_slot_bit, 0);
+        round = 0;
+    }
 
-        uint32_t this_past_distance = 0;
-        int j = 0;
-        uint8_t n_within = 0;
-        if (meta._extra) {
-            for (; j < meta._extra->_past_distance_idx && j < max_n_past_distances; ++j) {
-                uint8_t past_distance_idx = (meta._extra->_past_distance_idx - 1 - j) % max_n_past_distances;
-                const uint32_t &past_distance = meta._extra->_past_distances[past_distance_idx];
-                this_past_distance += past_distance;
-                indices.emplace_back(j + 1);
-                data.emplace_back(past_distance);
-                if (this_past_distance < memory_window) {
-                    ++n_within;
-                }
-            }
+    //forget the positions sampled so far
+    void new_round() {
+        if (!++round) {
+            fill(slot_round.begin(), slot_round.end(), 0);
+            round = 1;
         }
+    }
 
-        counter += j;
+    //false if pos was already sampled in this round
+    bool insert(const uint32_t &pos) {
+        const uint32_t mask = (1u << n_slot_bit) - 1;
+        //Fibonacci hashing: the high bits of the product are well mixed
+        uint32_t i = static_cast<uint32_t>((pos * UINT64_C(11400714819323198485)) >> (64 - n_slot_bit));
+        for (; slot_round[i] == round; i = (i + 1) & mask) {
+            if (slot_pos[i] == pos)
+                return false;
+        }
+        slot_round[i] = round;
+        slot_pos[i] = pos;
+        return true;
+    }
 
-        indices.emplace_back(max_n_past_timestamps);
-        data.push_back(meta._size);
-        ++counter;
+private:
+    uint32_t n_slot_bit = 0;
+    vector<uint32_t> slot_pos;
+    vector<uint32_t> slot_round;
+    uint32_t round = 0;
+};
 
-        for (int k = 0; k < n_extra_fields; ++k) {
-            indices.push_back(max_n_past_timestamps + k + 1);
-            data.push_back(meta._extra_features[k]);
-        }
-        counter += n_extra_fields;
-
-        indices.push_back(max_n_past_timestamps + n_extra_fields + 1);
-        data.push_back(n_within);
-        ++counter;
-
-        if (meta._extra) {
-            for (int k = 0; k < n_edc_feature; ++k) {
-                indices.push_back(max_n_past_timestamps + n_extra_fields + 2 + k);
-                uint32_t _distance_idx = std::min(
-                        uint32_t(sample_timestamp - meta._past_timestamp) / edc_windows[k],
-                        max_hash_edc_idx);
-                data.push_back(meta._extra->_edc[k] * hash_edc[_distance_idx]);
-            }
-        } else {
-            for (int k = 0; k < n_edc_feature; ++k) {
-                indices.push_back(max_n_past_timestamps + n_extra_fields + 2 + k);
-                uint32_t _distance_idx = std::min(
-                        uint32_t(sample_timestamp - meta._past_timestamp) / edc_windows[k],
-                        max_hash_edc_idx);
-                data.push_back(hash_edc[_distance_idx]);
-            }
-        }
+class TrainingData {
+public:
+    const LRBConfig &config;
+    vector<float> labels;
+    //row-major, n_feature per row
+    vector<float> data;
 
-        counter += n_edc_feature;
+    explicit TrainingData(const LRBConfig &config) : config(config) {
+        labels.reserve(config.batch_size);
+        data.reserve(config.batch_size * config.n_feature);
+    }
 
+    void emplace_back(Meta &meta, uint32_t &sample_timestamp, uint32_t &future_interval, const uint64_t &key) {
+        auto row_begin = data.size();
+        data.resize(row_begin + config.n_feature);
+        meta.features(sample_timestamp, &data[row_begin], config);
         labels.push_back(log1p(future_interval));
-        indptr.push_back(counter);
-
 
 #ifdef EVICTION_LOGGING
-        if ((current_seq >= n_logging_start) && !start_train_logging && (indptr.size() == 2)) {
+        if ((logging_seq >= n_logging_start) && !start_train_logging && (labels.size() == 1)) {
             start_train_logging = true;
         }
 
         if (start_train_logging) {
-//            training_and_prediction_logic_timestamps.emplace_back(current_seq / 65536);
-            int i = indptr.size() - 2;
-            int current_idx = indptr[i];
-            for (int p = 0; p < n_feature; ++p) {
-                if (p == indices[current_idx]) {
-                    trainings_and_predictions.emplace_back(data[current_idx]);
-                    if (current_idx + 1 < indptr[i + 1])
-                        ++current_idx;
-                } else
-                    trainings_and_predictions.emplace_back(NAN);
-            }
+//            training_and_prediction_logic_timestamps.emplace_back(logging_seq / 65536);
+            trainings_and_predictions.insert(trainings_and_predictions.end(), data.begin() + row_begin, data.end());
             trainings_and_predictions.emplace_back(future_interval);
             trainings_and_predictions.emplace_back(NAN);
             trainings_and_predictions.emplace_back(sample_timestamp);
@@ -336,13 +452,10 @@ public:
             trainings_and_predictions.emplace_back(key);
         }
 #endif
-
     }
 
     void clear() {
         labels.clear();
-        indptr.resize(1);
-        indices.clear();
         data.clear();
     }
 };
@@ -350,107 +463,35 @@ public:
 #ifdef EVICTION_LOGGING
 class LRBEvictionTrainingData {
 public:
+    const LRBConfig &config;
     vector<float> labels;
-    vector<int32_t> indptr;
-    vector<int32_t> indices;
-    vector<double> data;
-
-    LRBEvictionTrainingData() {
-        labels.reserve(batch_size);
-        indptr.reserve(batch_size + 1);
-        indptr.emplace_back(0);
-        indices.reserve(batch_size * n_feature);
-        data.reserve(batch_size * n_feature);
+    //row-major, n_feature per row
+    vector<float> data;
+
+    explicit LRBEvictionTrainingData(const LRBConfig &config) : config(config) {
+        labels.reserve(config.batch_size);
+        data.reserve(config.batch_size * config.n_feature);
     }
 
     void emplace_back(Meta &meta, uint32_t &sample_timestamp, uint32_t &future_interval, const uint64_t &key) {
-        int32_t counter = indptr.back();
-
-        indices.emplace_back(0);
-        data.emplace_back(sample_timestamp - meta._past_timestamp);
-        ++counter;
-
-        uint32_t this_past_distance = 0;
-        int j = 0;
-        uint8_t n_within = 0;
-        if (meta._extra) {
-            for (; j < meta._extra->_past_distance_idx && j < max_n_past_distances; ++j) {
-                uint8_t past_distance_idx = (meta._extra->_past_distance_idx - 1 - j) % max_n_past_distances;
-                const uint32_t &past_distance = meta._extra->_past_distances[past_distance_idx];
-                this_past_distance += past_distance;
-                indices.emplace_back(j + 1);
-                data.emplace_back(past_distance);
-                if (this_past_distance < memory_window) {
-                    ++n_within;
-                }
-            }
-        }
-
-        counter += j;
-
-        indices.emplace_back(max_n_past_timestamps);
-        data.push_back(meta._size);
-        ++counter;
-
-        for (int k = 0; k < n_extra_fields; ++k) {
-            indices.push_back(max_n_past_timestamps + k + 1);
-            data.push_back(meta._extra_features[k]);
-        }
-        counter += n_extra_fields;
-
-        indices.push_back(max_n_past_timestamps + n_extra_fields + 1);
-        data.push_back(n_within);
-        ++counter;
-
-        if (meta._extra) {
-            for (int k = 0; k < n_edc_feature; ++k) {
-                indices.push_back(max_n_past_timestamps + n_extra_fields + 2 + k);
-                uint32_t _distance_idx = std::min(
-                        uint32_t(sample_timestamp - meta._past_timestamp) / edc_windows[k],
-                        max_hash_edc_idx);
-                data.push_back(meta._extra->_edc[k] * hash_edc[_distance_idx]);
-            }
-        } else {
-            for (int k = 0; k < n_edc_feature; ++k) {
-                indices.push_back(max_n_past_timestamps + n_extra_fields + 2 + k);
-                uint32_t _distance_idx = std::min(
-                        uint32_t(sample_timestamp - meta._past_timestamp) / edc_windows[k],
-                        max_hash_edc_idx);
-                data.push_back(hash_edc[_distance_idx]);
-            }
-        }
-
-        counter += n_edc_feature;
-
+        auto row_begin = data.size();
+        data.resize(row_begin + config.n_feature);
+        meta.features(sample_timestamp, &data[row_begin], config);
         labels.push_back(log1p(future_interval));
-        indptr.push_back(counter);
-
 
         if (start_train_logging) {
 //            training_and_prediction_logic_timestamps.emplace_back(current_seq / 65536);
-            int i = indptr.size() - 2;
-            int current_idx = indptr[i];
-            for (int p = 0; p < n_feature; ++p) {
-                if (p == indices[current_idx]) {
-                    trainings_and_predictions.emplace_back(data[current_idx]);
-                    if (current_idx + 1 < indptr[i + 1])
-                        ++current_idx;
-                } else
-                    trainings_and_predictions.emplace_back(NAN);
-            }
+            trainings_and_predictions.insert(trainings_and_predictions.end(), data.begin() + row_begin, data.end());
             trainings_and_predictions.emplace_back(future_interval);
             trainings_and_predictions.emplace_back(NAN);
             trainings_and_predictions.emplace_back(sample_timestamp);
             trainings_and_predictions.emplace_back(2);
             trainings_and_predictions.emplace_back(key);
         }
-
     }
 
     void clear() {
         labels.clear();
-        indptr.resize(1);
-        indices.clear();
         data.clear();
     }
 };
@@ -464,14 +505,21 @@ struct KeyMapEntryT {
 
 class LRBCache : public Cache {
 public:
+    //fixed after init_with_params
+    LRBConfig config;
+    //requests seen so far, minus 1
+    uint32_t current_seq = -1;
     //key -> (0/1 list, idx)
     sparse_hash_map<uint64_t, KeyMapEntryT> key_map;
 //    vector<Meta> meta_holder[2];
     vector<InCacheMeta> in_cache_metas;
     vector<Meta> out_cache_metas;
+    //key -> times the object was sampled for training, waiting for the label
+    sparse_hash_map<uint64_t, vector<uint32_t>> sample_times;
 
-    InCacheLRUQueue in_cache_lru_queue;
-    shared_ptr<sparse_hash_map<uint64_t, uint64_t>> negative_candidate_queue;
+    InCacheLRUQueue in_cache_lru_queue{in_cache_metas};
+    //forget table: past timestamp -> position in out_cache_metas
+    TimerWheel negative_candidate_queue;
     TrainingData *training_data;
 #ifdef EVICTION_LOGGING
     LRBEvictionTrainingData *eviction_training_data;
@@ -479,6 +527,46 @@ public:
 
     // sample_size: use n_memorize keys + random choose (sample_rate - n_memorize) keys
     uint sample_rate = 64;
+    //evict up to this many of the best ranked samples per inference, as long as more space is needed
+    uint max_evictions_per_inference = 1;
+    //(key, pos) in eviction order, filled by rank(). Only the 1st pos is reliable, evictions move metas
+    vector<pair<uint64_t, uint32_t>> victims;
+    RankWorkspace rank_workspace;
+    //rank() calls that used the model, and the evictions they decided
+    int64_t n_inference = 0;
+    int64_t n_inference_eviction = 0;
+    //reuse a sample's score for up to this many requests, adjusted for the time passed. 0 disables the score cache
+    uint32_t score_cache_staleness = 0;
+    //seq of the last model swap, scores predicted before are void
+    uint32_t model_seq = 0;
+    int64_t n_score_lookup = 0;
+    int64_t n_score_hit = 0;
+
+    /*
+     * window_tuning: shadow LRB caches at window_tuning_n_candidate log-spaced windows (window_tuning_factor apart,
+     * centered on the initial memory_window) simulate a spatial sample of the requests, with the cache size, windows
+     * and batch size scaled by window_tuning_sample_rate. Every window_tuning_segment requests, once all shadows have a
+     * model, the live memory_window moves one candidate toward the shadow with the lowest smoothed byte miss ratio
+     */
+    bool window_tuning = false;
+    double window_tuning_sample_rate = 0.01;
+    uint32_t window_tuning_n_candidate = 5;
+    double window_tuning_factor = 2;
+    uint32_t window_tuning_segment = 1000000;
+    //a smaller shadow holds too few objects for its eviction samples to say much about the window
+    static constexpr uint64_t window_tuning_min_shadow_size = 1 << 20;
+    unique_ptr<SpatialSampler> window_tuning_sampler;
+    vector<unique_ptr<LRBCache>> window_tuning_shadows;
+    //live scale, increasing
+    vector<uint32_t> window_tuning_candidates;
+    //index of the live memory_window in window_tuning_candidates
+    uint32_t window_tuning_idx = 0;
+    //per shadow, exponentially smoothed over segments. Negative before the 1st decision
+    vector<double> window_tuning_byte_miss_ratio;
+    vector<uint64_t> window_tuning_segment_byte_miss;
+    uint64_t window_tuning_segment_byte_req = 0;
+    //(seq, new memory_window) of every change
+    vector<pair<uint32_t, uint32_t>> window_tuning_changes;
 
     double training_loss = 0;
     int32_t n_force_eviction = 0;
@@ -487,6 +575,26 @@ public:
     double inference_time = 0;
 
     BoosterHandle booster = nullptr;
+    //booster compiled for rank(), scoring the samples much faster than LGBM_BoosterPredictForCSR
+    CompiledForest forest;
+
+    /*
+     * async_training: a full batch is swapped out and trained on a background thread while requests keep using the
+     * current model. The new model is installed exactly async_training_delay requests after the batch closed, so
+     * results do not depend on the training speed; the request path only waits if training is not done by then.
+     */
+    bool async_training = false;
+    uint32_t async_training_delay = 65536;
+    TrainingData *background_training_data = nullptr;
+    std::thread training_thread;
+    BoosterHandle background_booster = nullptr;
+    double background_se = 0;
+    double background_training_time = 0;
+    //valid while training_thread is joinable
+    uint32_t model_install_seq = 0;
+    //model the batch in fit() starts from, empty to fit from scratch. The head trees go in front of it
+    string background_init_model;
+    string background_init_head;
 
     unordered_map<string, string> training_params = {
             //don't use alias here. C api may not recongize
@@ -509,13 +617,23 @@ public:
     };
     ObjectiveT objective = byte_miss_ratio;
 
+    /*
+     * how a batch updates the model. scratch: fit a new model. incremental: boost num_iterations more trees on top of
+     * the model, after dropping its oldest trees beyond max_n_tree. refit: keep the trees, only refit their leaf values
+     */
+    enum TrainingModeT : uint8_t {
+        scratch = 0, incremental = 1, refit = 2
+    };
+    TrainingModeT training_mode = scratch;
+    uint32_t max_n_tree = 128;
+
     default_random_engine _generator = default_random_engine();
     uniform_int_distribution<std::size_t> _distribution = uniform_int_distribution<std::size_t>();
 
     vector<int> segment_n_in;
     vector<int> segment_n_out;
-    uint32_t obj_distribution[2];
-    uint32_t training_data_distribution[2];  //1: pos, 0: neg
+    uint32_t obj_distribution[2] = {0, 0};
+    uint32_t training_data_distribution[2] = {0, 0};  //1: pos, 0: neg
     vector<float> segment_positive_example_ratio;
     vector<double> segment_percent_beyond;
     int n_retrain = 0;
@@ -537,19 +655,32 @@ public:
     vector<int64_t> far_bytes;
 #endif
 
+    ~LRBCache() override {
+        if (training_thread.joinable())
+            training_thread.join();
+    }
+
     void init_with_params(const map<string, string> &params) override {
         //set params
         for (auto &it: params) {
             if (it.first == "sample_rate") {
                 sample_rate = stoul(it.second);
+            } else if (it.first == "max_evictions_per_inference") {
+                max_evictions_per_inference = stoul(it.second);
+            } else if (it.first == "score_cache_staleness") {
+                score_cache_staleness = stoul(it.second);
+            } else if (it.first == "async_training") {
+                async_training = static_cast<bool>(stoi(it.second));
+            } else if (it.first == "async_training_delay") {
+                async_training_delay = stoul(it.second);
             } else if (it.first == "memory_window") {
-                memory_window = stoull(it.second);
+                config.memory_window = stoull(it.second);
             } else if (it.first == "max_n_past_timestamps") {
-                max_n_past_timestamps = (uint8_t) stoi(it.second);
+                config.max_n_past_timestamps = (uint8_t) stoi(it.second);
             } else if (it.first == "batch_size") {
-                batch_size = stoull(it.second);
+                config.batch_size = stoull(it.second);
             } else if (it.first == "n_extra_fields") {
-                n_extra_fields = stoull(it.second);
+                config.n_extra_fields = stoull(it.second);
             } else if (it.first == "num_iterations") {
                 training_params["num_iterations"] = it.second;
             } else if (it.first == "learning_rate") {
@@ -589,40 +720,82 @@ public:
                     cerr << "error: unknown objective" << endl;
                     exit(-1);
                 }
+            } else if (it.first == "training_mode") {
+                if (it.second == "scratch")
+                    training_mode = scratch;
+                else if (it.second == "incremental")
+                    training_mode = incremental;
+                else if (it.second == "refit")
+                    training_mode = refit;
+                else {
+                    cerr << "error: unknown training_mode" << endl;
+                    exit(-1);
+                }
+            } else if (it.first == "max_n_tree") {
+                max_n_tree = stoul(it.second);
+            } else if (it.first == "window_tuning") {
+                window_tuning = static_cast<bool>(stoi(it.second));
+            } else if (it.first == "window_tuning_sample_rate") {
+                window_tuning_sample_rate = stod(it.second);
+            } else if (it.first == "window_tuning_n_candidate") {
+                window_tuning_n_candidate = stoul(it.second);
+            } else if (it.first == "window_tuning_factor") {
+                window_tuning_factor = stod(it.second);
+            } else if (it.first == "window_tuning_segment") {
+                window_tuning_segment = stoul(it.second);
             } else {
                 cerr << "LRB unrecognized parameter: " << it.first << endl;
             }
         }
 
-        negative_candidate_queue = make_shared<sparse_hash_map<uint64_t, uint64_t>>(memory_window);
-        max_n_past_distances = max_n_past_timestamps - 1;
-        //init
-        edc_windows = vector<uint32_t>(n_edc_feature);
-        for (uint8_t i = 0; i < n_edc_feature; ++i) {
-            edc_windows[i] = pow(2, base_edc_window + i);
+        if (config.max_n_past_timestamps < 2 || config.max_n_past_timestamps > max_n_past_distances_capacity + 1) {
+            cerr << "error: only support 2 ~ " + to_string(max_n_past_distances_capacity + 1)
+                    + " past timestamps because of static allocation" << endl;
+            abort();
         }
-        set_hash_edc();
-
-        //interval, distances, size, extra_features, n_past_intervals, edwt
-        n_feature = max_n_past_timestamps + n_extra_fields + 2 + n_edc_feature;
-        if (n_extra_fields) {
-            if (n_extra_fields > max_n_extra_feature) {
+        negative_candidate_queue = TimerWheel(config.memory_window);
+        config.init();
+        if (config.n_extra_fields) {
+            if (config.n_extra_fields > max_n_extra_feature) {
                 cerr << "error: only support <= " + to_string(max_n_extra_feature)
                         + " extra fields because of static allocation" << endl;
                 abort();
             }
-            string categorical_feature = to_string(max_n_past_timestamps + 1);
-            for (uint i = 0; i < n_extra_fields - 1; ++i) {
-                categorical_feature += "," + to_string(max_n_past_timestamps + 2 + i);
+            string categorical_feature = to_string(config.max_n_past_timestamps + 1);
+            for (uint i = 0; i < config.n_extra_fields - 1; ++i) {
+                categorical_feature += "," + to_string(config.max_n_past_timestamps + 2 + i);
             }
             training_params["categorical_feature"] = categorical_feature;
         }
         inference_params = training_params;
         //can set number of threads, however the inference time will increase a lot (2x~3x) if use 1 thread
 //        inference_params["num_threads"] = "4";
-        training_data = new TrainingData();
+        if (!max_evictions_per_inference || max_evictions_per_inference > sample_rate) {
+            throw invalid_argument("error: max_evictions_per_inference must be in 1 ~ sample_rate");
+        }
+        if (training_mode == incremental && max_n_tree <= stoul(training_params["num_iterations"])) {
+            throw invalid_argument("error: max_n_tree must be > num_iterations");
+        }
+        victims.reserve(max_evictions_per_inference);
+        rank_workspace.init(sample_rate, config.n_feature);
+        if (window_tuning) {
+            init_window_tuning(params);
+        }
+#ifdef EVICTION_LOGGING
+        if (score_cache_staleness || window_tuning) {
+            throw invalid_argument("error: score_cache_staleness and window_tuning not supported with "
+                                   "EVICTION_LOGGING");
+        }
+#endif
+        training_data = new TrainingData(config);
+        if (async_training) {
+            if (!async_training_delay) {
+                throw invalid_argument("error: async_training_delay must be positive");
+            }
+            background_training_data = new TrainingData(config);
+        }
 #ifdef EVICTION_LOGGING
-        eviction_training_data = new LRBEvictionTrainingData();
+        eviction_training_data = new LRBEvictionTrainingData(config);
 #endif
 
 #ifdef EVICTION_LOGGING
@@ -639,28 +812,55 @@ public:
 
     void admit(const SimpleRequest &req) override;
 
+    //free space with one rank() call
     void evict();
 
+    void evict(const uint64_t &key, const uint32_t &old_pos);
+
     void forget();
 
-    //sample, rank the 1st and return
-    pair<uint64_t, uint32_t> rank();
+    //forget out_cache_metas[pos], labelling its pending samples as beyond the memory window
+    void forget(uint32_t pos);
 
+    //create the shadow caches, with params minus the window_tuning ones
+    void init_window_tuning(const map<string, string> &params);
+
+    //feed req to the shadows if sampled, and move memory_window at the end of each segment
+    void tune_window(const SimpleRequest &req);
+
+    //forget out of cache metadata beyond the new window, and rebuild the forget table
+    void set_memory_window(const uint32_t &memory_window);
+
+    //fill victims: the LRU tail, or the best samples ranked by the model. Returns whether the model was used
+    bool rank();
+
+    //train on the full training_data batch and clear it, in the background if async_training
     void train();
 
+    //fit background_booster on data. Only reads state fixed after init_with_params and background_init_model, so it can
+    //run in the background
+    void fit(TrainingData *data);
+
+    //wait for the background training and replace the model
+    void install_model();
+
+    //text model of n_iteration trees (-1: all) of booster from start_iteration on, in LightGBM text format
+    string model_to_string(const int &start_iteration = 0, const int &n_iteration = -1) const;
+
     void sample();
 
     void update_stat_periodic() override;
 
-    static void set_hash_edc() {
-        max_hash_edc_idx = (uint64_t) (memory_window / pow(2, base_edc_window)) - 1;
-        hash_edc = vector<double>(max_hash_edc_idx + 1);
-        for (int i = 0; i < hash_edc.size(); ++i)
-            hash_edc[i] = pow(0.5, i);
-    }
-
     void remove_from_outcache_metas(Meta &meta, unsigned int &pos, const uint64_t &key);
 
+    /*
+     * checkpoint metadata with its lru links, pending training data, the model and counters. key_map and the forget
+     * table are rebuilt from the metadata. memory_window, max_n_past_timestamps and n_extra_fields must not change
+     */
+    void serialize(std::ostream &os) override;
+
+    void deserialize(std::istream &is) override;
+
     bool has(const uint64_t &id) {
         auto it = key_map.find(id);
         if (it == key_map.end())
@@ -672,21 +872,58 @@ public:
         int64_t feature_overhead = 0;
         int64_t sample_overhead = 0;
         for (auto &m: in_cache_metas) {
-            feature_overhead += m.feature_overhead();
-            sample_overhead += m.sample_overhead();
+            //plus the lru position and cached score
+            feature_overhead += m.feature_overhead() + sizeof(InCacheMeta) - sizeof(Meta);
         }
         for (auto &m: out_cache_metas) {
             feature_overhead += m.feature_overhead();
-            sample_overhead += m.sample_overhead();
+        }
+        for (auto &it: sample_times) {
+            sample_overhead += sizeof(it) + sizeof(uint32_t) * it.second.capacity();
         }
 
         doc.append(kvp("n_metadata", static_cast<int32_t>(key_map.size())));
         doc.append(kvp("feature_overhead", feature_overhead));
         doc.append(kvp("sample_overhead", sample_overhead));
+        doc.append(kvp("metadata_bytes_per_object",
+                       key_map.empty() ? 0. : static_cast<double>(feature_overhead + sample_overhead) /
+                                              key_map.size()));
         doc.append(kvp("n_force_eviction", n_force_eviction));
+        doc.append(kvp("training_mode", static_cast<int32_t>(training_mode)));
+        doc.append(kvp("training_time", training_time));
+        doc.append(kvp("training_loss", training_loss));
+        doc.append(kvp("memory_window", static_cast<int64_t>(config.memory_window)));
+        if (window_tuning) {
+            doc.append(kvp("window_tuning_candidates", [this](sub_array child) {
+                for (const auto &element : window_tuning_candidates)
+                    child.append(static_cast<int64_t>(element));
+            }));
+            doc.append(kvp("window_tuning_byte_miss_ratio", [this](sub_array child) {
+                for (const auto &element : window_tuning_byte_miss_ratio)
+                    child.append(element);
+            }));
+            doc.append(kvp("window_tuning_change_seq", [this](sub_array child) {
+                for (const auto &element : window_tuning_changes)
+                    child.append(static_cast<int64_t>(element.first));
+            }));
+            doc.append(kvp("window_tuning_change_memory_window", [this](sub_array child) {
+                for (const auto &element : window_tuning_changes)
+                    child.append(static_cast<int64_t>(element.second));
+            }));
+        }
+        if (booster) {
+            int n_tree;
+            LGBM_BoosterGetCurrentIteration(booster, &n_tree);
+            doc.append(kvp("n_tree", n_tree));
+        }
+        doc.append(kvp("n_inference", n_inference));
+        doc.append(kvp("evictions_per_inference",
+                       n_inference ? static_cast<double>(n_inference_eviction) / n_inference : 0.));
+        doc.append(kvp("score_cache_hit_rate",
+                       n_score_lookup ? static_cast<double>(n_score_hit) / n_score_lookup : 0.));
 
         int res;
-        auto importances = vector<double>(n_feature, 0);
+        auto importances = vector<double>(config.n_feature, 0);
 
         if (booster) {
             res = LGBM_BoosterFeatureImportance(booster,
@@ -777,19 +1014,19 @@ public:
     }
 
     vector<int> get_object_distribution_n_past_timestamps() {
-        vector<int> distribution(max_n_past_timestamps, 0);
+        vector<int> distribution(config.max_n_past_timestamps, 0);
         for (auto &meta: in_cache_metas) {
             if (nullptr == meta._extra) {
                 ++distribution[0];
             } else {
-                ++distribution[meta._extra->_past_distances.size()];
+                ++distribution[meta._extra->n_past_distances(config)];
             }
         }
         for (auto &meta: out_cache_metas) {
             if (nullptr == meta._extra) {
                 ++distribution[0];
             } else {
-                ++distribution[meta._extra->_past_distances.size()];
+                ++distribution[meta._extra->n_past_distances(config)];
             }
         }
         return distribution;
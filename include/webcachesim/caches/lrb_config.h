@@ -0,0 +1,53 @@
+//
+// Feature configuration of one LRB instance.
+//
+
+#ifndef WEBCACHESIM_LRB_CONFIG_H
+#define WEBCACHESIM_LRB_CONFIG_H
+
+#include <cstdint>
+#include <cmath>
+#include <vector>
+
+/*
+ * feature layout and the edc tables derived from it, owned by one cache so caches with different windows can coexist.
+ * Set by init_with_params. Afterwards only the cache's request path may change memory_window (window tuning), and then
+ * only init_edc() runs again: background training reads n_feature, which is never written after init()
+ */
+struct LRBConfig {
+    static constexpr uint8_t n_edc_feature = 10;
+    static constexpr uint32_t max_n_extra_feature = 4;
+
+    uint8_t max_n_past_timestamps = 32;
+    uint8_t max_n_past_distances = 31;
+    uint8_t base_edc_window = 10;
+    std::vector<uint32_t> edc_windows;
+    std::vector<double> hash_edc;
+    uint32_t max_hash_edc_idx = 0;
+    uint32_t memory_window = 67108864;
+    uint32_t n_extra_fields = 0;
+    uint32_t batch_size = 131072;
+    uint32_t n_feature = 0;
+
+    //derive the rest from max_n_past_timestamps, base_edc_window, memory_window and n_extra_fields
+    void init() {
+        max_n_past_distances = max_n_past_timestamps - 1;
+        init_edc();
+        //interval, distances, size, extra_features, n_past_intervals, edwt
+        n_feature = max_n_past_timestamps + n_extra_fields + 2 + n_edc_feature;
+    }
+
+    //edc tables only, from base_edc_window and memory_window. Called again when memory_window changes
+    void init_edc() {
+        edc_windows = std::vector<uint32_t>(n_edc_feature);
+        for (uint8_t i = 0; i < n_edc_feature; ++i) {
+            edc_windows[i] = pow(2, base_edc_window + i);
+        }
+        max_hash_edc_idx = (uint64_t) (memory_window / pow(2, base_edc_window)) - 1;
+        hash_edc = std::vector<double>(max_hash_edc_idx + 1);
+        for (int i = 0; i < hash_edc.size(); ++i)
+            hash_edc[i] = pow(0.5, i);
+    }
+};
+
+#endif //WEBCACHESIM_LRB_CONFIG_H
@@ -0,0 +1,120 @@
+//
+// One-pass exact LRU miss ratio curve.
+//
+
+#ifndef WEBCACHESIM_LRU_MRC_H
+#define WEBCACHESIM_LRU_MRC_H
+
+#include "cache.h"
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+using namespace webcachesim;
+
+/*
+ * LRU is a stack algorithm: a request hits in an LRU cache of size C iff its stack distance, the total size of the
+ * distinct objects requested since the last request to the same object (including itself), is at most C. Stack
+ * distances are computed in O(log n) with Fenwick trees over last access positions, both in bytes (caches sized in
+ * bytes) and in objects (caches sized in number of objects).
+ *
+ * lookup() answers as LRU of _cacheSize, so the usual segment_* results are those of LRU. In addition, update_stat()
+ * reports the miss curve for every cache size in geometric steps of mrc_bins_per_octave per power of two:
+ * - mrc_cache_size, mrc_segment_byte_miss, mrc_segment_object_miss: cache sized in bytes
+ * - mrc_n_object, mrc_object_segment_byte_miss, mrc_object_segment_object_miss: cache sized in objects
+ * where the i-th element of a *_segment_* array holds the per segment misses of the i-th cache size.
+ *
+ * An object larger than a cache size is counted in the stack of that size, while LRU would not admit it. The curve
+ * is exact for cache sizes at least as large as the largest object.
+ */
+class LRUMRCCache : public Cache {
+public:
+    bool lookup(const SimpleRequest &req) override;
+
+    //nothing to admit: contents of every cache size are implied by the stack
+    void admit(const SimpleRequest &req) override {}
+
+    void init_with_params(const map<string, string> &params) override;
+
+    void update_stat_periodic() override;
+
+    void update_stat(bsoncxx::builder::basic::document &doc) override;
+
+    size_t memory_overhead() override {
+        return last_access.size() * (sizeof(uint64_t) + sizeof(LastAccess)) +
+               byte_tree.size() * 2 * sizeof(int64_t) + Cache::memory_overhead();
+    }
+
+private:
+    struct LastAccess {
+        uint64_t pos;
+        uint64_t size;
+    };
+
+    //Fenwick tree over positions of last accesses, one entry per request position
+    class FenwickTree {
+    public:
+        void reset(const size_t &n) {
+            tree.assign(n + 1, 0);
+        }
+
+        void add(size_t i, const int64_t &v) {
+            for (++i; i < tree.size(); i += i & (~i + 1))
+                tree[i] += v;
+        }
+
+        //sum of [0, i]
+        int64_t prefix(size_t i) const {
+            int64_t s = 0;
+            for (++i; i; i -= i & (~i + 1))
+                s += tree[i];
+            return s;
+        }
+
+        size_t size() const { return tree.size(); }
+
+    private:
+        vector<int64_t> tree;
+    };
+
+    //misses of each cache size, per segment: hist[size idx] = {byte miss, object miss}
+    struct Histogram {
+        vector<int64_t> byte_miss;
+        vector<int64_t> object_miss;
+        int64_t cold_byte_miss = 0, cold_object_miss = 0;
+
+        void add(const size_t &bin, const int64_t &size) {
+            if (bin >= byte_miss.size()) {
+                byte_miss.resize(bin + 1, 0);
+                object_miss.resize(bin + 1, 0);
+            }
+            byte_miss[bin] += size;
+            ++object_miss[bin];
+        }
+    };
+
+    uint mrc_bins_per_octave = 8;
+    vector<uint64_t> bin_boundaries;
+
+    unordered_map<uint64_t, LastAccess> last_access;
+    FenwickTree byte_tree, object_tree;
+    int64_t total_bytes = 0;
+    uint64_t next_pos = 0;
+
+    Histogram byte_hist, object_hist;
+    //finished segments
+    vector<Histogram> byte_segments, object_segments;
+
+    //smallest bin whose cache size is at least distance
+    size_t bin_of(const uint64_t &distance) const;
+
+    //renumber live positions to 0..n-1 when the trees are full
+    void compact();
+
+    void append_curve(bsoncxx::builder::basic::document &doc, const string &size_key, const string &byte_miss_key,
+                      const string &object_miss_key, const vector<Histogram> &segments) const;
+};
+
+static Factory<LRUMRCCache> factoryLRUMRC("LRUMRC");
+
+#endif //WEBCACHESIM_LRU_MRC_H
@@ -115,6 +115,10 @@ public:
     void evict();
 
     SimpleRequest evict_return();
+
+    void serialize(std::ostream &os) override;
+
+    void deserialize(std::istream &is) override;
 };
 
 static Factory<LRUCache> factoryLRU("LRU");
@@ -214,6 +218,15 @@ public:
     virtual bool lookup(const SimpleRequest &);
     virtual void admit(const SimpleRequest &);
 
+    //the admission model is not checkpointed
+    void serialize(std::ostream &os) override {
+        throw runtime_error("Error: serialize() function not implemented");
+    }
+
+    void deserialize(std::istream &is) override {
+        throw runtime_error("Error: deserialize() function not implemented");
+    }
+
 private:
     double _cParam; //
     uint64_t statSize;
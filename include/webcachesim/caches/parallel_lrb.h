@@ -7,6 +7,9 @@
 
 
 #include "parallel_cache.h"
+#include "timer_wheel.h"
+#include "lrb_config.h"
+#include "compiled_forest.h"
 #include <atomic>
 #include <unordered_map>
 #include <vector>
@@ -20,6 +23,7 @@
 #include <queue>
 #include <shared_mutex>
 #include <list>
+#include <memory>
 #include "sparsepp/sparsepp/spp.h"
 
 using namespace webcachesim;
@@ -29,19 +33,10 @@ typedef uint64_t LRBKey;
 using bsoncxx::builder::basic::kvp;
 using bsoncxx::builder::basic::sub_array;
 
+//only constants here: the configuration lives in each ParallelLRBCache, see LRBConfig
 namespace ParallelLRB {
-    uint8_t max_n_past_timestamps = 32;
-    uint8_t max_n_past_distances = 31;
-    uint8_t base_edc_window = 10;
-    const uint8_t n_edc_feature = 10;
-    vector<uint32_t> edc_windows;
-    vector<double> hash_edc;
-    uint32_t max_hash_edc_idx;
-    uint32_t memory_window = 67108864;
-    uint32_t n_extra_fields = 0;
-    uint32_t batch_size = 131072;
-    const uint max_n_extra_feature = 4;
-    uint32_t n_feature;
+    const uint8_t n_edc_feature = LRBConfig::n_edc_feature;
+    const uint max_n_extra_feature = LRBConfig::max_n_extra_feature;
 }
 
 struct ParalllelLRBMetaExtra {
@@ -52,29 +47,29 @@ struct ParalllelLRBMetaExtra {
     //the next index to put the distance
     uint8_t _past_distance_idx = 1;
 
-    ParalllelLRBMetaExtra(const uint32_t &distance) {
+    ParalllelLRBMetaExtra(const uint32_t &distance, const LRBConfig &config) {
         _past_distances = vector<uint32_t>(1, distance);
         for (uint8_t i = 0; i < ParallelLRB::n_edc_feature; ++i) {
-            uint32_t _distance_idx = min(uint32_t(distance / ParallelLRB::edc_windows[i]),
-                                         ParallelLRB::max_hash_edc_idx);
-            _edc[i] = ParallelLRB::hash_edc[_distance_idx] + 1;
+            uint32_t _distance_idx = min(uint32_t(distance / config.edc_windows[i]),
+                                         config.max_hash_edc_idx);
+            _edc[i] = config.hash_edc[_distance_idx] + 1;
         }
     }
 
-    void update(const uint32_t &distance) {
-        uint8_t distance_idx = _past_distance_idx % ParallelLRB::max_n_past_distances;
-        if (_past_distances.size() < ParallelLRB::max_n_past_distances)
+    void update(const uint32_t &distance, const LRBConfig &config) {
+        uint8_t distance_idx = _past_distance_idx % config.max_n_past_distances;
+        if (_past_distances.size() < config.max_n_past_distances)
             _past_distances.emplace_back(distance);
         else
             _past_distances[distance_idx] = distance;
-        assert(_past_distances.size() <= ParallelLRB::max_n_past_distances);
+        assert(_past_distances.size() <= config.max_n_past_distances);
         _past_distance_idx = _past_distance_idx + (uint8_t) 1;
-        if (_past_distance_idx >= ParallelLRB::max_n_past_distances * 2)
-            _past_distance_idx -= ParallelLRB::max_n_past_distances;
+        if (_past_distance_idx >= config.max_n_past_distances * 2)
+            _past_distance_idx -= config.max_n_past_distances;
         for (uint8_t i = 0; i < ParallelLRB::n_edc_feature; ++i) {
-            uint32_t _distance_idx = min(uint32_t(distance / ParallelLRB::edc_windows[i]),
-                                         ParallelLRB::max_hash_edc_idx);
-            _edc[i] = _edc[i] * ParallelLRB::hash_edc[_distance_idx] + 1;
+            uint32_t _distance_idx = min(uint32_t(distance / config.edc_windows[i]),
+                                         config.max_hash_edc_idx);
+            _edc[i] = _edc[i] * config.hash_edc[_distance_idx] + 1;
         }
     }
 };
@@ -91,11 +86,11 @@ public:
 
 
     ParallelLRBMeta(const uint64_t &key, const uint64_t &size, const uint64_t &past_timestamp,
-                    const uint16_t *&extra_features) {
+                    const uint16_t *&extra_features, const LRBConfig &config) {
         _key = key;
         _size = size;
         _past_timestamp = past_timestamp;
-        for (int i = 0; i < ParallelLRB::n_extra_fields; ++i)
+        for (int i = 0; i < config.n_extra_fields; ++i)
             _extra_features[i] = extra_features[i];
     }
 
@@ -109,14 +104,14 @@ public:
         delete _extra;
     }
 
-    void update(const uint32_t &past_timestamp) {
+    void update(const uint32_t &past_timestamp, const LRBConfig &config) {
         //distance
         uint32_t _distance = past_timestamp - _past_timestamp;
         assert(_distance);
         if (!_extra) {
-            _extra = new ParalllelLRBMetaExtra(_distance);
+            _extra = new ParalllelLRBMetaExtra(_distance, config);
         } else
-            _extra->update(_distance);
+            _extra->update(_distance, config);
         //timestamp
         _past_timestamp = past_timestamp;
     }
@@ -144,8 +139,9 @@ public:
     ParallelInCacheMeta(const uint64_t &key,
                         const uint64_t &size,
                         const uint64_t &past_timestamp,
-                        const uint16_t *&extra_features, const list<LRBKey>::const_iterator &it) :
-            ParallelLRBMeta(key, size, past_timestamp, extra_features) {
+                        const uint16_t *&extra_features, const list<LRBKey>::const_iterator &it,
+                        const LRBConfig &config) :
+            ParallelLRBMeta(key, size, past_timestamp, extra_features, config) {
         p_last_request = it;
     };
 
@@ -177,17 +173,30 @@ public:
 
 class ParallelLRBTrainingData {
 public:
+    const LRBConfig &config;
     vector<float> labels;
     vector<int32_t> indptr;
     vector<int32_t> indices;
     vector<double> data;
 
-    ParallelLRBTrainingData() {
-        labels.reserve(ParallelLRB::batch_size);
-        indptr.reserve(ParallelLRB::batch_size + 1);
+    //reserve room for n_row rows
+    ParallelLRBTrainingData(const LRBConfig &config, const uint32_t &n_row) : config(config) {
+        labels.reserve(n_row);
+        indptr.reserve(n_row + 1);
         indptr.emplace_back(0);
-        indices.reserve(ParallelLRB::batch_size * ParallelLRB::n_feature);
-        data.reserve(ParallelLRB::batch_size * ParallelLRB::n_feature);
+        indices.reserve(n_row * config.n_feature);
+        data.reserve(n_row * config.n_feature);
+    }
+
+    explicit ParallelLRBTrainingData(const LRBConfig &config) : ParallelLRBTrainingData(config, config.batch_size) {}
+
+    void append(const ParallelLRBTrainingData &other) {
+        labels.insert(labels.end(), other.labels.begin(), other.labels.end());
+        indices.insert(indices.end(), other.indices.begin(), other.indices.end());
+        data.insert(data.end(), other.data.begin(), other.data.end());
+        auto offset = indptr.back();
+        for (size_t i = 1; i < other.indptr.size(); ++i)
+            indptr.emplace_back(other.indptr[i] + offset);
     }
 
     void emplace_back(ParallelLRBMeta &meta, uint32_t &sample_timestamp, uint32_t &future_interval) {
@@ -201,14 +210,14 @@ public:
         int j = 0;
         uint8_t n_within = 0;
         if (meta._extra) {
-            for (; j < meta._extra->_past_distance_idx && j < ParallelLRB::max_n_past_distances; ++j) {
+            for (; j < meta._extra->_past_distance_idx && j < config.max_n_past_distances; ++j) {
                 uint8_t past_distance_idx =
-                        (meta._extra->_past_distance_idx - 1 - j) % ParallelLRB::max_n_past_distances;
+                        (meta._extra->_past_distance_idx - 1 - j) % config.max_n_past_distances;
                 const uint32_t &past_distance = meta._extra->_past_distances[past_distance_idx];
                 this_past_distance += past_distance;
                 indices.emplace_back(j + 1);
                 data.emplace_back(past_distance);
-                if (this_past_distance < ParallelLRB::memory_window) {
+                if (this_past_distance < config.memory_window) {
                     ++n_within;
                 }
             }
@@ -216,35 +225,35 @@ public:
 
         counter += j;
 
-        indices.emplace_back(ParallelLRB::max_n_past_timestamps);
+        indices.emplace_back(config.max_n_past_timestamps);
         data.push_back(meta._size);
         ++counter;
 
-        for (int k = 0; k < ParallelLRB::n_extra_fields; ++k) {
-            indices.push_back(ParallelLRB::max_n_past_timestamps + k + 1);
+        for (int k = 0; k < config.n_extra_fields; ++k) {
+            indices.push_back(config.max_n_past_timestamps + k + 1);
             data.push_back(meta._extra_features[k]);
         }
-        counter += ParallelLRB::n_extra_fields;
+        counter += config.n_extra_fields;
 
-        indices.push_back(ParallelLRB::max_n_past_timestamps + ParallelLRB::n_extra_fields + 1);
+        indices.push_back(config.max_n_past_timestamps + config.n_extra_fields + 1);
         data.push_back(n_within);
         ++counter;
 
         if (meta._extra) {
             for (int k = 0; k < ParallelLRB::n_edc_feature; ++k) {
-                indices.push_back(ParallelLRB::max_n_past_timestamps + ParallelLRB::n_extra_fields + 2 + k);
+                indices.push_back(config.max_n_past_timestamps + config.n_extra_fields + 2 + k);
                 uint32_t _distance_idx = std::min(
-                        uint32_t(sample_timestamp - meta._past_timestamp) / ParallelLRB::edc_windows[k],
-                        ParallelLRB::max_hash_edc_idx);
-                data.push_back(meta._extra->_edc[k] * ParallelLRB::hash_edc[_distance_idx]);
+                        uint32_t(sample_timestamp - meta._past_timestamp) / config.edc_windows[k],
+                        config.max_hash_edc_idx);
+                data.push_back(meta._extra->_edc[k] * config.hash_edc[_distance_idx]);
             }
         } else {
             for (int k = 0; k < ParallelLRB::n_edc_feature; ++k) {
-                indices.push_back(ParallelLRB::max_n_past_timestamps + ParallelLRB::n_extra_fields + 2 + k);
+                indices.push_back(config.max_n_past_timestamps + config.n_extra_fields + 2 + k);
                 uint32_t _distance_idx = std::min(
-                        uint32_t(sample_timestamp - meta._past_timestamp) / ParallelLRB::edc_windows[k],
-                        ParallelLRB::max_hash_edc_idx);
-                data.push_back(ParallelLRB::hash_edc[_distance_idx]);
+                        uint32_t(sample_timestamp - meta._past_timestamp) / config.edc_windows[k],
+                        config.max_hash_edc_idx);
+                data.push_back(config.hash_edc[_distance_idx]);
             }
         }
 
@@ -268,20 +277,111 @@ struct KeyMapEntryT {
     unsigned int list_pos: 31;
 };
 
+/*
+ * The training pipeline and current model of ParallelLRB, shared by the shards of a ShardedParallelLRB (a single
+ * ParallelLRB owns one too). Workers hand matured samples over in chunks; the training thread swaps out every full
+ * batch, trains on it and publishes the model as an immutable compiled forest, which workers score with lock free.
+ */
+class ParallelLRBModel {
+public:
+    //starts the training thread
+    ParallelLRBModel(const LRBConfig &config, const unordered_map<string, string> &train_params) :
+            config(config), train_params(train_params) {
+        training_data = new ParallelLRBTrainingData(this->config);
+        background_training_data = new ParallelLRBTrainingData(this->config);
+        training_thread = std::thread(&ParallelLRBModel::async_training, this);
+    }
+
+    ~ParallelLRBModel() {
+        keep_running = false;
+        if (training_thread.joinable())
+            training_thread.join();
+        if (booster)
+            LGBM_BoosterFree(booster);
+        delete training_data;
+        delete background_training_data;
+    }
+
+    //move the samples of data into the next batch
+    void append(ParallelLRBTrainingData &data) {
+        training_data_mutex.lock();
+        training_data->append(data);
+        training_data_mutex.unlock();
+        data.clear();
+    }
+
+    //nullptr until the first model
+    shared_ptr<const CompiledForest> get_forest() const {
+        return atomic_load(&forest);
+    }
+
+    size_t n_pending_sample() {
+        std::lock_guard<std::mutex> lock(training_data_mutex);
+        return training_data->labels.size();
+    }
+
+    vector<double> feature_importance() {
+        auto importances = vector<double>(config.n_feature, 0);
+        std::lock_guard<std::mutex> lock(booster_mutex);
+        if (booster && LGBM_BoosterFeatureImportance(booster, 0, 1, importances.data()) == -1) {
+            cerr << "error: get model importance fail" << endl;
+            abort();
+        }
+        return importances;
+    }
+
+    std::atomic<uint64_t> n_retrain = {0};
+
+private:
+    const LRBConfig config;
+    unordered_map<string, string> train_params;
+    ParallelLRBTrainingData *training_data;
+    ParallelLRBTrainingData *background_training_data;
+    std::mutex training_data_mutex;
+    std::thread training_thread;
+    std::atomic<bool> keep_running = true;
+    //for feature importance
+    BoosterHandle booster = nullptr;
+    std::mutex booster_mutex;
+    shared_ptr<const CompiledForest> forest;
+
+    void async_training() {
+        while (keep_running) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            training_data_mutex.lock();
+            bool is_full = training_data->labels.size() >= config.batch_size;
+            if (is_full) {
+                //assume back ground training data is already clear
+                std::swap(training_data, background_training_data);
+            }
+            training_data_mutex.unlock();
+            if (is_full) {
+                train();
+                background_training_data->clear();
+            }
+        }
+    }
+
+    void train();
+};
+
 class ParallelLRBCache : public ParallelCache {
 public:
+    //fixed after init_with_params
+    LRBConfig config;
     //key -> (0/1 list, idx)
     sparse_hash_map<uint64_t, KeyMapEntryT> key_map;
     vector<ParallelInCacheMeta> in_cache_metas;
     vector<ParallelLRBMeta> out_cache_metas;
 
     ParallelInCacheLRUQueue in_cache_lru_queue;
-    //TODO: negative queue should have a better abstraction, at least hide the round-up
-    //sparse_hash_map<uint64_t, uint64_t> has smaller memory overhead than <uint32_t, uint64_t>
-    sparse_hash_map<uint64_t, uint64_t> negative_candidate_queue;
-    ParallelLRBTrainingData *training_data;
-    ParallelLRBTrainingData *background_training_data;
-    std::mutex training_data_mutex;
+    //forget table: past timestamp -> position in out_cache_metas
+    TimerWheel negative_candidate_queue;
+    //matured samples not yet handed to the model, so the worker takes its lock once per chunk
+    unique_ptr<ParallelLRBTrainingData> training_data;
+    static constexpr uint32_t training_chunk_size = 1024;
+    //set before init_with_params to share another cache's model, otherwise created there
+    shared_ptr<ParallelLRBModel> model;
 
     // sample_size
     uint sample_rate = 64;
@@ -290,11 +390,6 @@ public:
 
     //mutex guarantee the concurrency control, so counter doesn't need to be atomic
     uint32_t t_counter = 0;
-    std::thread training_thread;
-
-    BoosterHandle booster = nullptr;
-    std::mutex booster_mutex;
-    bool if_trained = false;
 
     unordered_map<string, string> LRB_train_params = {
             //don't use alias here. C api may not recongize
@@ -310,20 +405,23 @@ public:
             {"verbosity",        "0"},
     };
 
-    std::unordered_map<std::string, std::string> LRB_inference_params;
-
 //    enum ObjectiveT: uint8_t {byte_hit_rate=0, object_hit_rate=1};
 //    ObjectiveT objective = byte_hit_rate;
 
     std::default_random_engine _generator = std::default_random_engine();
     std::uniform_int_distribution<std::size_t> _distribution = std::uniform_int_distribution<std::size_t>();
 
+    //rank() buffers: sample_rate dense rows of n_feature, absent features 0 as in the sparse training rows
+    vector<double> rank_rows;
+    vector<double> rank_scores;
+    vector<uint64_t> rank_keys;
+    vector<uint32_t> rank_poses;
+    vector<uint32_t> rank_past_timestamps;
+
     ~ParallelLRBCache() {
         keep_running = false;
         if (lookup_get_thread.joinable())
             lookup_get_thread.join();
-        if (training_thread.joinable())
-            training_thread.join();
         if (print_status_thread.joinable())
             print_status_thread.join();
     }
@@ -334,13 +432,13 @@ public:
             if (it.first == "sample_rate") {
                 sample_rate = stoul(it.second);
             } else if (it.first == "memory_window") {
-                ParallelLRB::memory_window = stoull(it.second);
+                config.memory_window = stoull(it.second);
             } else if (it.first == "max_n_past_timestamps") {
-                ParallelLRB::max_n_past_timestamps = (uint8_t) stoi(it.second);
+                config.max_n_past_timestamps = (uint8_t) stoi(it.second);
             } else if (it.first == "batch_size") {
-                ParallelLRB::batch_size = stoull(it.second);
+                config.batch_size = stoull(it.second);
             } else if (it.first == "n_extra_fields") {
-                ParallelLRB::n_extra_fields = stoull(it.second);
+                config.n_extra_fields = stoull(it.second);
             } else if (it.first == "num_iterations") {
                 LRB_train_params["num_iterations"] = it.second;
             } else if (it.first == "learning_rate") {
@@ -349,6 +447,8 @@ public:
                 LRB_train_params["num_threads"] = it.second;
             } else if (it.first == "num_leaves") {
                 LRB_train_params["num_leaves"] = it.second;
+            } else if (it.first.compare(0, 3, "op_") == 0 || it.first == "print_status") {
+                //ParallelCache's
             } else if (it.first == "n_edc_feature") {
                 if (stoull(it.second) != ParallelLRB::n_edc_feature) {
                     cerr << "error: cannot change n_edc_feature because of const" << endl;
@@ -362,54 +462,39 @@ public:
             }
         }
 
-        negative_candidate_queue.reserve(ParallelLRB::memory_window);
-        ParallelLRB::max_n_past_distances = ParallelLRB::max_n_past_timestamps - 1;
-        //init
-        ParallelLRB::edc_windows = vector<uint32_t>(ParallelLRB::n_edc_feature);
-        for (uint8_t i = 0; i < ParallelLRB::n_edc_feature; ++i) {
-            ParallelLRB::edc_windows[i] = pow(2, ParallelLRB::base_edc_window + i);
-        }
-        ParallelLRB::max_hash_edc_idx =
-                (uint64_t) (ParallelLRB::memory_window / pow(2, ParallelLRB::base_edc_window)) - 1;
-        ParallelLRB::hash_edc = vector<double>(ParallelLRB::max_hash_edc_idx + 1);
-        for (int i = 0; i < ParallelLRB::hash_edc.size(); ++i)
-            ParallelLRB::hash_edc[i] = pow(0.5, i);
-
-        //interval, distances, size, extra_features, n_past_intervals, edwt
-        ParallelLRB::n_feature =
-                ParallelLRB::max_n_past_timestamps + ParallelLRB::n_extra_fields + 2 + ParallelLRB::n_edc_feature;
-        if (ParallelLRB::n_extra_fields) {
-            if (ParallelLRB::n_extra_fields > ParallelLRB::max_n_extra_feature) {
+        negative_candidate_queue = TimerWheel(config.memory_window);
+        config.init();
+        if (config.n_extra_fields) {
+            if (config.n_extra_fields > ParallelLRB::max_n_extra_feature) {
                 cerr << "error: only support <= " + to_string(ParallelLRB::max_n_extra_feature)
                         + " extra fields because of static allocation" << endl;
                 abort();
             }
-            string categorical_feature = to_string(ParallelLRB::max_n_past_timestamps + 1);
-            for (uint i = 0; i < ParallelLRB::n_extra_fields - 1; ++i) {
-                categorical_feature += "," + to_string(ParallelLRB::max_n_past_timestamps + 2 + i);
+            string categorical_feature = to_string(config.max_n_past_timestamps + 1);
+            for (uint i = 0; i < config.n_extra_fields - 1; ++i) {
+                categorical_feature += "," + to_string(config.max_n_past_timestamps + 2 + i);
             }
             LRB_train_params["categorical_feature"] = categorical_feature;
         }
-        LRB_inference_params = LRB_train_params;
-        training_data = new ParallelLRBTrainingData();
-        background_training_data = new ParallelLRBTrainingData();
-        LRB_inference_params = LRB_train_params;
-        //TODO: don't believe inference need so large number of threads
-//        LRB_inference_params["num_threads"] = "4";
-        training_thread = std::thread(&ParallelLRBCache::async_training, this);
+        training_data.reset(new ParallelLRBTrainingData(config, training_chunk_size));
+        rank_rows.resize(sample_rate * config.n_feature);
+        rank_scores.resize(sample_rate);
+        rank_keys.resize(sample_rate);
+        rank_poses.resize(sample_rate);
+        rank_past_timestamps.resize(sample_rate);
+        if (!model) {
+            model = make_shared<ParallelLRBModel>(config, LRB_train_params);
+        }
         ParallelCache::init_with_params(params);
     }
 
 
     void print_stats() override {
-//        std::cerr << "\nop queue length: " << op_queue.size() << std::endl;
-//        std::cerr << "async size_map len: " << size_map.size() << std::endl;
-        std::cerr << "cache size: " << _currentSize << "/" << _cacheSize << " (" << ((double) _currentSize) / _cacheSize
-                  << ")" << std::endl
-                  << "in/out metadata " << in_cache_metas.size() << " / " << out_cache_metas.size() << std::endl;
+        ParallelCache::print_stats();
+        std::cerr << "in/out metadata " << in_cache_metas.size() << " / " << out_cache_metas.size() << std::endl;
 //        std::cerr << "cache size: "<<_currentSize<<"/"<<_cacheSize<<std::endl;
 //        std::cerr << "n_metadata: "<<key_map.size()<<std::endl;
-        std::cerr << "n_training: " << training_data->labels.size() << std::endl;
+        std::cerr << "n_training: " << model->n_pending_sample() << std::endl;
 
 //        std::cerr << "training loss: " << training_loss << std::endl;
 //        std::cerr << "n_force_eviction: " << n_force_eviction <<std::endl;
@@ -417,21 +502,6 @@ public:
 //        std::cerr << "inference time: " << inference_time <<std::endl;
     }
 
-    void async_training() {
-        while (keep_running) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
-            if (training_data->labels.size() >= ParallelLRB::batch_size) {
-                //assume back ground training data is already clear
-                training_data_mutex.lock();
-                std::swap(training_data, background_training_data);
-                training_data_mutex.unlock();
-                train();
-                background_training_data->clear();
-            }
-//            printf("async training\n");
-        }
-    }
-
     void async_lookup(const uint64_t &key) override;
 
     void
@@ -445,10 +515,14 @@ public:
     //sample, rank the 1st and return
     pair<uint64_t, uint32_t> rank();
 
-    void train();
-
     void sample();
 
+    //hand training_data to the model once a chunk is full
+    void flush_training_data() {
+        if (training_data->labels.size() >= training_chunk_size)
+            model->append(*training_data);
+    }
+
     bool has(const uint64_t &id) {
         auto it = key_map.find(id);
         if (it == key_map.end())
@@ -457,6 +531,7 @@ public:
     }
 
     void update_stat(bsoncxx::v_noabi::builder::basic::document &doc) override {
+        ParallelCache::update_stat(doc);
         uint64_t feature_overhead = 0;
         uint64_t sample_overhead = 0;
         for (auto &m: in_cache_metas) {
@@ -472,20 +547,8 @@ public:
         doc.append(kvp("feature_overhead", to_string(feature_overhead)));
         doc.append(kvp("sample ", to_string(sample_overhead)));
 
-        int res;
-        auto importances = vector<double>(ParallelLRB::n_feature, 0);
-
-        if (booster) {
-            res = LGBM_BoosterFeatureImportance(booster,
-                                                0,
-                                                1,
-                                                importances.data());
-            if (res == -1) {
-                cerr << "error: get model importance fail" << endl;
-                abort();
-            }
-        }
-
+        doc.append(kvp("n_retrain", to_string(model->n_retrain)));
+        auto importances = model->feature_importance();
         doc.append(kvp("model_importance", [importances](sub_array child) {
             for (const auto &element : importances)
                 child.append(element);
@@ -0,0 +1,89 @@
+//
+// ParallelLRB sharded over several worker threads.
+//
+
+#ifndef WEBCACHESIM_SHARDED_PARALLEL_LRB_H
+#define WEBCACHESIM_SHARDED_PARALLEL_LRB_H
+
+#include "parallel_lrb.h"
+#include <memory>
+#include <vector>
+
+using namespace webcachesim;
+using namespace std;
+
+/*
+ * ShardedParallelLRB: keys are hashed to n_worker independent ParallelLRB shards. Each shard has a 1/n_worker slice of
+ * the cache size, its own metadata, op queue and worker thread, so metadata maintenance scales with the worker count.
+ * The shards share one ParallelLRBModel: their samples feed a single training pipeline, and all of them evict with its
+ * model. A shard sees about 1/n_worker of the requests, like a spatial sample, so its memory_window is scaled down the
+ * same way, and an object larger than its shard's size is not admitted. The last shard also takes the remainder of the
+ * cache size.
+ *
+ * ParallelCache::init_with_params is not called: the op queue and size map of this object stay empty, and every path
+ * of ParallelCache using them is overridden to go to a shard.
+ */
+class ShardedParallelLRBCache : public ParallelCache {
+public:
+    ~ShardedParallelLRBCache() override {
+        keep_running = false;
+        if (print_status_thread.joinable())
+            print_status_thread.join();
+    }
+
+    void init_with_params(const map<string, string> &params) override;
+
+    void setSize(const uint64_t &cs) override;
+
+    bool has(const uint64_t &id) override {
+        return shard_of(id).has(id);
+    }
+
+    uint64_t parallel_lookup(const uint64_t &key) override {
+        return shard_of(key).parallel_lookup(key);
+    }
+
+    void parallel_admit(const uint64_t &key, const int64_t &size,
+                        const uint16_t extra_features[max_n_extra_feature]) override {
+        shard_of(key).parallel_admit(key, size, extra_features);
+    }
+
+    //ops are queued to the shards, whose workers apply them: these are not called
+    void async_lookup(const uint64_t &key) override {
+        shard_of(key).async_lookup(key);
+    }
+
+    void async_admit(const uint64_t &key, const int64_t &size,
+                     const uint16_t extra_features[max_n_extra_feature]) override {
+        shard_of(key).async_admit(key, size, extra_features);
+    }
+
+    uint64_t n_dequeued_op() override;
+
+    size_t op_queue_depth() override;
+
+    void update_stat_periodic() override;
+
+    void update_stat(bsoncxx::v_noabi::builder::basic::document &doc) override;
+
+protected:
+    void print_stats() override;
+
+private:
+    uint32_t n_worker = 4;
+    vector<unique_ptr<ParallelLRBCache>> shards;
+
+    uint64_t shard_size(const uint32_t &i) const {
+        return _cacheSize / n_worker + (i + 1 == n_worker ? _cacheSize % n_worker : 0);
+    }
+
+    ParallelLRBCache &shard_of(const uint64_t &key) {
+        //high bits of a multiplicative hash, independent of the key % n_shard size map sharding within a shard
+        uint64_t hash = (key * 0x9E3779B97F4A7C15ull) >> 32;
+        return *shards[(hash * n_worker) >> 32];
+    }
+};
+
+static Factory<ShardedParallelLRBCache> factoryShardedParallelLRB("ShardedParallelLRB");
+
+#endif //WEBCACHESIM_SHARDED_PARALLEL_LRB_H
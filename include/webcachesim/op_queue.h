@@ -0,0 +1,184 @@
+//
+// Bounded multi-producer/single-consumer op queue with batch dequeue.
+//
+
+#ifndef WEBCACHESIM_OP_QUEUE_H
+#define WEBCACHESIM_OP_QUEUE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/*
+ * A ring of cells, each with a sequence number telling whether it is free for the producer of ticket pos (seq == pos)
+ * or holds the op of ticket pos (seq == pos + 1). Producers claim tickets with one CAS; the single consumer drains up to
+ * a batch of published cells without atomics read-modify-write.
+ *
+ * An idle consumer backs off from spinning to yielding, then parks on a condition variable. Producers pay for the
+ * notification only when the consumer is parked. Parking is bounded by park_timeout, so the consumer still polls its
+ * stop flag.
+ */
+template<class T>
+class OpQueue {
+public:
+    static constexpr uint32_t n_spin = 64;
+    static constexpr uint32_t n_yield = 64;
+    static constexpr std::chrono::milliseconds park_timeout{10};
+
+    OpQueue() = default;
+
+    OpQueue(const OpQueue &) = delete;
+
+    OpQueue &operator=(const OpQueue &) = delete;
+
+    //capacity is rounded up to a power of 2. Not thread safe: call before any push or pop
+    void init(const size_t &capacity) {
+        size_t n = 2;
+        while (n < capacity)
+            n <<= 1;
+        mask = n - 1;
+        cells.reset(new Cell[n]);
+        for (size_t i = 0; i < n; ++i)
+            cells[i].seq.store(i, std::memory_order_relaxed);
+        enqueue_pos.store(0, std::memory_order_relaxed);
+        dequeue_pos.store(0, std::memory_order_relaxed);
+    }
+
+    size_t capacity() const {
+        return mask + 1;
+    }
+
+    //false if full
+    bool try_push(const T &op) {
+        //init() first
+        assert(cells);
+        auto pos = enqueue_pos.load(std::memory_order_relaxed);
+        Cell *cell;
+        while (true) {
+            cell = &cells[pos & mask];
+            auto seq = cell->seq.load(std::memory_order_acquire);
+            auto diff = static_cast<int64_t>(seq - pos);
+            if (!diff) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->op = op;
+        cell->seq.store(pos + 1, std::memory_order_release);
+        //pairs with the fence in wait(): either the consumer sees the op, or we see it parked
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (parked.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(park_mutex);
+            park_cv.notify_one();
+        }
+        return true;
+    }
+
+    //block until there is room, backing off the same way as the idle consumer
+    void push(const T &op) {
+        for (uint32_t n_retry = 0; !try_push(op); ++n_retry) {
+            n_full_retry.fetch_add(1, std::memory_order_relaxed);
+            if (n_retry < n_spin)
+                cpu_relax();
+            else
+                std::this_thread::yield();
+        }
+    }
+
+    //consumer only. Move up to max_n ops to out, return the number moved
+    size_t pop_batch(T *out, const size_t &max_n) {
+        assert(cells);
+        auto pos = dequeue_pos.load(std::memory_order_relaxed);
+        size_t n = 0;
+        for (; n < max_n; ++n, ++pos) {
+            auto &cell = cells[pos & mask];
+            if (cell.seq.load(std::memory_order_acquire) != pos + 1)
+                break;
+            out[n] = cell.op;
+            cell.seq.store(pos + mask + 1, std::memory_order_release);
+        }
+        if (n) {
+            dequeue_pos.store(pos, std::memory_order_relaxed);
+            n_batch.fetch_add(1, std::memory_order_relaxed);
+            n_op.fetch_add(n, std::memory_order_relaxed);
+            if (n > max_batch.load(std::memory_order_relaxed))
+                max_batch.store(n, std::memory_order_relaxed);
+        }
+        return n;
+    }
+
+    //consumer only, after n_idle consecutive empty pop_batch. Returns on a push, after park_timeout, or earlier
+    void wait(const uint32_t &n_idle) {
+        if (n_idle < n_spin) {
+            cpu_relax();
+            return;
+        }
+        if (n_idle < n_spin + n_yield) {
+            std::this_thread::yield();
+            return;
+        }
+        std::unique_lock<std::mutex> lock(park_mutex);
+        parked.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (empty()) {
+            n_park.fetch_add(1, std::memory_order_relaxed);
+            park_cv.wait_for(lock, park_timeout);
+        }
+        parked.store(false, std::memory_order_relaxed);
+    }
+
+    //approximate when read concurrently
+    size_t size() const {
+        auto enqueue = enqueue_pos.load(std::memory_order_relaxed);
+        auto dequeue = dequeue_pos.load(std::memory_order_relaxed);
+        return enqueue > dequeue ? enqueue - dequeue : 0;
+    }
+
+    //metrics, relaxed
+    std::atomic<uint64_t> n_full_retry = {0};
+    std::atomic<uint64_t> n_batch = {0};
+    std::atomic<uint64_t> n_op = {0};
+    std::atomic<uint64_t> max_batch = {0};
+    std::atomic<uint64_t> n_park = {0};
+
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        T op;
+    };
+
+    static void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+        _mm_pause();
+#endif
+    }
+
+    bool empty() const {
+        auto pos = dequeue_pos.load(std::memory_order_relaxed);
+        return cells[pos & mask].seq.load(std::memory_order_acquire) != pos + 1;
+    }
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask = 0;
+    //producers and consumer positions on separate cache lines
+    alignas(64) std::atomic<size_t> enqueue_pos = {0};
+    alignas(64) std::atomic<size_t> dequeue_pos = {0};
+    alignas(64) std::atomic<bool> parked = {false};
+    std::mutex park_mutex;
+    std::condition_variable park_cv;
+};
+
+#endif //WEBCACHESIM_OP_QUEUE_H
@@ -14,7 +14,7 @@
 #include <shared_mutex>
 #include <atomic>
 #include <chrono>
-#include <boost/lockfree/queue.hpp>
+#include "op_queue.h"
 
 using spp::sparse_hash_map;
 using namespace chrono;
@@ -73,7 +73,8 @@ namespace webcachesim {
                 OpT op = {.key=key, .size=size};
                 for (uint8_t i = 0; i < n_extra_fields; ++i)
                     op._extra_features[i] = extra_features[i];
-                while (! op_queue.push(op));
+                if (!enqueue(op))
+                    ++n_admit_drop;
             } else {
                 //already inserted
                 size_map_mutex[shard_id].unlock_shared();
@@ -90,7 +91,8 @@ namespace webcachesim {
             if (it != size_map[shard_id].end()) {
                 ret = it->second;
                 size_map_mutex[shard_id].unlock_shared();
-                while(!op_queue.push(OpT{.key=key, .size=-1}));
+                if (!enqueue(OpT{.key=key, .size=-1}))
+                    ++n_lookup_drop;
             } else {
                 size_map_mutex[shard_id].unlock_shared();
             }
@@ -103,29 +105,124 @@ namespace webcachesim {
             for (auto &it: params) {
                 if (it.first == "n_extra_fields") {
                     n_extra_fields = stoul(it.second);
+                } else if (it.first == "op_queue_capacity") {
+                    op_queue_capacity = stoul(it.second);
+                } else if (it.first == "op_batch_size") {
+                    op_batch_size = stoul(it.second);
+                } else if (it.first == "op_overload") {
+                    if (it.second == "block") {
+                        op_overload = OverloadT::block;
+                    } else if (it.second == "drop") {
+                        op_overload = OverloadT::drop;
+                    } else if (it.second == "sample") {
+                        op_overload = OverloadT::sample;
+                    } else {
+                        cerr << "error: op_overload must be block, drop or sample" << endl;
+                        abort();
+                    }
+                } else if (it.first == "op_overload_sample_rate") {
+                    op_overload_sample_rate = stod(it.second);
+                } else if (it.first == "op_overload_watermark") {
+                    op_overload_watermark = stod(it.second);
+                } else if (it.first == "print_status") {
+                    is_printing_status = static_cast<bool>(stoi(it.second));
                 }
             }
+            if (!op_queue_capacity || !op_batch_size) {
+                cerr << "error: op_queue_capacity and op_batch_size must be positive" << endl;
+                abort();
+            }
+            if (op_overload_sample_rate < 0 || op_overload_sample_rate > 1 || op_overload_watermark < 0 ||
+                op_overload_watermark > 1) {
+                cerr << "error: op_overload_sample_rate and op_overload_watermark must be in [0, 1]" << endl;
+                abort();
+            }
+            op_queue.init(op_queue_capacity);
+            op_overload_depth = op_overload_watermark * op_queue.capacity();
+            op_overload_threshold = op_overload_sample_rate * (double) (1ull << 32);
             lookup_get_thread = std::thread(&ParallelCache::async_lookup_get, this);
-            print_status_thread = std::thread(&ParallelCache::async_print_status, this);
+            if (is_printing_status)
+                print_status_thread = std::thread(&ParallelCache::async_print_status, this);
+        }
+
+        //ops taken by the background thread so far
+        virtual uint64_t n_dequeued_op() {
+            return op_queue.n_op;
+        }
+
+        virtual size_t op_queue_depth() {
+            return op_queue.size();
+        }
+
+        void update_stat(bsoncxx::builder::basic::document &doc) override {
+            using bsoncxx::builder::basic::kvp;
+            doc.append(kvp("op_queue_capacity", to_string(op_queue.capacity())));
+            doc.append(kvp("op_queue_depth", to_string(op_queue.size())));
+            doc.append(kvp("op_queue_full_retry", to_string(op_queue.n_full_retry)));
+            doc.append(kvp("op_queue_n_park", to_string(op_queue.n_park)));
+            doc.append(kvp("op_batch_mean",
+                           to_string(op_queue.n_batch ? (double) op_queue.n_op / op_queue.n_batch : 0)));
+            doc.append(kvp("op_batch_max", to_string(op_queue.max_batch)));
+            doc.append(kvp("op_lookup_drop", to_string(n_lookup_drop)));
+            doc.append(kvp("op_admit_drop", to_string(n_admit_drop)));
         }
 
     protected:
         std::thread lookup_get_thread;
         std::atomic<bool> keep_running = true;
-        //op queue
-        boost::lockfree::queue<OpT, boost::lockfree::capacity<4096>> op_queue;
-//        std::queue<OpT> op_queue;
+        //lookup hints and admissions from the client threads, consumed by lookup_get_thread
+        OpQueue<OpT> op_queue;
         std::thread print_status_thread;
-    private:
-        uint8_t n_extra_fields = 0;
+        //print_stats every 10 seconds
+        bool is_printing_status = true;
+        size_t op_queue_capacity = 4096;
+        //max ops lookup_get_thread takes per dequeue
+        size_t op_batch_size = 64;
+
+        /*
+         * what a client thread does with an op when lookup_get_thread falls behind. block: wait for room. drop: drop
+         * the op if the queue is full. sample: once the queue is op_overload_watermark full, only keep the ops of a
+         * hashed op_overload_sample_rate of the keys, and drop the rest, like drop, if the queue is full
+         */
+        enum class OverloadT : uint8_t {
+            block, drop, sample
+        };
+        OverloadT op_overload = OverloadT::block;
+        double op_overload_sample_rate = 0.1;
+        double op_overload_watermark = 0.5;
+        size_t op_overload_depth = 0;
+        uint64_t op_overload_threshold = 0;
+        std::atomic<uint64_t> n_lookup_drop = {0};
+        std::atomic<uint64_t> n_admit_drop = {0};
+
+        //false if the op is dropped under the overload policy
+        bool enqueue(const OpT &op) {
+            switch (op_overload) {
+                case OverloadT::block:
+                    op_queue.push(op);
+                    return true;
+                case OverloadT::sample:
+                    if (op_queue.size() >= op_overload_depth &&
+                        ((op.key * 0x9E3779B97F4A7C15ull) >> 32) >= op_overload_threshold)
+                        return false;
+                    return op_queue.try_push(op);
+                default:
+                    return op_queue.try_push(op);
+            }
+        }
 
         virtual void print_stats() {
             //no lock because read fail doesn't hurt much
-//            std::cerr << "\nop queue length: " << op_queue.size() << std::endl;
-//            std::cerr << "async size_map len: " << size_map.size() << std::endl;
             std::cerr << "cache size: " << _currentSize << "/" << _cacheSize << " ("
                       << ((double) _currentSize) / _cacheSize
                       << ")" << std::endl;
+            std::cerr << "op queue depth: " << op_queue.size() << "/" << op_queue.capacity()
+                      << ", full retries: " << op_queue.n_full_retry
+                      << ", batches: " << op_queue.n_batch << " (mean "
+                      << (op_queue.n_batch ? (double) op_queue.n_op / op_queue.n_batch : 0) << ", max "
+                      << op_queue.max_batch << ")" << std::endl;
+            if (op_overload != OverloadT::block)
+                std::cerr << "dropped lookup/admit ops: " << n_lookup_drop << " / " << n_admit_drop << std::endl;
 //                      << "in/out metadata " << in_cache_metas.size() << " / " << out_cache_metas.size() << std::endl;
 //            std::cerr << "n_training: "<<training_data->labels.size()<<std::endl;
 
@@ -136,16 +233,29 @@ namespace webcachesim {
         }
 
         void async_print_status() {
-            while (keep_running) {
-                std::this_thread::sleep_for(std::chrono::seconds(10));
-                print_stats();
+            //every 10 seconds, checking often enough not to hold up the destructor
+            for (uint32_t i = 1; keep_running; ++i) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                if (!(i % 100))
+                    print_stats();
             }
         }
 
+    private:
+        uint8_t n_extra_fields = 0;
+
         void async_lookup_get() {
+            vector<OpT> batch(op_batch_size);
+            uint32_t n_idle = 0;
             while (keep_running) {
-                OpT op;
-                if (op_queue.pop(op)) {
+                auto n = op_queue.pop_batch(batch.data(), batch.size());
+                if (!n) {
+                    op_queue.wait(n_idle++);
+                    continue;
+                }
+                n_idle = 0;
+                for (size_t i = 0; i < n; ++i) {
+                    auto &op = batch[i];
                     if (op.size < 0) {
                         async_lookup(op.key);
                     } else {
@@ -0,0 +1,83 @@
+//
+// Binary checkpoint helpers.
+//
+
+#ifndef WEBCACHESIM_SERIALIZATION_H
+#define WEBCACHESIM_SERIALIZATION_H
+
+#include <istream>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <type_traits>
+
+/*
+ * Checkpoints are raw native-endian dumps meant to be restored on the machine (and build) that wrote them.
+ */
+namespace webcachesim {
+    template<class T>
+    inline void write_pod(std::ostream &os, const T &v) {
+        static_assert(std::is_trivially_copyable<T>::value, "write_pod needs a trivially copyable type");
+        os.write(reinterpret_cast<const char *>(&v), sizeof(T));
+    }
+
+    template<class T>
+    inline void read_pod(std::istream &is, T &v) {
+        static_assert(std::is_trivially_copyable<T>::value, "read_pod needs a trivially copyable type");
+        if (!is.read(reinterpret_cast<char *>(&v), sizeof(T))) {
+            throw std::runtime_error("Exception reading checkpoint: truncated");
+        }
+    }
+
+    template<class T>
+    inline void write_vector(std::ostream &os, const std::vector<T> &v) {
+        static_assert(std::is_trivially_copyable<T>::value, "write_vector needs a trivially copyable type");
+        write_pod(os, static_cast<uint64_t>(v.size()));
+        os.write(reinterpret_cast<const char *>(v.data()), v.size() * sizeof(T));
+    }
+
+    template<class T>
+    inline void read_vector(std::istream &is, std::vector<T> &v) {
+        static_assert(std::is_trivially_copyable<T>::value, "read_vector needs a trivially copyable type");
+        uint64_t n;
+        read_pod(is, n);
+        v.resize(n);
+        if (!is.read(reinterpret_cast<char *>(v.data()), n * sizeof(T))) {
+            throw std::runtime_error("Exception reading checkpoint: truncated");
+        }
+    }
+
+    inline void write_string(std::ostream &os, const std::string &s) {
+        write_pod(os, static_cast<uint64_t>(s.size()));
+        os.write(s.data(), s.size());
+    }
+
+    inline void read_string(std::istream &is, std::string &s) {
+        uint64_t n;
+        read_pod(is, n);
+        s.resize(n);
+        if (!is.read(&s[0], n)) {
+            throw std::runtime_error("Exception reading checkpoint: truncated");
+        }
+    }
+
+    //standard random engines and distributions only define their state through text streams
+    template<class T>
+    inline void write_streamable(std::ostream &os, const T &v) {
+        std::ostringstream ss;
+        ss << v;
+        write_string(os, ss.str());
+    }
+
+    template<class T>
+    inline void read_streamable(std::istream &is, T &v) {
+        std::string s;
+        read_string(is, s);
+        std::istringstream ss(s);
+        ss >> v;
+    }
+}
+
+#endif //WEBCACHESIM_SERIALIZATION_H
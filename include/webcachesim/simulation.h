@@ -13,9 +13,13 @@
 #include <unordered_set>
 #include <map>
 #include <random>
+#include <queue>
 #include "cache.h"
 #include "bsoncxx/document/view.hpp"
 #include "bloom_filter.h"
+#include "spatial_sampler.h"
+#include "trace_reader.h"
+#include "trace_prefetcher.h"
 
 
 /*
@@ -24,6 +28,20 @@
 bsoncxx::builder::basic::document simulation(const vector<string> trace_files, std::string cache_type,
                                              uint64_t cache_size, std::map<std::string, std::string> params);
 
+struct SimulationConfig {
+    std::string cache_type;
+    uint64_t cache_size;
+    std::map<std::string, std::string> params;
+};
+
+/*
+ * simulate several configurations in one pass over the trace: each request is decoded once and fed to every
+ * configuration, spread over fan_out_n_threads threads (parameter of the first configuration, default: all cores).
+ * Returns results in the order of configs.
+ */
+std::vector<bsoncxx::builder::basic::document> simulation(const vector<string> trace_files,
+                                                          std::vector<SimulationConfig> configs);
+
 using namespace webcachesim;
 
 class FrameWork {
@@ -37,12 +55,19 @@ public:
     unique_ptr<Cache> webcache = nullptr;
     int64_t n_early_stop = -1;  //-1: no stop
     int64_t seq_start = 0;
+    //parse the trace on a separate thread, handing over batches of prefetch_batch_size requests
+    bool prefetch = true;
+    size_t prefetch_batch_size = 4096;
+    size_t prefetch_n_batch = 4;
 
     std::string _cache_type;
     uint64_t _cache_size;
-    const unordered_set<string> offline_algorithms = {"Belady", "BeladySample", "RelaxedBelady", "BinaryRelaxedBelady",
-                                                      "PercentRelaxedBelady"};
+    static inline const unordered_set<string> offline_algorithms = {"Belady", "BeladySample", "RelaxedBelady",
+                                                                    "BinaryRelaxedBelady", "PercentRelaxedBelady"};
     bool is_offline;
+    //offline algorithms: annotation threads (0: hardware concurrency) and memory before spilling to disk
+    uint annotate_n_threads = 0;
+    uint64_t annotate_memory_budget = 8ull * 1024 * 1024 * 1024;
 
     /*
      * bloom filter
@@ -50,6 +75,46 @@ public:
     bool bloom_filter = false;
     AkamaiBloomFilter *filter;
 
+    /*
+     * spatial sampling: only simulate objects whose hashed id is sampled, with a cache of sample_ratio * cache_size.
+     * sample_max_n_object > 0 bounds the number of sampled objects, lowering the ratio as needed. Reported request
+     * counters are those of the full trace, miss counters are scaled from the sample.
+     */
+    double sample_ratio = 1;
+    uint64_t sample_max_n_object = 0;
+    std::unique_ptr<SpatialSampler> sampler;
+
+    struct SampleStats {
+        //all requests, sampled or not
+        int64_t byte_req = 0, obj_req = 0;
+        //sampled requests weighted by 1 / sample ratio, per sub-sample
+        std::vector<double> byte_req_w, byte_miss_w, obj_req_w, obj_miss_w;
+
+        SampleStats() : byte_req_w(SpatialSampler::n_group), byte_miss_w(SpatialSampler::n_group),
+                        obj_req_w(SpatialSampler::n_group), obj_miss_w(SpatialSampler::n_group) {}
+
+        //scale the sampled miss ratio to the full trace
+        void correct(int64_t &_byte_req, int64_t &_byte_miss, int64_t &_obj_req, int64_t &_obj_miss) const;
+
+        //standard error of the byte and object miss ratio across sub-samples
+        std::pair<double, double> miss_ratio_stderr() const;
+
+        void add(const SampleStats &other);
+    };
+    //segment, real time segment and whole trace
+    SampleStats sample_stats, rt_sample_stats, total_sample_stats;
+    std::vector<double> seg_byte_miss_ratio_stderr, seg_object_miss_ratio_stderr;
+    std::vector<double> seg_sample_ratio;
+
+    /*
+     * checkpoint: write the simulation state to checkpoint_file before simulating request checkpoint_seq.
+     * restore_file: resume from such a checkpoint of the same cache type and size. Requests it covers are read but
+     * not simulated. Parameters not stored in the checkpoint (e.g., LRB training parameters) can differ.
+     */
+    std::string checkpoint_file;
+    int64_t checkpoint_seq = -1;
+    std::string restore_file;
+
     //=================================================================
     //simulation parameter
     int64_t t, id, size, usize, next_seq;
@@ -110,11 +175,23 @@ public:
 //    int64_t byte_miss_filter = 0;
 
 
+    /*
+     * decoded_traces: if not empty, one already loaded trace per trace file to read from instead of opening the files.
+     * They must carry next_seq for offline algorithms
+     */
     FrameWork(const vector<string> &trace_files, const std::string &cache_type, const uint64_t &cache_size,
-              std::map<std::string, std::string> &params);
+              std::map<std::string, std::string> &params,
+              const std::vector<std::shared_ptr<const DecodedTrace>> &decoded_traces = {});
 
     bsoncxx::builder::basic::document simulate();
 
+    /*
+     * run frame_works over the trace of the first offline one (or the first one), reading it once. Frameworks are
+     * spread over n_threads threads (0: hardware concurrency) and must not share state
+     */
+    static std::vector<bsoncxx::builder::basic::document>
+    simulate_fan_out(std::vector<std::unique_ptr<FrameWork>> &frame_works, uint n_threads);
+
     bsoncxx::builder::basic::document simulation_results();
 
     void adjust_real_time_offset();
@@ -125,16 +202,27 @@ public:
 
 private:
     // State for reading input files
-    std::vector<std::ifstream> infiles;
+    std::vector<std::unique_ptr<TraceReader>> readers;
     std::vector<std::string> _trace_files;
-    std::vector<size_t> files_choosable;
+    //k-way merge over the readers: min-heap of (time of next request, reader index)
+    std::priority_queue<std::pair<int64_t, size_t>, std::vector<std::pair<int64_t, size_t>>,
+            std::greater<std::pair<int64_t, size_t>>> reader_heap;
     std::vector<size_t> files_suitable_time;
-    struct TempInput {
-        int64_t seq;
-        int64_t time;
-        std::streampos pos;
-    };
-    std::vector<TempInput> temp_input;
+    std::vector<uint16_t> read_extra_features;
+    std::unique_ptr<TracePrefetcher> prefetcher;
+    std::unique_ptr<SimpleRequest> req;
+
+    void start();
+
+    //simulate one request. Returns false once n_early_stop is reached
+    bool process(const TraceRecord &record);
+
+    bsoncxx::builder::basic::document finish();
+
+    //the prefetcher, or nullptr if reading on the caller thread
+    TracePrefetcher *start_reading();
+
+    void stop_reading();
     // TODO: Set more sophisticated random generator
     std::default_random_engine gen;
 
@@ -144,7 +232,22 @@ private:
     void update_metrics_miss(const int64_t &size);
     void update_metrics_miss(const int64_t &size, const std::vector<uint16_t> &extra_features);
 
-    bool read_trace(int64_t &next_seq, int64_t &t, int64_t &id, int64_t &size);
+    //weight and sub-sample of the current request when sampling
+    double sample_weight = 1;
+    uint32_t sample_group = 0;
+
+    //cache size of the current sample ratio
+    uint64_t sampled_cache_size() const;
+
+    //requests already simulated by the restored checkpoint
+    uint64_t n_restored_to_skip = 0;
+
+    void save_checkpoint();
+
+    void restore_checkpoint();
+
+    //merge the next request of all trace files. Called from the reader thread when prefetching
+    bool read_trace(TraceRecord &record);
 };
 
 
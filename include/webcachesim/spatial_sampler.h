@@ -0,0 +1,68 @@
+//
+// Spatially hashed request sampling.
+//
+
+#ifndef WEBCACHESIM_SPATIAL_SAMPLER_H
+#define WEBCACHESIM_SPATIAL_SAMPLER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <istream>
+#include <ostream>
+#include <queue>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+/*
+ * SHARDS (Waldspurger et al., FAST'15): requests are kept iff the hash of their id modulo `modulus` is below a
+ * threshold. All requests of a sampled object are kept, so simulating the sample with a cache scaled by
+ * ratio() = threshold / modulus approximates the full trace.
+ *
+ * Fixed-size variant: with max_n_object > 0, at most max_n_object sampled objects are tracked. Once a new object
+ * exceeds the bound, the threshold is lowered to the largest tracked hash, which drops every object at that hash.
+ */
+class SpatialSampler {
+public:
+    static const uint64_t modulus = 1ull << 24;
+    //sampled objects are split by hash into this many sub-samples to estimate the sampling error
+    static const uint32_t n_group = 16;
+
+    SpatialSampler(const double &sample_ratio, const uint64_t &max_n_object);
+
+    //whether requests to id are simulated. May lower the threshold in the fixed-size variant
+    bool sample(const uint64_t &id);
+
+    double ratio() const {
+        return static_cast<double>(threshold) / modulus;
+    }
+
+    static uint32_t group(const uint64_t &id) {
+        return hash(id) % n_group;
+    }
+
+    //objects tracked by the fixed-size variant
+    size_t n_object() const {
+        return tracked.size();
+    }
+
+    void serialize(std::ostream &os) const;
+
+    void deserialize(std::istream &is);
+
+private:
+    uint64_t threshold;
+    uint64_t max_n_object;
+    std::unordered_set<uint64_t> tracked;
+    //max-heap of (hash, id) of tracked objects
+    std::priority_queue<std::pair<uint64_t, uint64_t>> by_hash;
+
+    static uint64_t hash(uint64_t id) {
+        //splitmix64 finalizer: ids are often sequential, so they need mixing before taking the low bits
+        id = (id ^ (id >> 30)) * 0xbf58476d1ce4e5b9ull;
+        id = (id ^ (id >> 27)) * 0x94d049bb133111ebull;
+        return (id ^ (id >> 31)) & (modulus - 1);
+    }
+};
+
+#endif //WEBCACHESIM_SPATIAL_SAMPLER_H
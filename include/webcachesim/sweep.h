@@ -0,0 +1,29 @@
+//
+// In-process parameter sweep.
+//
+
+#ifndef WEBCACHESIM_SWEEP_H
+#define WEBCACHESIM_SWEEP_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+struct SweepTask {
+    std::string trace_file;
+    std::string cache_type;
+    uint64_t cache_size;
+    std::map<std::string, std::string> params;
+};
+
+/*
+ * simulate every task in this process, on a work-stealing pool of n_threads threads (0: hardware concurrency).
+ * Each trace is checked, annotated (if an offline algorithm needs it) and decoded once, then shared read-only by all
+ * its tasks. One JSON document per task is appended to output_file as it finishes, keyed like webcachesim_cli
+ * results; a failed task gets a document with an "error" field instead of its results.
+ * Returns the number of failed tasks.
+ */
+size_t sweep(const std::vector<SweepTask> &tasks, uint n_threads, const std::string &output_file);
+
+#endif //WEBCACHESIM_SWEEP_H
@@ -0,0 +1,130 @@
+//
+// Coarse-grained timing wheel for fixed-length expiry.
+//
+
+#ifndef WEBCACHESIM_TIMER_WHEEL_H
+#define WEBCACHESIM_TIMER_WHEEL_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+/*
+ * Every entry lives n_slot ticks. The window is cut into buckets of bucket_width consecutive slots (t % n_slot), each a
+ * compact vector of (start tick, value). When the clock leaves a bucket, its entries that started at least n_slot ticks
+ * ago expire together, so expiry is up to bucket_width - 1 ticks late, and costs nothing on the other ticks.
+ *
+ * Memory is 8 bytes per live entry plus 24 bytes per bucket. The width grows with the window so there are at most
+ * max_n_bucket buckets (1.5 MB of headers); erase and update scan the bucket of their tick. Values are 32-bit (e.g.,
+ * positions in a metadata vector), ticks are compared in 32 bits, so n_slot must be below 2^31.
+ */
+class TimerWheel {
+public:
+    typedef uint32_t ValueT;
+    static constexpr uint32_t min_bucket_width = 64;
+    static constexpr uint32_t max_n_bucket = 1 << 16;
+
+    TimerWheel() = default;
+
+    explicit TimerWheel(const uint32_t &n_slot)
+            : n_slot(n_slot),
+              bucket_width(std::max(min_bucket_width, (n_slot + max_n_bucket - 1) / max_n_bucket)),
+              buckets((n_slot + bucket_width - 1) / bucket_width) {}
+
+    //several entries may start at the same tick, an entry is (tick, value)
+    bool contains(const uint64_t &t, const ValueT &value) const {
+        if (buckets.empty())
+            return false;
+        auto &bucket = bucket_of(t);
+        return std::find(bucket.begin(), bucket.end(), Entry{static_cast<uint32_t>(t), value}) != bucket.end();
+    }
+
+    void insert(const uint64_t &t, const ValueT &value) {
+        bucket_of(t).push_back({static_cast<uint32_t>(t), value});
+        ++n_entry;
+    }
+
+    //the entry keeps its tick but refers to new_value, e.g., after the value moved in its container
+    void update(const uint64_t &t, const ValueT &value, const ValueT &new_value) {
+        auto &bucket = bucket_of(t);
+        auto it = std::find(bucket.begin(), bucket.end(), Entry{static_cast<uint32_t>(t), value});
+        if (it != bucket.end())
+            it->value = new_value;
+    }
+
+    //no-op if the entry already expired
+    void erase(const uint64_t &t, const ValueT &value) {
+        auto &bucket = bucket_of(t);
+        auto it = std::find(bucket.begin(), bucket.end(), Entry{static_cast<uint32_t>(t), value});
+        if (it == bucket.end())
+            return;
+        *it = bucket.back();
+        bucket.pop_back();
+        --n_entry;
+        if (bucket.size() * 4 <= bucket.capacity())
+            std::vector<Entry>(bucket).swap(bucket);
+    }
+
+    /*
+     * call at every tick t, before other operations of the tick. Once t leaves a bucket, call on_expire(value) for
+     * each of its entries started at least n_slot ticks ago. An entry is removed before its callback, which may update
+     * or erase other entries, but not insert
+     */
+    template<class F>
+    void expire(const uint64_t &t, F &&on_expire) {
+        if (buckets.empty() || !t || (t % n_slot) % bucket_width)
+            return;
+        auto &bucket = bucket_of(t - 1);
+        for (size_t i = 0; i < bucket.size();) {
+            if (static_cast<uint32_t>(t) - bucket[i].tick < n_slot) {
+                ++i;
+                continue;
+            }
+            auto value = bucket[i].value;
+            bucket[i] = bucket.back();
+            bucket.pop_back();
+            --n_entry;
+            on_expire(value);
+        }
+        //the bucket held two laps around its expiry, keep the space of one. The copy costs as much as the scan
+        if (bucket.size() < bucket.capacity())
+            std::vector<Entry>(bucket).swap(bucket);
+    }
+
+    size_t size() const {
+        return n_entry;
+    }
+
+    size_t memory_overhead() const {
+        size_t res = sizeof(std::vector<Entry>) * buckets.capacity();
+        for (auto &bucket: buckets)
+            res += sizeof(Entry) * bucket.capacity();
+        return res;
+    }
+
+private:
+    struct Entry {
+        uint32_t tick;
+        ValueT value;
+
+        bool operator==(const Entry &rhs) const {
+            return tick == rhs.tick && value == rhs.value;
+        }
+    };
+
+    uint32_t n_slot = 0;
+    uint32_t bucket_width = min_bucket_width;
+    std::vector<std::vector<Entry>> buckets;
+    size_t n_entry = 0;
+
+    std::vector<Entry> &bucket_of(const uint64_t &t) {
+        return buckets[(t % n_slot) / bucket_width];
+    }
+
+    const std::vector<Entry> &bucket_of(const uint64_t &t) const {
+        return buckets[(t % n_slot) / bucket_width];
+    }
+};
+
+#endif //WEBCACHESIM_TIMER_WHEEL_H
@@ -0,0 +1,70 @@
+//
+// Background trace reading for FrameWork.
+//
+
+#ifndef WEBCACHESIM_TRACE_PREFETCHER_H
+#define WEBCACHESIM_TRACE_PREFETCHER_H
+
+#include <cstdint>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "api.h"
+
+namespace webcachesim {
+
+    //a decoded request as handed from the reader thread to the simulation loop
+    struct TraceRecord {
+        int64_t next_seq;
+        int64_t t;
+        int64_t id;
+        int64_t size;
+        uint16_t extra_features[max_n_extra_feature];
+    };
+
+    /*
+     * Runs a request source on a separate thread, parsing ahead into fixed-size batches. Batches are handed over
+     * through a bounded ring, so the reader is at most n_batch batches ahead of the consumer. Only the consumer thread
+     * may call next_batch().
+     */
+    class TracePrefetcher {
+    public:
+        //source fills a record and returns false at the end of trace. It is only called from the reader thread
+        TracePrefetcher(std::function<bool(TraceRecord &)> source, const size_t &batch_size, const size_t &n_batch);
+
+        ~TracePrefetcher();
+
+        TracePrefetcher(const TracePrefetcher &) = delete;
+
+        TracePrefetcher &operator=(const TracePrefetcher &) = delete;
+
+        /*
+         * block until the next batch is ready. The batch stays valid until the following call. An empty batch means
+         * end of trace; an exception thrown by the source is rethrown here once the batches before it are consumed
+         */
+        const std::vector<TraceRecord> &next_batch();
+
+    private:
+        std::function<bool(TraceRecord &)> source;
+        std::vector<std::vector<TraceRecord>> batches;
+        size_t batch_size;
+        //ring state, guarded by mtx. head: oldest ready batch, owned by the consumer while holding
+        size_t head = 0;
+        size_t n_ready = 0;
+        bool holding = false;
+        bool done = false;
+        bool stop = false;
+        std::exception_ptr error;
+        std::mutex mtx;
+        std::condition_variable cv_ready;
+        std::condition_variable cv_free;
+        std::thread reader_thread;
+
+        void run();
+    };
+}
+
+#endif //WEBCACHESIM_TRACE_PREFETCHER_H
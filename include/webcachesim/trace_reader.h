@@ -0,0 +1,174 @@
+//
+// Per-file trace readers used by FrameWork.
+//
+
+#ifndef WEBCACHESIM_TRACE_READER_H
+#define WEBCACHESIM_TRACE_READER_H
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+#include "binary_trace.h"
+#include "annotate.h"
+
+namespace webcachesim {
+
+    /*
+     * buffered parser for the space-separated format. ifstream >> is the bottleneck on large traces, so parse the
+     * integers by hand.
+     */
+    class TextTraceScanner {
+    public:
+        TextTraceScanner(const std::string &trace_file, size_t buffer_size);
+
+        /*
+         * only scan the lines starting in the byte range [begin, end). Splitting a file at arbitrary offsets gives
+         * every line to exactly one range
+         */
+        TextTraceScanner(const std::string &trace_file, size_t buffer_size, uint64_t begin, uint64_t end);
+
+        ~TextTraceScanner();
+
+        TextTraceScanner(const TextTraceScanner &) = delete;
+
+        TextTraceScanner &operator=(const TextTraceScanner &) = delete;
+
+        //parse the integers of the next non-empty line. Returns number of fields; 0 on end of file
+        int next_line(int64_t *fields, const int &max_fields);
+
+        //number of the line last returned by next_line, counting non-empty lines from 1
+        uint64_t line() const {
+            return n_line;
+        }
+
+    private:
+        FILE *file;
+        std::vector<char> buffer;
+        size_t pos = 0, end = 0;
+        uint64_t n_line = 0;
+        //file offset of buffer[0], and of the current line
+        uint64_t buffer_offset = 0, line_start = 0;
+        uint64_t range_end = UINT64_MAX;
+
+        bool fill();
+
+        bool parse_int(int64_t &v);
+    };
+
+    class TraceReader {
+    public:
+        virtual ~TraceReader() = default;
+
+        //timestamp of the next request without consuming it. Return false at the end of trace
+        virtual bool peek_time(int64_t &t) = 0;
+
+        //consume the next request. next_seq is only filled for annotated traces
+        virtual bool read(int64_t &next_seq, int64_t &t, int64_t &id, int64_t &size,
+                          std::vector<uint16_t> &extra_features) = 0;
+
+        /*
+         * open a trace, picking the binary reader if the file carries the binary trace magic.
+         * is_annotated: fill next_seq from the sidecar written by annotate()
+         */
+        static std::unique_ptr<TraceReader>
+        open(const std::string &trace_file, const bool &is_annotated, const uint &n_extra_fields);
+    };
+
+    class TextTraceReader : public TraceReader {
+    public:
+        TextTraceReader(const std::string &trace_file, const uint &n_extra_fields);
+
+        bool peek_time(int64_t &t) override;
+
+        bool read(int64_t &next_seq, int64_t &t, int64_t &id, int64_t &size,
+                  std::vector<uint16_t> &extra_features) override;
+
+    private:
+        //a few readers are open at once when replaying multiple traces, so keep the buffer moderate
+        static const size_t buffer_size = 1024 * 1024;
+        TextTraceScanner scanner;
+        uint n_extra_fields;
+        //one request of lookahead, so peek_time does not need to seek back
+        int64_t fields[3 + max_n_extra_feature];
+        bool has_next = false;
+
+        void advance();
+    };
+
+    class BinaryTraceReader : public TraceReader {
+    public:
+        BinaryTraceReader(const std::string &trace_file, const uint &n_extra_fields);
+
+        bool peek_time(int64_t &t) override;
+
+        bool read(int64_t &next_seq, int64_t &t, int64_t &id, int64_t &size,
+                  std::vector<uint16_t> &extra_features) override;
+
+    private:
+        MappedBinaryTrace trace;
+        uint64_t cursor = 0;
+        uint n_extra_fields;
+    };
+
+    /*
+     * a whole trace decoded once and shared read-only by any number of DecodedTraceReader, e.g., by the tasks of a
+     * parameter sweep. Binary traces and the next_seq sidecar stay memory mapped, text traces are decoded into columns.
+     */
+    class DecodedTrace {
+    public:
+        //is_annotated: also map the next_seq sidecar, which annotate() must have written
+        static std::shared_ptr<const DecodedTrace>
+        load(const std::string &trace_file, const bool &is_annotated, const uint &n_extra_fields);
+
+        uint64_t n_req = 0;
+        uint n_extra_fields = 0;
+        const int64_t *t = nullptr;
+        const uint64_t *id = nullptr;
+        const uint32_t *size = nullptr;
+        const uint16_t *extra[max_n_extra_feature] = {};
+        //nullptr unless annotated
+        const uint64_t *next_seq = nullptr;
+
+    private:
+        std::unique_ptr<MappedBinaryTrace> mapped;
+        std::unique_ptr<MappedNextSeq> sidecar;
+        std::vector<int64_t> t_column;
+        std::vector<uint64_t> id_column;
+        std::vector<uint32_t> size_column;
+        std::vector<uint16_t> extra_columns[max_n_extra_feature];
+    };
+
+    class DecodedTraceReader : public TraceReader {
+    public:
+        explicit DecodedTraceReader(std::shared_ptr<const DecodedTrace> trace) : trace(std::move(trace)) {}
+
+        bool peek_time(int64_t &t) override;
+
+        bool read(int64_t &next_seq, int64_t &t, int64_t &id, int64_t &size,
+                  std::vector<uint16_t> &extra_features) override;
+
+    private:
+        std::shared_ptr<const DecodedTrace> trace;
+        uint64_t cursor = 0;
+    };
+
+    //pairs the requests of a trace with the next_seq sidecar written by annotate()
+    class AnnotatedTraceReader : public TraceReader {
+    public:
+        AnnotatedTraceReader(std::unique_ptr<TraceReader> reader, const std::string &next_seq_file);
+
+        bool peek_time(int64_t &t) override { return reader->peek_time(t); }
+
+        bool read(int64_t &next_seq, int64_t &t, int64_t &id, int64_t &size,
+                  std::vector<uint16_t> &extra_features) override;
+
+    private:
+        std::unique_ptr<TraceReader> reader;
+        MappedNextSeq sidecar;
+        uint64_t cursor = 0;
+    };
+}
+
+#endif //WEBCACHESIM_TRACE_READER_H
@@ -8,8 +8,31 @@
 #include <string>
 #include <map>
 #include <vector>
+#include <cstdint>
 
-bool trace_sanity_check(const std::vector<std::string>& trace_file, std::map<std::string, std::string> &params);
+struct TraceStats {
+    bool valid = false;
+    uint64_t n_req = 0;
+    uint64_t n_unique_obj = 0;
+    uint64_t unique_bytes = 0;
+    //bytes requested per million requests
+    uint64_t byte_million_req = 0;
+};
+
+/*
+ * Check trace_files can be simulated. The verdict and statistics of each trace are cached on local disk in
+ * ${WEBCACHESIM_CACHE_DIR} (default ~/.cache/webcachesim), keyed by file size, mtime and a hash of the file head and
+ * tail, so repeated runs on the same trace skip the scan. With dburi, they are also shared in MongoDB, keyed by a
+ * hash of the whole file. stats: if not null, filled with one entry per trace
+ */
+bool trace_sanity_check(const std::vector<std::string> &trace_file, std::map<std::string, std::string> &params,
+                        std::vector<TraceStats> *stats = nullptr);
+
+/*
+ * a trace of any length passes the check, but some caches count requests in 32-bit sequence numbers. Throw
+ * invalid_argument if the traces of stats are too long for cache_type
+ */
+void check_n_req(const std::string &cache_type, const std::vector<TraceStats> &stats);
 
 
 #endif //WEBCACHESIM_TRACE_SANITY_CHECK_H
@@ -10,6 +10,7 @@
 #include <limits>
 #include <vector>
 #include <string>
+#include "binary_trace.h"
 
 // hash_combine derived from boost/functional/hash/hash.hpp:212
 // Copyright 2005-2014 Daniel James.
@@ -39,20 +40,26 @@ namespace std {
 inline int get_n_fields(const std::vector<std::string>& filenames) {
     int prev_counter = std::numeric_limits<int>::max();
     for (const auto& filename: filenames) {
-        std::ifstream infile(filename);
-        if (!infile) {
-            throw std::runtime_error("Exception opening file "+filename);
-        }
-        //get whether file is in a correct format
-        std::string line;
-        getline(infile, line);
-        std::istringstream iss(line);
-        uint64_t tmp;
         int counter = 0;
-        while (iss >> tmp) {
-            ++counter;
+        if (webcachesim::is_binary_trace(filename)) {
+            //binary trace stores the number of fields in its header
+            webcachesim::MappedBinaryTrace trace(filename);
+            counter = 3 + trace.n_extra_fields();
+        } else {
+            std::ifstream infile(filename);
+            if (!infile) {
+                throw std::runtime_error("Exception opening file "+filename);
+            }
+            //get whether file is in a correct format
+            std::string line;
+            getline(infile, line);
+            std::istringstream iss(line);
+            uint64_t tmp;
+            while (iss >> tmp) {
+                ++counter;
+            }
+            infile.close();
         }
-        infile.close();
 
         if (prev_counter != std::numeric_limits<int>::max() && prev_counter != counter) {
             throw std::runtime_error("Found unequal number of fields!");
@@ -0,0 +1,27 @@
+//
+// Convert a space-separated trace into the binary columnar format.
+//
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include "binary_trace.h"
+
+using namespace std;
+using namespace webcachesim;
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        cerr << "webcachesim_convert_trace textTraceFile binaryTraceFile" << endl;
+        return 1;
+    }
+
+    if (is_binary_trace(argv[1])) {
+        cerr << "error: " << argv[1] << " is already a binary trace" << endl;
+        return 1;
+    }
+
+    auto n_req = convert_to_binary_trace(argv[1], argv[2]);
+    cerr << "wrote " << n_req << " requests to " << argv[2] << endl;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,132 @@
+//
+// Throughput benchmark of the concurrent caches behind webcachesim::Interface.
+//
+
+#include <string>
+#include <regex>
+#include <map>
+#include <cmath>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include "parallel_cache.h"
+
+using namespace std;
+using namespace webcachesim;
+
+/*
+ * Client threads replay a synthetic skewed workload (lookup, and admit on a miss) against one cache. Ops are counted
+ * when the cache's worker threads dequeue them, so the rate is the metadata maintenance throughput: with the default
+ * blocking overload policy, clients wait for the workers once the op queues are full.
+ */
+double run(const string &cache_type, const uint64_t &cache_size, const map<string, string> &params,
+           const uint32_t &n_client, const double &seconds, const uint64_t &n_object) {
+    unique_ptr<ParallelCache> cache(dynamic_cast<ParallelCache *>(Cache::create_unique(cache_type).release()));
+    if (!cache) {
+        cerr << "error: " << cache_type << " is not a parallel cache" << endl;
+        abort();
+    }
+    cache->setSize(cache_size);
+    cache->init_with_params(params);
+
+    atomic<bool> is_running = {true};
+    vector<thread> clients;
+    for (uint32_t i = 0; i < n_client; ++i) {
+        clients.emplace_back([&, i] {
+            mt19937_64 generator(i);
+            uniform_real_distribution<> distribution(0, 1);
+            uint16_t extra_features[max_n_extra_feature] = {0};
+            while (is_running) {
+                //popularity skewed toward small ids
+                uint64_t key = pow(distribution(generator), 4) * n_object;
+                int64_t size = 1000 + (key * 2654435761u) % 64000;
+                if (!cache->parallel_lookup(key))
+                    cache->parallel_admit(key, size, extra_features);
+            }
+        });
+    }
+    //warm up before measuring
+    this_thread::sleep_for(chrono::duration<double>(seconds / 4));
+    auto n_begin = cache->n_dequeued_op();
+    auto time_begin = chrono::steady_clock::now();
+    this_thread::sleep_for(chrono::duration<double>(seconds));
+    auto n_end = cache->n_dequeued_op();
+    auto elapsed = chrono::duration<double>(chrono::steady_clock::now() - time_begin).count();
+    is_running = false;
+    for (auto &client: clients)
+        client.join();
+    return (n_end - n_begin) / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        cerr << "webcachesim_parallel_bench cacheType cacheSize [--bench_n_client=n] [--bench_seconds=s] "
+                "[--bench_n_object=n] [--bench_n_worker=1,2,4,8] [--param=value]" << endl;
+        cerr << "reports the ops/sec the cache's worker threads apply, for each n_worker of ShardedParallelLRB"
+             << endl;
+        return 1;
+    }
+    string cache_type = argv[1];
+    uint64_t cache_size = stoull(argv[2]);
+
+    map<string, string> params;
+    regex opexp("--([^=]*)=(.*)");
+    cmatch opmatch;
+    for (int i = 3; i < argc; i++) {
+        regex_match(argv[i], opmatch, opexp);
+        if (opmatch.size() != 3) {
+            cerr << "error: unrecognized argument " << argv[i] << endl;
+            return 1;
+        }
+        params[opmatch[1]] = opmatch[2];
+    }
+    uint32_t n_client = thread::hardware_concurrency();
+    double seconds = 10;
+    uint64_t n_object = 10000000;
+    vector<uint32_t> n_workers = {0};
+    for (auto it = params.begin(); it != params.end();) {
+        if (it->first == "bench_n_client") {
+            n_client = stoul(it->second);
+        } else if (it->first == "bench_seconds") {
+            seconds = stod(it->second);
+        } else if (it->first == "bench_n_object") {
+            n_object = stoull(it->second);
+        } else if (it->first == "bench_n_worker") {
+            n_workers.clear();
+            stringstream ss(it->second);
+            string n_worker;
+            while (getline(ss, n_worker, ',')) {
+                n_workers.emplace_back(stoul(n_worker));
+            }
+        } else {
+            ++it;
+            continue;
+        }
+        it = params.erase(it);
+    }
+    if (params.find("print_status") == params.end()) {
+        params["print_status"] = "0";
+    }
+
+    cout << setw(10) << "n_worker" << setw(16) << "ops/sec" << setw(10) << "speedup" << endl;
+    double base_rate = 0;
+    for (auto &n_worker: n_workers) {
+        //0: the cache's own default
+        if (n_worker) {
+            params["n_worker"] = to_string(n_worker);
+        }
+        auto rate = run(cache_type, cache_size, params, n_client, seconds, n_object);
+        if (!base_rate) {
+            base_rate = rate;
+        }
+        cout << setw(10) << (n_worker ? to_string(n_worker) : "default") << setw(16) << (uint64_t) rate
+             << setw(10) << setprecision(3) << rate / base_rate << endl;
+    }
+    return EXIT_SUCCESS;
+}
@@ -10,6 +10,7 @@
 #include <cstdlib>
 #include <iostream>
 #include <vector>
+#include <sstream>
 #include "bsoncxx/builder/basic/document.hpp"
 #include "bsoncxx/json.hpp"
 #include "mongocxx/client.hpp"
@@ -35,6 +36,8 @@ int main(int argc, char *argv[]) {
         cerr
                 << "webcachesim_cli traceFile cacheType cacheSize [--param=value]"
                 << endl;
+        cerr << "cacheType and cacheSize can be comma-separated lists: all combinations are simulated in one pass"
+             << endl;
         cerr << "Available cache types:\n";
         for (const auto& e : Cache::get_factory_instance()) {
             cerr << e.first << " ";
@@ -71,70 +74,86 @@ int main(int argc, char *argv[]) {
 
     string task_id;
 
-    bsoncxx::builder::basic::document key_builder{};
-    bsoncxx::builder::basic::document value_builder{};
-
-    for (auto &k: params) {
-        //don't store authentication information
-        if (unordered_set<string>({"dburi"}).count(k.first)) {
-            continue;
-        }
-        if (!unordered_set<string>({"dbcollection", "task_id", "enable_trace_format_check"}).count(k.first)) {
-            key_builder.append(kvp(k.first, k.second));
-        } else {
-            value_builder.append(kvp(k.first, k.second));
-        }
-    }
-
     mongocxx::instance inst;
 
-    auto cacheType = argv[1];
-    auto cacheSize = std::stoull(argv[2]);
     std::vector<string> traceFiles;
     for(int i = 3; i < argc; ++i) {
         if (string(argv[i]).find_first_of("=") == std::string::npos) {
             traceFiles.emplace_back(string(webcachesim_trace_dir) + '/' + argv[i]);
         }
     }
-
-    key_builder.append(kvp("trace_file", [&traceFiles](sub_array child) {
-            std::vector<string> sortedTraceFiles = traceFiles;
-            std::sort(sortedTraceFiles.begin(), sortedTraceFiles.end());
-            for(const auto& element: traceFiles)
-                child.append(element);
-    }));
-    key_builder.append(kvp("cache_type", argv[1]));
-    key_builder.append(kvp("cache_size", argv[2]));
-
     if (traceFiles.empty()) {
         cerr << "error: no trace file found" << endl;
         return 1;
     }
 
-    for (bsoncxx::document::element ele: key_builder.view())
-        value_builder.append(kvp(ele.key(), ele.get_value()));
+    auto split = [](const string &s) {
+        std::vector<string> items;
+        stringstream ss(s);
+        string item;
+        while (getline(ss, item, ',')) {
+            items.emplace_back(item);
+        }
+        return items;
+    };
+    std::vector<SimulationConfig> configs;
+    for (auto &cacheType: split(argv[1])) {
+        for (auto &cacheSize: split(argv[2])) {
+            configs.push_back({cacheType, std::stoull(cacheSize), params});
+        }
+    }
 
     auto timeBegin = chrono::system_clock::now();
-    
-    auto res = simulation(traceFiles, cacheType, cacheSize,
-                          params);
+
+    auto results = simulation(traceFiles, configs);
     auto simulation_time = chrono::duration_cast<chrono::seconds>(chrono::system_clock::now() - timeBegin).count();
     auto simulation_timestamp = current_timestamp();
 
-    for (bsoncxx::document::element ele: res.view())
-        value_builder.append(kvp(ele.key(), ele.get_value()));
-    value_builder.append(kvp("simulation_time", to_string(simulation_time)));
-    value_builder.append(kvp("simulation_timestamp", simulation_timestamp));
-
-    cout << bsoncxx::to_json(value_builder.view()) << endl;
+    //one result document per configuration, keyed as if it was simulated alone
+    for (size_t i = 0; i < configs.size(); ++i) {
+        bsoncxx::builder::basic::document key_builder{};
+        bsoncxx::builder::basic::document value_builder{};
+
+        for (auto &k: params) {
+            //don't store authentication information
+            if (unordered_set<string>({"dburi"}).count(k.first)) {
+                continue;
+            }
+            if (!unordered_set<string>({"dbcollection", "task_id", "enable_trace_format_check",
+                                        "fan_out_n_threads"}).count(k.first)) {
+                key_builder.append(kvp(k.first, k.second));
+            } else {
+                value_builder.append(kvp(k.first, k.second));
+            }
+        }
 
-    try {
-        mongocxx::client client = mongocxx::client{mongocxx::uri(params["dburi"])};
-        auto db = client[mongocxx::uri(params["dburi"]).database()];
-        mongocxx::options::replace option;
-        db[params["dbcollection"]].replace_one(key_builder.extract(), value_builder.extract(), option.upsert(true));
-    } catch (const std::exception &xcp) {
-        cerr << "warning: db connection failed: " << xcp.what() << std::endl;
+        key_builder.append(kvp("trace_file", [&traceFiles](sub_array child) {
+                std::vector<string> sortedTraceFiles = traceFiles;
+                std::sort(sortedTraceFiles.begin(), sortedTraceFiles.end());
+                for(const auto& element: traceFiles)
+                    child.append(element);
+        }));
+        key_builder.append(kvp("cache_type", configs[i].cache_type));
+        key_builder.append(kvp("cache_size", to_string(configs[i].cache_size)));
+
+        for (bsoncxx::document::element ele: key_builder.view())
+            value_builder.append(kvp(ele.key(), ele.get_value()));
+
+        for (bsoncxx::document::element ele: results[i].view())
+            value_builder.append(kvp(ele.key(), ele.get_value()));
+        value_builder.append(kvp("simulation_time", to_string(simulation_time)));
+        value_builder.append(kvp("simulation_timestamp", simulation_timestamp));
+
+        cout << bsoncxx::to_json(value_builder.view()) << endl;
+
+        try {
+            mongocxx::client client = mongocxx::client{mongocxx::uri(params["dburi"])};
+            auto db = client[mongocxx::uri(params["dburi"]).database()];
+            mongocxx::options::replace option;
+            db[params["dbcollection"]].replace_one(key_builder.extract(), value_builder.extract(), option.upsert(true));
+        } catch (const std::exception &xcp) {
+            cerr << "warning: db connection failed: " << xcp.what() << std::endl;
+        }
     }
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,175 @@
+//
+// Run a parameter sweep described by the pywebcachesim job, algorithm parameter and trace parameter files in
+// this process.
+//
+
+#include <string>
+#include <regex>
+#include <map>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#include "yaml-cpp/yaml.h"
+#include "sweep.h"
+#include "cache.h"
+
+using namespace std;
+using namespace webcachesim;
+
+//a parameter with a list value is expanded into one task per element
+typedef map<string, vector<string>> ParamSpace;
+
+//scalars and lists of scalars; null removes the parameter, like in get_task.py
+void merge(ParamSpace &params, const YAML::Node &node) {
+    for (auto it = node.begin(); it != node.end(); ++it) {
+        auto key = it->first.as<string>();
+        auto &value = it->second;
+        if (value.IsNull()) {
+            continue;
+        }
+        vector<string> values;
+        if (value.IsSequence()) {
+            for (auto &&element: value) {
+                values.emplace_back(element.as<string>());
+            }
+        } else if (value.IsScalar()) {
+            values.emplace_back(value.as<string>());
+        } else {
+            throw invalid_argument("error: parameter " + key + " must be a scalar or a list");
+        }
+        params[key] = values;
+    }
+}
+
+vector<map<string, string>> cartesian_product(const ParamSpace &space) {
+    vector<map<string, string>> res(1);
+    for (auto &it: space) {
+        vector<map<string, string>> expanded;
+        for (auto &params: res) {
+            for (auto &value: it.second) {
+                expanded.push_back(params);
+                expanded.back()[it.first] = value;
+            }
+        }
+        res = move(expanded);
+    }
+    return res;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 5) {
+        cerr << "webcachesim_sweep jobFile algorithmParamFile traceParamFile outputFile [--sweep_n_threads=n] "
+                "[--param=value]" << endl;
+        cerr << "simulates the same tasks as pywebcachesim in this process, appending one json line per task to "
+                "outputFile" << endl;
+        cerr << "Available cache types:\n";
+        for (const auto &e : Cache::get_factory_instance()) {
+            cerr << e.first << " ";
+        }
+        cerr << endl;
+        return 1;
+    }
+
+    auto webcachesim_trace_dir = getenv("WEBCACHESIM_TRACE_DIR");
+    if (!webcachesim_trace_dir) {
+        cerr << "error: WEBCACHESIM_TRACE_DIR is not set, can not find trace" << endl;
+        abort();
+    }
+
+    //command line parameters take precedence over the job file
+    map<string, string> args;
+    regex opexp("--([^=]*)=(.*)");
+    cmatch opmatch;
+    for (int i = 5; i < argc; i++) {
+        regex_match(argv[i], opmatch, opexp);
+        if (opmatch.size() != 3) {
+            cerr << "error: unrecognized argument " << argv[i] << endl;
+            return 1;
+        }
+        args[opmatch[1]] = opmatch[2];
+    }
+    uint n_threads = 0;
+    if (args.count("sweep_n_threads")) {
+        n_threads = stoul(args["sweep_n_threads"]);
+        args.erase("sweep_n_threads");
+    }
+
+    const YAML::Node job = YAML::LoadFile(argv[1]);
+    const YAML::Node default_algorithm_params = YAML::LoadFile(argv[2]);
+    const YAML::Node trace_params = YAML::LoadFile(argv[3]);
+    ParamSpace job_params;
+    for (auto it = job.begin(); it != job.end(); ++it) {
+        auto key = it->first.as<string>();
+        if (key == "cache_types" || key == "trace_files" || key == "nodes" || key == "algorithm_param_file" ||
+            key == "trace_param_file" || key == "job_file" || key == "dburi") {
+            continue;
+        }
+        YAML::Node single;
+        single[key] = it->second;
+        merge(job_params, single);
+    }
+    for (auto &it: args) {
+        job_params[it.first] = {it.second};
+    }
+
+    //same precedence as get_task.py: default < per trace < per trace per algorithm < per trace per algorithm per
+    //cache size < job
+    vector<SweepTask> tasks;
+    for (auto &&trace_node: job["trace_files"]) {
+        auto trace_file = trace_node.as<string>();
+        const YAML::Node trace = trace_params[trace_file];
+        if (!trace) {
+            cerr << "error: trace " << trace_file << " not found in " << argv[3] << endl;
+            return 1;
+        }
+        for (auto &&cache_type_node: job["cache_types"]) {
+            auto cache_type = cache_type_node.as<string>();
+            for (auto &&cache_size_or_size_parameters: trace["cache_sizes"]) {
+                ParamSpace params;
+                if (default_algorithm_params[cache_type]) {
+                    merge(params, default_algorithm_params[cache_type]);
+                }
+                for (auto it = trace.begin(); it != trace.end(); ++it) {
+                    auto key = it->first.as<string>();
+                    if (key != "cache_sizes" && !default_algorithm_params[key] && !it->second.IsMap()) {
+                        YAML::Node single;
+                        single[key] = it->second;
+                        merge(params, single);
+                    }
+                }
+                if (trace[cache_type]) {
+                    merge(params, trace[cache_type]);
+                }
+                string cache_size;
+                if (cache_size_or_size_parameters.IsMap()) {
+                    if (cache_size_or_size_parameters.size() != 1) {
+                        cerr << "error: per cache size parameters must have a single cache size" << endl;
+                        return 1;
+                    }
+                    auto it = cache_size_or_size_parameters.begin();
+                    cache_size = it->first.as<string>();
+                    if (it->second[cache_type]) {
+                        merge(params, it->second[cache_type]);
+                    }
+                } else {
+                    cache_size = cache_size_or_size_parameters.as<string>();
+                }
+                for (auto &it: job_params) {
+                    params[it.first] = it.second;
+                }
+                for (auto &p: cartesian_product(params)) {
+                    tasks.push_back({string(webcachesim_trace_dir) + '/' + trace_file, cache_type,
+                                     stoull(cache_size), p});
+                }
+            }
+        }
+    }
+    cerr << "n_task: " << tasks.size() << endl;
+
+    auto n_failed = sweep(tasks, n_threads, argv[4]);
+    if (n_failed) {
+        cerr << "error: " << n_failed << " tasks failed, see " << argv[4] << endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -7,7 +7,7 @@ git submodule update --init --recursive
 set -e
 # assume current path is under webcachesim
 sudo apt-get update
-sudo apt install -y git cmake build-essential libboost-all-dev python3-pip parallel libprocps-dev software-properties-common
+sudo apt install -y git cmake build-essential libboost-all-dev python3-pip parallel libprocps-dev libyaml-cpp-dev software-properties-common
 # install openjdk 1.8. This is for simulating Adaptive-TinyLFU. The steps has to be one by one
 sudo add-apt-repository ppa:openjdk-r/ppa -y
 sudo apt-get update
@@ -17,6 +17,8 @@ Interface::Interface(const string &cache_type, const uint64_t &cache_size, const
         webcachesim_cache_type = "ParallelFIFO";
     } else if (cache_type == "LRB") {
         webcachesim_cache_type = "ParallelLRB";
+    } else if (cache_type == "ShardedLRB") {
+        webcachesim_cache_type = "ShardedParallelLRB";
     } else if (cache_type == "Static") {
         webcachesim_cache_type = "ParallelStatic";
     } else {
@@ -0,0 +1,189 @@
+//
+// Binary columnar trace format.
+//
+
+#include "binary_trace.h"
+#include "trace_reader.h"
+#include <iostream>
+#include <fstream>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace webcachesim {
+
+    MappedBinaryTrace::MappedBinaryTrace(const string &trace_file) {
+        int fd = open(trace_file.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw runtime_error("Exception opening file " + trace_file);
+        }
+        struct stat st{};
+        if (fstat(fd, &st) || st.st_size < (off_t) sizeof(BinaryTraceHeader)) {
+            close(fd);
+            throw runtime_error("Exception reading binary trace header " + trace_file);
+        }
+        length = st.st_size;
+        addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED) {
+            addr = nullptr;
+            throw runtime_error("Exception mapping file " + trace_file + ": " + strerror(errno));
+        }
+        //requests are consumed front to back
+        madvise(addr, length, MADV_SEQUENTIAL);
+
+        header = static_cast<const BinaryTraceHeader *>(addr);
+        string error;
+        if (memcmp(header->magic, binary_trace_magic, sizeof(binary_trace_magic)) ||
+            header->version != binary_trace_version) {
+            error = "Not a binary trace (or unsupported version): ";
+        } else if (header->n_extra_fields > max_n_extra_feature) {
+            error = "Binary trace has too many extra fields: ";
+        } else if (length < binary_trace_file_size(header->n_req, header->n_extra_fields)) {
+            error = "Binary trace is truncated: ";
+        }
+        if (!error.empty()) {
+            //destructor does not run for a throwing constructor
+            munmap(addr, length);
+            addr = nullptr;
+            throw runtime_error(error + trace_file);
+        }
+
+        auto base = static_cast<const char *>(addr) + sizeof(BinaryTraceHeader);
+        const uint64_t n = header->n_req;
+        t = reinterpret_cast<const int64_t *>(base);
+        id = reinterpret_cast<const uint64_t *>(base + n * sizeof(int64_t));
+        size = reinterpret_cast<const uint32_t *>(base + n * (sizeof(int64_t) + sizeof(uint64_t)));
+        auto extra_base = base + n * (sizeof(int64_t) + sizeof(uint64_t) + sizeof(uint32_t));
+        for (uint32_t i = 0; i < header->n_extra_fields; ++i) {
+            extra[i] = reinterpret_cast<const uint16_t *>(extra_base + i * n * sizeof(uint16_t));
+        }
+    }
+
+    MappedBinaryTrace::~MappedBinaryTrace() {
+        if (addr) {
+            munmap(addr, length);
+        }
+    }
+
+    bool is_binary_trace(const string &trace_file) {
+        ifstream infile(trace_file, ios::binary);
+        char magic[sizeof(binary_trace_magic)];
+        if (!infile.read(magic, sizeof(magic))) {
+            return false;
+        }
+        return !memcmp(magic, binary_trace_magic, sizeof(binary_trace_magic));
+    }
+
+    size_t binary_trace_file_size(const uint64_t &n_req, const uint32_t &n_extra_fields) {
+        return sizeof(BinaryTraceHeader) +
+               n_req * (sizeof(int64_t) + sizeof(uint64_t) + sizeof(uint32_t) + n_extra_fields * sizeof(uint16_t));
+    }
+
+    uint64_t convert_to_binary_trace(const string &text_trace_file, const string &binary_trace_file) {
+        const int max_fields = 3 + max_n_extra_feature;
+        int64_t fields[max_fields + 1];
+
+        //first pass: count requests and fields, as the columns are laid out back to back
+        uint64_t n_req = 0;
+        int n_fields = -1;
+        {
+            TextTraceScanner scanner(text_trace_file, 4 * 1024 * 1024);
+            int n;
+            while ((n = scanner.next_line(fields, max_fields + 1))) {
+                if (n_fields < 0) {
+                    n_fields = n;
+                    if (n_fields < 3 || n_fields > max_fields) {
+                        throw runtime_error("Expecting 3 to " + to_string(max_fields) + " fields per line, got " +
+                                            to_string(n_fields));
+                    }
+                } else if (n != n_fields) {
+                    throw runtime_error("Found unequal number of fields at request " + to_string(n_req));
+                }
+                //the binary columns are narrower than the text fields: refuse to truncate
+                if (fields[2] < 0 || fields[2] > UINT32_MAX) {
+                    throw runtime_error("Size out of uint32 range at trace line " + to_string(scanner.line()));
+                }
+                for (int j = 3; j < n_fields; ++j) {
+                    if (fields[j] < 0 || fields[j] > UINT16_MAX) {
+                        throw runtime_error("Extra feature out of uint16 range at trace line " +
+                                            to_string(scanner.line()));
+                    }
+                }
+                if (!(++n_req % 100000000)) {
+                    cerr << "counting requests: " << n_req << endl;
+                }
+            }
+        }
+        if (n_fields < 0) {
+            throw runtime_error("Empty trace " + text_trace_file);
+        }
+        const uint32_t n_extra_fields = n_fields - 3;
+        cerr << "converting " << n_req << " requests with " << n_extra_fields << " extra fields" << endl;
+
+        auto tmp_file = binary_trace_file + ".tmp";
+        int fd = open(tmp_file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw runtime_error("Exception opening file " + tmp_file);
+        }
+        size_t length = binary_trace_file_size(n_req, n_extra_fields);
+        if (ftruncate(fd, length)) {
+            close(fd);
+            throw runtime_error("Exception resizing file " + tmp_file + ": " + strerror(errno));
+        }
+        void *addr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED) {
+            throw runtime_error("Exception mapping file " + tmp_file + ": " + strerror(errno));
+        }
+
+        auto header = static_cast<BinaryTraceHeader *>(addr);
+        memset(header, 0, sizeof(BinaryTraceHeader));
+        memcpy(header->magic, binary_trace_magic, sizeof(binary_trace_magic));
+        header->version = binary_trace_version;
+        header->n_extra_fields = n_extra_fields;
+        header->n_req = n_req;
+
+        auto base = static_cast<char *>(addr) + sizeof(BinaryTraceHeader);
+        auto t_col = reinterpret_cast<int64_t *>(base);
+        auto id_col = reinterpret_cast<uint64_t *>(base + n_req * sizeof(int64_t));
+        auto size_col = reinterpret_cast<uint32_t *>(base + n_req * (sizeof(int64_t) + sizeof(uint64_t)));
+        auto extra_base = base + n_req * (sizeof(int64_t) + sizeof(uint64_t) + sizeof(uint32_t));
+        vector<uint16_t *> extra_cols(n_extra_fields);
+        for (uint32_t i = 0; i < n_extra_fields; ++i) {
+            extra_cols[i] = reinterpret_cast<uint16_t *>(extra_base + i * n_req * sizeof(uint16_t));
+        }
+
+        //second pass: fill in the columns
+        {
+            TextTraceScanner scanner(text_trace_file, 4 * 1024 * 1024);
+            for (uint64_t i = 0; i < n_req; ++i) {
+                scanner.next_line(fields, max_fields);
+                t_col[i] = fields[0];
+                id_col[i] = fields[1];
+                size_col[i] = fields[2];
+                for (uint32_t j = 0; j < n_extra_fields; ++j) {
+                    extra_cols[j][i] = fields[3 + j];
+                }
+                if (!((i + 1) % 100000000)) {
+                    cerr << "converting: " << i + 1 << endl;
+                }
+            }
+        }
+
+        msync(addr, length, MS_SYNC);
+        munmap(addr, length);
+        if (rename(tmp_file.c_str(), binary_trace_file.c_str())) {
+            throw runtime_error("Exception renaming file " + tmp_file + " to " + binary_trace_file + ": " +
+                                strerror(errno));
+        }
+        return n_req;
+    }
+}
@@ -4,110 +4,291 @@
 
 #include "annotate.h"
 #include <iostream>
-#include <fstream>
 #include <vector>
 #include <unordered_map>
+#include <atomic>
+#include <thread>
 #include <chrono>
 #include <cstdint>
 #include <cstring>
+#include <cstdio>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "trace_reader.h"
 
-//max to 4 billion (2**32-1)
-const uint64_t max_next_seq = 0xffffffff;
 using namespace std;
+using namespace webcachesim;
 
+namespace {
+    const char next_seq_magic[8] = {'W', 'C', 'S', 'N', 'S', 'E', 'Q', '\1'};
+    const size_t next_seq_header_size = sizeof(next_seq_magic) + sizeof(uint64_t);
+    //records kept in memory per bucket before appending them to its spill file
+    const size_t spill_buffer_size = 4096;
+    //rough per-request memory when annotating a bucket: the record plus its share of the last seen map
+    const uint64_t bytes_per_request = 64;
+    const uint max_n_bucket = 4096;
 
-void annotate(const string &trace_file, const int &n_extra_fields) {
-    /*
-     * assume trace is less than max(uint32_t)
-     * */
-    auto expect_file = trace_file+".ant";
-    ifstream cachefile(expect_file);
-    if (cachefile.good()) {
-        cerr<<"file has been annotated, so skip annotation"<<endl;
-        return;
-    }
+    struct IdSeq {
+        uint64_t id;
+        uint64_t seq;
+    };
+
+    //the tmp next_seq file and the bucket spill files of one annotation. Removed on destruction unless committed
+    class TmpFiles {
+    public:
+        TmpFiles(const string &prefix, const uint &n_bucket) : prefix(prefix), n_bucket(n_bucket) {}
+
+        TmpFiles(const TmpFiles &) = delete;
+
+        TmpFiles &operator=(const TmpFiles &) = delete;
 
-    // in the first path, hold ids; in the reverse path, hold next_seq
-    vector<uint64_t> id_and_next_seq;
+        ~TmpFiles() {
+            if (is_committed) {
+                return;
+            }
+            unlink(prefix.c_str());
+            for (uint b = 0; b < n_bucket; ++b) {
+                unlink(spill_file(b).c_str());
+            }
+        }
 
-    uint64_t id;
-    int64_t i = 0;
-    //not actually need t and size
-    uint64_t t, size;
-    vector<uint64_t> extra_features(n_extra_fields, 0);
+        const string &tmp_file() const {
+            return prefix;
+        }
 
-    ifstream infile(trace_file);
-    if (!infile) {
-        cerr << "Exception opening/reading annotate original file " << trace_file << endl;
-        exit(-1);
+        string spill_file(const uint &b) const {
+            return prefix + ".bucket." + to_string(b);
+        }
+
+        //the tmp file was renamed and the spill files consumed
+        void commit() {
+            is_committed = true;
+        }
+
+    private:
+        string prefix;
+        uint n_bucket;
+        bool is_committed = false;
+    };
+
+    inline uint bucket_of(const uint64_t &id, const uint &bucket_bits) {
+        //fibonacci hashing; bucket_bits is at least 1
+        return (id * 0x9E3779B97F4A7C15ull) >> (64 - bucket_bits);
     }
 
-    while(infile>> t >> id >> size) {
-        for (int j = 0; j < n_extra_fields; ++j)
-            infile >> extra_features[j];
-        if (!(++i%1000000))
-            cerr<<"reading origin trace: "<<i<<endl;
-        id_and_next_seq.emplace_back(id);
+    //only used to size the buckets, so a rough guess is fine
+    uint64_t estimate_n_req(const string &trace_file) {
+        if (is_binary_trace(trace_file)) {
+            return MappedBinaryTrace(trace_file).n_req();
+        }
+        struct stat st{};
+        if (stat(trace_file.c_str(), &st)) {
+            throw runtime_error("Exception opening file " + trace_file);
+        }
+        //shortest plausible line, so more rather than fewer buckets
+        return st.st_size / 10 + 1;
     }
 
-    uint64_t n_req = id_and_next_seq.size();
-    std::cerr << "scanned trace n=" << n_req << std::endl;
-    if (n_req > max_next_seq) {
-        cerr<<"Error: don't support more trace length than "<<max_next_seq<<endl;
-        abort();
+    void append_to_file(const string &file, const vector<IdSeq> &records) {
+        FILE *f = fopen(file.c_str(), "ab");
+        if (!f || fwrite(records.data(), sizeof(IdSeq), records.size(), f) != records.size()) {
+            throw runtime_error("Exception writing spill file " + file + ": " + strerror(errno));
+        }
+        fclose(f);
     }
 
-    // get nextSeen indices
-    // assume id has same size
-    unordered_map<uint64_t, uint32_t> last_seen;
-    for (i = n_req - 1; i >= 0; --i) {
-        uint64_t current_id = id_and_next_seq[i];
-        auto lit = last_seen.find(current_id);
-        if (lit != last_seen.end())
-            id_and_next_seq[i] = lit->second;
-        else
-            id_and_next_seq[i] = max_next_seq;
-        last_seen[current_id] = i;
-        if (!(i % 1000000))
-            cerr<<"computing next t: "<<i<<endl;
+    void read_file(const string &file, vector<IdSeq> &records) {
+        struct stat st{};
+        if (stat(file.c_str(), &st)) {
+            //bucket without any request
+            records.clear();
+            return;
+        }
+        records.resize(st.st_size / sizeof(IdSeq));
+        FILE *f = fopen(file.c_str(), "rb");
+        if (!f || fread(records.data(), sizeof(IdSeq), records.size(), f) != records.size()) {
+            throw runtime_error("Exception reading spill file " + file + ": " + strerror(errno));
+        }
+        fclose(f);
     }
+}
+
+string next_seq_file(const string &trace_file) {
+    return trace_file + ".next_seq";
+}
+
+void annotate(const string &trace_file, const int &n_extra_fields, uint n_threads, uint64_t memory_budget) {
+    auto expect_file = next_seq_file(trace_file);
+    struct stat st{};
+    if (!stat(expect_file.c_str(), &st)) {
+        cerr << "file has been annotated, so skip annotation" << endl;
+        return;
+    }
+
+    if (!n_threads) {
+        n_threads = max(1u, thread::hardware_concurrency());
+    }
+    const uint64_t n_req_estimate = estimate_n_req(trace_file);
+    //n_threads buckets are annotated concurrently, each has to fit in its share of the budget
+    const uint64_t bucket_capacity = max<uint64_t>(1, memory_budget / n_threads / bytes_per_request);
+    uint bucket_bits = 1;
+    while ((1u << bucket_bits) < max_n_bucket &&
+           ((1u << bucket_bits) < 4 * n_threads || (n_req_estimate >> bucket_bits) > bucket_capacity)) {
+        ++bucket_bits;
+    }
+    const uint n_bucket = 1u << bucket_bits;
+    //all records are held in memory at the end of the first pass unless spilled
+    const bool spill = n_req_estimate * sizeof(IdSeq) > memory_budget / 2;
 
-    // get current time
-    string now;
     auto timenow = chrono::system_clock::to_time_t(chrono::system_clock::now());
-    auto tmp_file = trace_file + ".ant.tmp." + to_string(timenow);
-    cerr<<"writing the annotated trace "<<tmp_file<<endl;
-
-    ofstream outfile(tmp_file);
-    if (!outfile) {
-        cerr << "Exception opening/reading tmp file " << tmp_file << endl;
-        exit(-1);
-    }
-
-    infile.clear();
-    infile.seekg(0, ios::beg);
-    //no need to write seq, which is implicit
-    for (i = 0; i < (uint32_t) n_req; ++i) {
-        infile >> t >> id >> size;
-        for (int j = 0; j < n_extra_fields; ++j)
-            infile >> extra_features[j];
-        outfile << id_and_next_seq[i] << " " << t << " " << id << " " << size;
-        for (int j = 0; j < n_extra_fields; ++j)
-            outfile << " " << extra_features[j];
-        outfile <<endl;
-        if (!(i % 1000000))
-            cerr<<"writing: "<<i<<endl;
-    }
-
-    outfile.close();
-
-    //fat has bug in renaming: cross link file system. Actually it's better to do this in python with c wrapper
-    //as not using /tmp, this is not a problem anymore
-//    system(("mv "+tmp_file+" "+expect_file).c_str());
+    auto tmp_prefix = expect_file + ".tmp." + to_string(timenow);
+    TmpFiles tmp_files(tmp_prefix, spill ? n_bucket : 0);
+    auto spill_file = [&](const uint &b) { return tmp_files.spill_file(b); };
+    cerr << "annotating with " << n_threads << " threads, " << n_bucket << " buckets"
+         << (spill ? ", spilling to " + tmp_prefix + ".bucket.*" : "") << endl;
+
+    // first pass: partition (id, seq) by id. Within a bucket records stay in seq order
+    vector<vector<IdSeq>> buckets(n_bucket);
+    uint64_t n_req = 0;
+    {
+        int64_t next_seq, t, id, size;
+        vector<uint16_t> extra_features(n_extra_fields, 0);
+        //the original trace can be either text or binary
+        auto reader = TraceReader::open(trace_file, false, n_extra_fields);
+        while (reader->read(next_seq, t, id, size, extra_features)) {
+            auto b = bucket_of(id, bucket_bits);
+            buckets[b].push_back({static_cast<uint64_t>(id), n_req});
+            if (spill && buckets[b].size() == spill_buffer_size) {
+                append_to_file(spill_file(b), buckets[b]);
+                buckets[b].clear();
+            }
+            if (!(++n_req % 10000000))
+                cerr << "reading origin trace: " << n_req << endl;
+        }
+        if (spill) {
+            for (uint b = 0; b < n_bucket; ++b) {
+                if (!buckets[b].empty()) {
+                    append_to_file(spill_file(b), buckets[b]);
+                }
+                vector<IdSeq>().swap(buckets[b]);
+            }
+        }
+    }
+    cerr << "scanned trace n=" << n_req << endl;
+
+    auto &tmp_file = tmp_files.tmp_file();
+    int fd = open(tmp_file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw runtime_error("Exception opening tmp file " + tmp_file);
+    }
+    const size_t length = next_seq_header_size + n_req * sizeof(uint64_t);
+    if (ftruncate(fd, length)) {
+        close(fd);
+        throw runtime_error("Exception resizing file " + tmp_file + ": " + strerror(errno));
+    }
+    void *addr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        throw runtime_error("Exception mapping file " + tmp_file + ": " + strerror(errno));
+    }
+    memcpy(addr, next_seq_magic, sizeof(next_seq_magic));
+    memcpy(static_cast<char *>(addr) + sizeof(next_seq_magic), &n_req, sizeof(n_req));
+    auto next_seq = reinterpret_cast<uint64_t *>(static_cast<char *>(addr) + next_seq_header_size);
+
+    // second pass: reverse scan of each bucket. A seq belongs to exactly one bucket, so writes do not overlap
+    atomic<uint> next_bucket(0);
+    atomic<uint> n_done(0);
+    vector<exception_ptr> errors(n_threads);
+    auto worker = [&](const uint &tid) {
+        try {
+            vector<IdSeq> spilled;
+            unordered_map<uint64_t, uint64_t> last_seen;
+            for (uint b = next_bucket++; b < n_bucket; b = next_bucket++) {
+                auto &records = spill ? spilled : buckets[b];
+                if (spill) {
+                    read_file(spill_file(b), records);
+                    remove(spill_file(b).c_str());
+                }
+                last_seen.clear();
+                last_seen.reserve(records.size());
+                for (auto it = records.rbegin(); it != records.rend(); ++it) {
+                    auto lit = last_seen.find(it->id);
+                    if (lit != last_seen.end()) {
+                        next_seq[it->seq] = lit->second;
+                        lit->second = it->seq;
+                    } else {
+                        next_seq[it->seq] = never_requested_again;
+                        last_seen.emplace(it->id, it->seq);
+                    }
+                }
+                vector<IdSeq>().swap(records);
+                auto done = ++n_done;
+                if (!(done % (n_bucket / 16 ? n_bucket / 16 : 1)))
+                    cerr << "computing next seq: " << done << "/" << n_bucket << " buckets" << endl;
+            }
+        } catch (...) {
+            errors[tid] = current_exception();
+        }
+    };
+    vector<thread> threads;
+    for (uint i = 0; i < n_threads; ++i) {
+        threads.emplace_back(worker, i);
+    }
+    for (auto &th: threads) {
+        th.join();
+    }
+    for (auto &e: errors) {
+        if (e) {
+            munmap(addr, length);
+            rethrow_exception(e);
+        }
+    }
+
+    msync(addr, length, MS_SYNC);
+    munmap(addr, length);
+
     if (rename(tmp_file.c_str(), expect_file.c_str())) {
         cerr << "Exception in renaming file from " << tmp_file << " to " << expect_file << " code: " << strerror(errno)
              << endl;
         return;
     }
+    tmp_files.commit();
+}
+
+MappedNextSeq::MappedNextSeq(const string &file) {
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw runtime_error("Exception opening file " + file);
+    }
+    struct stat st{};
+    if (fstat(fd, &st) || st.st_size < (off_t) next_seq_header_size) {
+        close(fd);
+        throw runtime_error("Exception reading next_seq header " + file);
+    }
+    length = st.st_size;
+    addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        addr = nullptr;
+        throw runtime_error("Exception mapping file " + file + ": " + strerror(errno));
+    }
+    madvise(addr, length, MADV_SEQUENTIAL);
 
+    memcpy(&n_req, static_cast<const char *>(addr) + sizeof(next_seq_magic), sizeof(n_req));
+    if (memcmp(addr, next_seq_magic, sizeof(next_seq_magic)) ||
+        length < next_seq_header_size + n_req * sizeof(uint64_t)) {
+        munmap(addr, length);
+        addr = nullptr;
+        throw runtime_error("Not a next_seq file (or truncated): " + file);
+    }
+    next_seq = reinterpret_cast<const uint64_t *>(static_cast<const char *>(addr) + next_seq_header_size);
+}
+
+MappedNextSeq::~MappedNextSeq() {
+    if (addr) {
+        munmap(addr, length);
+    }
 }
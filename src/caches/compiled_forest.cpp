@@ -0,0 +1,222 @@
+//
+// Flat-array evaluation of LightGBM regression forests.
+//
+
+#include "compiled_forest.h"
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+
+namespace {
+    //LightGBM kZeroThreshold
+    const double zero_threshold = 1e-35f;
+
+    //LightGBM writes "inf" for splits that only separate missing values, which operator>> rejects
+    template<class T>
+    T parse_value(const string &token) {
+        return static_cast<T>(stoll(token));
+    }
+
+    template<>
+    double parse_value<double>(const string &token) {
+        return strtod(token.c_str(), nullptr);
+    }
+
+    template<class T>
+    vector<T> parse_array(const map<string, string> &fields, const string &key, const size_t &n) {
+        vector<T> res;
+        auto it = fields.find(key);
+        if (it == fields.end()) {
+            if (!n) {
+                return res;
+            }
+            throw runtime_error("Exception compiling model: missing " + key);
+        }
+        istringstream ss(it->second);
+        string token;
+        while (ss >> token) {
+            res.push_back(parse_value<T>(token));
+        }
+        if (res.size() != n) {
+            throw runtime_error("Exception compiling model: expecting " + to_string(n) + " values of " + key);
+        }
+        return res;
+    }
+}
+
+void CompiledForest::compile(const string &model) {
+    *this = CompiledForest();
+    istringstream ss(model);
+    string line;
+    map<string, string> header;
+    //header until the first tree
+    while (getline(ss, line) && line.compare(0, 5, "Tree=") && line != "end of trees") {
+        auto pos = line.find('=');
+        if (pos != string::npos) {
+            header[line.substr(0, pos)] = line.substr(pos + 1);
+        }
+    }
+    if (header["num_tree_per_iteration"] != "1" || header["objective"].compare(0, 10, "regression") ||
+        header["objective"].find("sqrt") != string::npos) {
+        throw runtime_error("Exception compiling model: only single output regression without sqrt is supported");
+    }
+    max_feature_idx = stoi(header["max_feature_idx"]);
+
+    while (!line.compare(0, 5, "Tree=")) {
+        map<string, string> fields;
+        while (getline(ss, line) && !line.empty()) {
+            auto pos = line.find('=');
+            if (pos != string::npos) {
+                fields[line.substr(0, pos)] = line.substr(pos + 1);
+            }
+        }
+        if (fields.count("is_linear") && fields["is_linear"] != "0") {
+            throw runtime_error("Exception compiling model: linear trees are not supported");
+        }
+        const size_t n_leaf = stoul(fields["num_leaves"]);
+        const size_t n_internal = n_leaf - 1;
+        const size_t n_cat = fields.count("num_cat") ? stoul(fields["num_cat"]) : 0;
+        auto split_feature = parse_array<int32_t>(fields, "split_feature", n_internal);
+        auto thresholds = parse_array<double>(fields, "threshold", n_internal);
+        auto decision_types = parse_array<int>(fields, "decision_type", n_internal);
+        auto left_child = parse_array<int32_t>(fields, "left_child", n_internal);
+        auto right_child = parse_array<int32_t>(fields, "right_child", n_internal);
+        auto leaf_value = parse_array<double>(fields, "leaf_value", n_leaf);
+        vector<uint32_t> cat_boundaries, cat_thresholds;
+        if (n_cat) {
+            cat_boundaries = parse_array<uint32_t>(fields, "cat_boundaries", n_cat + 1);
+            cat_thresholds = parse_array<uint32_t>(fields, "cat_threshold", cat_boundaries.back());
+        }
+
+        const uint32_t cat_base = cat_threshold.size();
+        cat_threshold.insert(cat_threshold.end(), cat_thresholds.begin(), cat_thresholds.end());
+
+        /*
+         * breadth first layout with siblings next to each other: the right child is left_child + 1. Leaves are their
+         * own left child, with a threshold every feature (and NaN) goes left of
+         */
+        const uint32_t base = feature.size();
+        const size_t n_node = n_internal + n_leaf;
+        feature.resize(base + n_node, 0);
+        threshold.resize(base + n_node, numeric_limits<double>::infinity());
+        left_child_of.resize(base + n_node);
+        flags.resize(base + n_node, nan_left_flag);
+        decision_type.resize(base + n_node, 0);
+        value.resize(base + n_node, 0);
+        cat_begin.resize(base + n_node, 0);
+        cat_n_word.resize(base + n_node, 0);
+        //(LightGBM node: >= 0 internal, < 0 leaf, depth), in layout order starting at base
+        vector<pair<int32_t, uint32_t>> layout = {{n_internal ? 0 : -1, 0}};
+        uint32_t depth = 0;
+        for (uint32_t k = 0; k < layout.size(); ++k) {
+            const uint32_t node = base + k;
+            const int32_t lgbm_node = layout[k].first;
+            depth = max(depth, layout[k].second);
+            if (lgbm_node < 0) {
+                left_child_of[node] = node;
+                value[node] = leaf_value[~lgbm_node];
+                continue;
+            }
+            const uint8_t type = decision_types[lgbm_node];
+            const uint8_t missing_type = (type >> 2) & 3;
+            left_child_of[node] = base + layout.size();
+            layout.emplace_back(left_child[lgbm_node], layout[k].second + 1);
+            layout.emplace_back(right_child[lgbm_node], layout[k].second + 1);
+            feature[node] = split_feature[lgbm_node];
+            decision_type[node] = type;
+            if (type & categorical_mask) {
+                auto cat_idx = static_cast<size_t>(thresholds[lgbm_node]);
+                cat_begin[node] = cat_base + cat_boundaries.at(cat_idx);
+                cat_n_word[node] = cat_boundaries.at(cat_idx + 1) - cat_boundaries[cat_idx];
+                flags[node] = slow_flag;
+            } else {
+                threshold[node] = thresholds[lgbm_node];
+                if (missing_type == missing_zero) {
+                    flags[node] = slow_flag;
+                } else if (missing_type == missing_nan) {
+                    flags[node] = (type & default_left_mask) ? nan_left_flag : 0;
+                } else {
+                    //NaN is taken as 0
+                    flags[node] = 0 <= thresholds[lgbm_node] ? nan_left_flag : 0;
+                }
+            }
+        }
+        if (layout.size() != n_node) {
+            throw runtime_error("Exception compiling model: malformed tree");
+        }
+        tree_root.push_back(base);
+        tree_depth.push_back(depth);
+
+        //skip blank lines to the next tree or the end of trees
+        while (getline(ss, line) && line.empty());
+    }
+    if (line != "end of trees") {
+        throw runtime_error("Exception compiling model: unexpected line " + line);
+    }
+}
+
+bool CompiledForest::slow_is_left(const uint32_t &node, double fval) const {
+    const uint8_t type = decision_type[node];
+    const uint8_t missing_type = (type >> 2) & 3;
+    const bool is_nan = std::isnan(fval);
+    if (type & categorical_mask) {
+        //NaN and negative categories always go right
+        if (is_nan) {
+            return false;
+        }
+        const int64_t int_fval = static_cast<int64_t>(fval);
+        if (int_fval < 0) {
+            return false;
+        }
+        const uint64_t word = int_fval / 32;
+        return word < cat_n_word[node] && ((cat_threshold[cat_begin[node] + word] >> (int_fval % 32)) & 1);
+    }
+    if (is_nan && missing_type != missing_nan) {
+        fval = 0;
+    }
+    if ((missing_type == missing_zero && fval >= -zero_threshold && fval <= zero_threshold) ||
+        (missing_type == missing_nan && is_nan)) {
+        return type & default_left_mask;
+    }
+    return fval <= threshold[node];
+}
+
+template<class T>
+void CompiledForest::predict(const T *rows, const uint32_t &n_row, const uint32_t &n_col, double *scores) const {
+    if (static_cast<int64_t>(n_col) <= max_feature_idx) {
+        throw invalid_argument("error: model needs " + to_string(max_feature_idx + 1) + " features");
+    }
+    //rows are scored in blocks that stay in registers and L1
+    const uint32_t block_size = 64;
+    uint32_t nodes[block_size];
+    for (uint32_t i = 0; i < n_row; ++i) {
+        scores[i] = 0;
+    }
+    for (uint32_t begin = 0; begin < n_row; begin += block_size) {
+        const uint32_t n = min(block_size, n_row - begin);
+        const T *block = rows + static_cast<size_t>(begin) * n_col;
+        for (size_t t = 0; t < tree_root.size(); ++t) {
+            for (uint32_t i = 0; i < n; ++i) {
+                nodes[i] = tree_root[t];
+            }
+            //leaves point to themselves, so every row takes exactly depth steps
+            for (uint32_t d = 0; d < tree_depth[t]; ++d) {
+                for (uint32_t i = 0; i < n; ++i) {
+                    nodes[i] = next(nodes[i], block + static_cast<size_t>(i) * n_col);
+                }
+            }
+            for (uint32_t i = 0; i < n; ++i) {
+                scores[begin + i] += value[nodes[i]];
+            }
+        }
+    }
+}
+
+template void CompiledForest::predict<float>(const float *, const uint32_t &, const uint32_t &, double *) const;
+
+template void CompiledForest::predict<double>(const double *, const uint32_t &, const uint32_t &, double *) const;
@@ -1,6 +1,7 @@
 #include <unordered_map>
 #include <cassert>
 #include "gd_variants.h"
+#include "serialization.h"
 
 #ifdef CDEBUG
 #include <vector>
@@ -139,6 +140,42 @@ long double GreedyDualBase::ageValue(const SimpleRequest& req)
     return _currentL + 1.0;
 }
 
+void GreedyDualBase::serialize_gd(std::ostream &os)
+{
+#ifdef EVICTION_LOGGING
+    throw runtime_error("Error: checkpoint not supported with EVICTION_LOGGING");
+#endif
+    write_pod(os, _currentSize);
+    write_pod(os, _currentL);
+    write_pod(os, static_cast<uint64_t>(_valueMap.size()));
+    //ascending value, ties in insertion order
+    for (auto &it: _valueMap) {
+        write_pod(os, it.first);
+        write_pod(os, it.second);
+        write_pod(os, _sizemap[it.second]);
+    }
+}
+
+void GreedyDualBase::deserialize_gd(std::istream &is)
+{
+    uint64_t n;
+    read_pod(is, _currentSize);
+    read_pod(is, _currentL);
+    read_pod(is, n);
+    _valueMap.clear();
+    _cacheMap.clear();
+    _sizemap.clear();
+    for (uint64_t i = 0; i < n; ++i) {
+        long double value;
+        uint64_t obj, size;
+        read_pod(is, value);
+        read_pod(is, obj);
+        read_pod(is, size);
+        _cacheMap[obj] = _valueMap.emplace_hint(_valueMap.end(), value, obj);
+        _sizemap[obj] = size;
+    }
+}
+
 void GreedyDualBase::hit(const SimpleRequest& req)
 {
     auto & obj = req.id;
@@ -177,6 +214,31 @@ bool GDSFCache::lookup(const SimpleRequest& req)
     return hit;
 }
 
+void GDSFCache::serialize(std::ostream &os)
+{
+    serialize_gd(os);
+    write_pod(os, static_cast<uint64_t>(_reqsMap.size()));
+    for (auto &it: _reqsMap) {
+        write_pod(os, it.first);
+        write_pod(os, it.second);
+    }
+}
+
+void GDSFCache::deserialize(std::istream &is)
+{
+    deserialize_gd(is);
+    uint64_t n;
+    read_pod(is, n);
+    _reqsMap.clear();
+    _reqsMap.reserve(n);
+    for (uint64_t i = 0; i < n; ++i) {
+        uint64_t obj, n_req;
+        read_pod(is, obj);
+        read_pod(is, n_req);
+        _reqsMap[obj] = n_req;
+    }
+}
+
 long double GDSFCache::ageValue(const SimpleRequest& req)
 {
     auto & obj = req.id;
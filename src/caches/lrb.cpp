@@ -5,6 +5,7 @@
 #include "lrb.h"
 #include <algorithm>
 #include "utils.h"
+#include "serialization.h"
 #include <chrono>
 
 using namespace chrono;
@@ -13,68 +14,173 @@ using namespace lrb;
 
 void LRBCache::train() {
     ++n_retrain;
+    //at most one batch in flight: the previous model goes in first
+    if (training_thread.joinable()) {
+        install_model();
+    }
+    if (booster && training_mode != scratch) {
+        int start_iteration = 0;
+        if (training_mode == incremental) {
+            //make room for the new trees. The 1st tree holds the label mean (boost_from_average), so it stays
+            int n_tree;
+            LGBM_BoosterGetCurrentIteration(booster, &n_tree);
+            int n_drop = n_tree - (max_n_tree - stoi(training_params.at("num_iterations")));
+            if (n_drop > 0) {
+                background_init_head = model_to_string(0, 1);
+                start_iteration = 1 + n_drop;
+            }
+        }
+        background_init_model = model_to_string(start_iteration);
+    }
+    if (!async_training) {
+        fit(training_data);
+        install_model();
+        training_data->clear();
+        return;
+    }
+    swap(training_data, background_training_data);
+    model_install_seq = current_seq + async_training_delay;
+    training_thread = thread(&LRBCache::fit, this, background_training_data);
+}
+
+void LRBCache::fit(TrainingData *data) {
     auto timeBegin = chrono::system_clock::now();
-    if (booster) LGBM_BoosterFree(booster);
     // create training dataset
     DatasetHandle trainData;
-    LGBM_DatasetCreateFromCSR(
-            static_cast<void *>(training_data->indptr.data()),
-            C_API_DTYPE_INT32,
-            training_data->indices.data(),
-            static_cast<void *>(training_data->data.data()),
-            C_API_DTYPE_FLOAT64,
-            training_data->indptr.size(),
-            training_data->data.size(),
-            n_feature,  //remove future t
-            training_params,
-            nullptr,
-            &trainData);
+    LGBM_DatasetCreateFromMat(data->data.data(),
+                              C_API_DTYPE_FLOAT32,
+                              data->labels.size(),
+                              config.n_feature,  //remove future t
+                              1,
+                              training_params,
+                              nullptr,
+                              &trainData);
 
     LGBM_DatasetSetField(trainData,
                          "label",
-                         static_cast<void *>(training_data->labels.data()),
-                         training_data->labels.size(),
+                         static_cast<void *>(data->labels.data()),
+                         data->labels.size(),
                          C_API_DTYPE_FLOAT32);
 
+    int64_t len;
+    vector<double> result(data->labels.size());
+    BoosterHandle init_booster = nullptr;
+    if (!background_init_model.empty()) {
+        int n_iteration;
+        LGBM_BoosterLoadModelFromString(background_init_model.c_str(), &n_iteration, &init_booster);
+        if (!background_init_head.empty()) {
+            BoosterHandle head_booster;
+            LGBM_BoosterLoadModelFromString(background_init_head.c_str(), &n_iteration, &head_booster);
+            LGBM_BoosterMerge(init_booster, head_booster);
+            LGBM_BoosterFree(head_booster);
+        }
+    }
+    if (init_booster && training_mode == incremental) {
+        //new trees fit the residual of the kept trees on this batch
+        LGBM_BoosterPredictForMat(init_booster,
+                                  data->data.data(),
+                                  C_API_DTYPE_FLOAT32,
+                                  data->labels.size(),
+                                  config.n_feature,
+                                  1,
+                                  C_API_PREDICT_RAW_SCORE,
+                                  0,
+                                  training_params,
+                                  &len,
+                                  result.data());
+        LGBM_DatasetSetField(trainData,
+                             "init_score",
+                             static_cast<void *>(result.data()),
+                             result.size(),
+                             C_API_DTYPE_FLOAT64);
+    }
+
     // init booster
-    LGBM_BoosterCreate(trainData, training_params, &booster);
-    // train
-    for (int i = 0; i < stoi(training_params["num_iterations"]); i++) {
-        int isFinished;
-        LGBM_BoosterUpdateOneIter(booster, &isFinished);
-        if (isFinished) {
-            break;
+    LGBM_BoosterCreate(trainData, training_params, &background_booster);
+    if (init_booster && training_mode == refit) {
+        int n_tree;
+        LGBM_BoosterGetCurrentIteration(init_booster, &n_tree);
+        vector<double> leaf_result(data->labels.size() * n_tree);
+        LGBM_BoosterPredictForMat(init_booster,
+                                  data->data.data(),
+                                  C_API_DTYPE_FLOAT32,
+                                  data->labels.size(),
+                                  config.n_feature,
+                                  1,
+                                  C_API_PREDICT_LEAF_INDEX,
+                                  0,
+                                  training_params,
+                                  &len,
+                                  leaf_result.data());
+        vector<int32_t> leaf_index(leaf_result.begin(), leaf_result.end());
+        LGBM_BoosterMerge(background_booster, init_booster);
+        LGBM_BoosterRefit(background_booster, leaf_index.data(), data->labels.size(), n_tree);
+    } else {
+        // train
+        for (int i = 0; i < stoi(training_params.at("num_iterations")); i++) {
+            int isFinished;
+            LGBM_BoosterUpdateOneIter(background_booster, &isFinished);
+            if (isFinished) {
+                break;
+            }
+        }
+        if (init_booster) {
+            //the kept trees go in front of the new ones
+            LGBM_BoosterMerge(background_booster, init_booster);
         }
     }
+    if (init_booster) {
+        LGBM_BoosterFree(init_booster);
+    }
 
-    int64_t len;
-    vector<double> result(training_data->indptr.size() - 1);
-    LGBM_BoosterPredictForCSR(booster,
-                              static_cast<void *>(training_data->indptr.data()),
-                              C_API_DTYPE_INT32,
-                              training_data->indices.data(),
-                              static_cast<void *>(training_data->data.data()),
-                              C_API_DTYPE_FLOAT64,
-                              training_data->indptr.size(),
-                              training_data->data.size(),
-                              n_feature,  //remove future t
+    LGBM_BoosterPredictForMat(background_booster,
+                              data->data.data(),
+                              C_API_DTYPE_FLOAT32,
+                              data->labels.size(),
+                              config.n_feature,  //remove future t
+                              1,
                               C_API_PREDICT_NORMAL,
                               0,
                               training_params,
                               &len,
                               result.data());
 
-
     double se = 0;
     for (int i = 0; i < result.size(); ++i) {
-        auto diff = result[i] - training_data->labels[i];
+        auto diff = result[i] - data->labels[i];
         se += diff * diff;
     }
-    training_loss = training_loss * 0.99 + se / batch_size * 0.01;
+    background_se = se;
 
     LGBM_DatasetFree(trainData);
-    training_time = 0.95 * training_time +
-                    0.05 * chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now() - timeBegin).count();
+    background_training_time =
+            chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now() - timeBegin).count();
+}
+
+void LRBCache::install_model() {
+    if (training_thread.joinable()) {
+        training_thread.join();
+        background_training_data->clear();
+    }
+    if (booster) LGBM_BoosterFree(booster);
+    booster = background_booster;
+    background_booster = nullptr;
+    background_init_model.clear();
+    background_init_head.clear();
+    forest.compile(model_to_string());
+    model_seq = current_seq;
+    training_loss = training_loss * 0.99 + background_se / config.batch_size * 0.01;
+    training_time = 0.95 * training_time + 0.05 * background_training_time;
+}
+
+string LRBCache::model_to_string(const int &start_iteration, const int &n_iteration) const {
+    int64_t len;
+    LGBM_BoosterSaveModelToString(booster, start_iteration, n_iteration, 0, &len, nullptr);
+    string model(len, '\0');
+    LGBM_BoosterSaveModelToString(booster, start_iteration, n_iteration, len, &len, &model[0]);
+    //drop the terminating null
+    model.resize(len - 1);
+    return model;
 }
 
 void LRBCache::sample() {
@@ -86,12 +192,10 @@ void LRBCache::sample() {
     auto is_from_in = distribution_from_in(_generator);
     if (is_from_in == true) {
         uint32_t pos = rand_idx % n_in;
-        auto &meta = in_cache_metas[pos];
-        meta.emplace_sample(current_seq);
+        sample_times[in_cache_metas[pos]._key].emplace_back(current_seq);
     } else {
         uint32_t pos = rand_idx % n_out;
-        auto &meta = out_cache_metas[pos];
-        meta.emplace_sample(current_seq);
+        sample_times[out_cache_metas[pos]._key].emplace_back(current_seq);
     }
 }
 
@@ -132,7 +236,7 @@ void LRBCache::update_stat_periodic() {
     cerr
             << "in/out metadata: " << in_cache_metas.size() << " / " << out_cache_metas.size() << endl
             //    cerr << "feature overhead: "<<feature_overhead<<endl;
-            << "memory_window: " << memory_window << endl
+            << "memory_window: " << config.memory_window << endl
 //            << "percent_beyond: " << percent_beyond << endl
 //            << "feature overhead per entry: " << static_cast<double>(feature_overhead) / key_map.size() << endl
 //            //    cerr << "sample overhead: "<<sample_overhead<<endl;
@@ -148,8 +252,12 @@ void LRBCache::update_stat_periodic() {
 bool LRBCache::lookup(const SimpleRequest &req) {
     bool ret;
     ++current_seq;
+    if (training_thread.joinable() && current_seq == model_install_seq) {
+        install_model();
+    }
 
 #ifdef EVICTION_LOGGING
+    logging_seq = current_seq;
     {
         AnnotatedRequest *_req = (AnnotatedRequest *) &req;
         auto it = future_timestamps.find(_req->_id);
@@ -161,6 +269,9 @@ bool LRBCache::lookup(const SimpleRequest &req) {
     }
 #endif
     forget();
+    if (window_tuning) {
+        tune_window(req);
+    }
 
     //first update the metadata: insert/update, which can trigger pending data.mature
     auto it = key_map.find(req.id);
@@ -171,27 +282,23 @@ bool LRBCache::lookup(const SimpleRequest &req) {
         //update past timestamps
         assert(meta._key == req.id);
         uint64_t last_timestamp = meta._past_timestamp;
-        uint64_t forget_timestamp = last_timestamp % memory_window;
         //if the key in out_metadata, it must also in forget table
-        assert((!list_idx) ||
-               (negative_candidate_queue->find(forget_timestamp) !=
-                negative_candidate_queue->end()));
+        assert((!list_idx) || (negative_candidate_queue.contains(last_timestamp, list_pos)));
         //re-request
-        if (!meta._sample_times.empty()) {
+        auto sample_it = sample_times.find(meta._key);
+        if (sample_it != sample_times.end()) {
             //mature
-            for (auto &sample_time: meta._sample_times) {
+            for (auto &sample_time: sample_it->second) {
                 //don't use label within the first forget window because the data is not static
                 uint32_t future_distance = current_seq - sample_time;
                 training_data->emplace_back(meta, sample_time, future_distance, meta._key);
                 ++training_data_distribution[1];
             }
+            sample_times.erase(sample_it);
             //batch_size ~>= batch_size
-            if (training_data->labels.size() >= batch_size) {
+            if (training_data->labels.size() >= config.batch_size) {
                 train();
-                training_data->clear();
             }
-            meta._sample_times.clear();
-            meta._sample_times.shrink_to_fit();
         }
 
 #ifdef EVICTION_LOGGING
@@ -202,7 +309,7 @@ bool LRBCache::lookup(const SimpleRequest &req) {
                 uint32_t future_distance = req.seq - sample_time;
                 eviction_training_data->emplace_back(meta, sample_time, future_distance, meta._key);
                 //training
-                if (eviction_training_data->labels.size() == batch_size) {
+                if (eviction_training_data->labels.size() == config.batch_size) {
                     eviction_training_data->clear();
                 }
             }
@@ -214,18 +321,16 @@ bool LRBCache::lookup(const SimpleRequest &req) {
         //make this update after update training, otherwise the last timestamp will change
 #ifdef EVICTION_LOGGING
         AnnotatedRequest *_req = (AnnotatedRequest *) &req;
-        meta.update(current_seq, _req->_next_seq);
+        meta.update(current_seq, _req->_next_seq, config);
 #else
-        meta.update(current_seq);
+        meta.update(current_seq, config);
 #endif
         if (list_idx) {
-            negative_candidate_queue->erase(forget_timestamp);
-            negative_candidate_queue->insert({current_seq % memory_window, req.id});
-            assert(negative_candidate_queue->find(current_seq % memory_window) !=
-                   negative_candidate_queue->end());
+            negative_candidate_queue.erase(last_timestamp, list_pos);
+            negative_candidate_queue.insert(current_seq, list_pos);
         } else {
-            auto *p = dynamic_cast<InCacheMeta *>(&meta);
-            p->p_last_request = in_cache_lru_queue.re_request(p->p_last_request);
+            in_cache_lru_queue.re_request(list_pos);
+            in_cache_metas[list_pos].score_seq = 0;
         }
         //update negative_candidate_queue
         ret = !list_idx;
@@ -244,61 +349,160 @@ bool LRBCache::lookup(const SimpleRequest &req) {
 
 void LRBCache::forget() {
     /*
-     * forget happens exactly after the beginning of each time, without doing any other operations. For example, an
-     * object is request at time 0 with memory window = 5, and will be forgotten exactly at the start of time 5.
+     * forget happens after the beginning of each time, without doing any other operations. For example, an object is
+     * request at time 0 with memory window = 5, and will be forgotten at the start of time 5, or up to the bucket
+     * width of the forget table later.
      * */
-    //remove item from forget table, which is not going to be affect from update
-    auto it = negative_candidate_queue->find(current_seq % memory_window);
-    if (it != negative_candidate_queue->end()) {
-        auto forget_key = it->second;
-        auto pos = key_map.find(forget_key)->second.list_pos;
-        // Forget only happens at list 1
-        assert(key_map.find(forget_key)->second.list_idx);
-//        auto pos = meta_it->second.list_pos;
-//        bool meta_id = meta_it->second.list_idx;
-        auto &meta = out_cache_metas[pos];
-
-        //timeout mature
-        if (!meta._sample_times.empty()) {
-            //mature
-            //todo: potential to overfill
-            uint32_t future_distance = memory_window * 2;
-            for (auto &sample_time: meta._sample_times) {
-                //don't use label within the first forget window because the data is not static
-                training_data->emplace_back(meta, sample_time, future_distance, meta._key);
-                ++training_data_distribution[0];
-            }
-            //batch_size ~>= batch_size
-            if (training_data->labels.size() >= batch_size) {
-                train();
-                training_data->clear();
-            }
-            meta._sample_times.clear();
-            meta._sample_times.shrink_to_fit();
+    negative_candidate_queue.expire(current_seq, [this](const uint32_t &pos) { forget(pos); });
+}
+
+void LRBCache::forget(uint32_t pos) {
+    // Forget only happens at list 1
+    auto &meta = out_cache_metas[pos];
+    auto forget_key = meta._key;
+    assert(key_map.find(forget_key)->second.list_idx);
+
+    //timeout mature
+    auto sample_it = sample_times.find(meta._key);
+    if (sample_it != sample_times.end()) {
+        //mature
+        //todo: potential to overfill
+        uint32_t future_distance = config.memory_window * 2;
+        for (auto &sample_time: sample_it->second) {
+            //don't use label within the first forget window because the data is not static
+            training_data->emplace_back(meta, sample_time, future_distance, meta._key);
+            ++training_data_distribution[0];
+        }
+        sample_times.erase(sample_it);
+        //batch_size ~>= batch_size
+        if (training_data->labels.size() >= config.batch_size) {
+            train();
         }
+    }
 
 #ifdef EVICTION_LOGGING
-        //timeout mature
-        if (!meta._eviction_sample_times.empty()) {
-            //mature
-            //todo: potential to overfill
-            uint32_t future_distance = memory_window * 2;
-            for (auto &sample_time: meta._eviction_sample_times) {
-                //don't use label within the first forget window because the data is not static
-                eviction_training_data->emplace_back(meta, sample_time, future_distance, meta._key);
-                //training
-                if (eviction_training_data->labels.size() == batch_size) {
-                    eviction_training_data->clear();
-                }
+    //timeout mature
+    if (!meta._eviction_sample_times.empty()) {
+        //mature
+        //todo: potential to overfill
+        uint32_t future_distance = config.memory_window * 2;
+        for (auto &sample_time: meta._eviction_sample_times) {
+            //don't use label within the first forget window because the data is not static
+            eviction_training_data->emplace_back(meta, sample_time, future_distance, meta._key);
+            //training
+            if (eviction_training_data->labels.size() == config.batch_size) {
+                eviction_training_data->clear();
             }
-            meta._eviction_sample_times.clear();
-            meta._eviction_sample_times.shrink_to_fit();
         }
+        meta._eviction_sample_times.clear();
+        meta._eviction_sample_times.shrink_to_fit();
+    }
 #endif
 
-        assert(meta._key == forget_key);
-        remove_from_outcache_metas(meta, pos, forget_key);
+    assert(meta._key == forget_key);
+    remove_from_outcache_metas(meta, pos, forget_key);
+}
+
+void LRBCache::init_window_tuning(const map<string, string> &params) {
+    if (window_tuning_n_candidate < 2 || !(window_tuning_factor > 1) || !window_tuning_segment) {
+        throw invalid_argument("error: window_tuning needs >= 2 candidates, a factor > 1 and a positive segment");
+    }
+    auto shadow_size = static_cast<uint64_t>(_cacheSize * window_tuning_sample_rate);
+    if (shadow_size < window_tuning_min_shadow_size) {
+        throw invalid_argument("error: window_tuning shadow size " + to_string(shadow_size) + " out of range, cache "
+                               "size * window_tuning_sample_rate must be at least " +
+                               to_string(window_tuning_min_shadow_size));
+    }
+    window_tuning_sampler.reset(new SpatialSampler(window_tuning_sample_rate, 0));
+    window_tuning_idx = window_tuning_n_candidate / 2;
+    for (uint32_t i = 0; i < window_tuning_n_candidate; ++i) {
+        double window = config.memory_window * pow(window_tuning_factor, static_cast<double>(i) - window_tuning_idx);
+        if (window > UINT32_MAX / 2 || window * window_tuning_sample_rate < pow(2, config.base_edc_window)) {
+            throw invalid_argument("error: window_tuning candidate " + to_string(window) + " out of range, the "
+                                   "sampled window must be at least 2^base_edc_window");
+        }
+        window_tuning_candidates.emplace_back(window);
+    }
+    window_tuning_candidates[window_tuning_idx] = config.memory_window;
+
+    map<string, string> shadow_params;
+    for (auto &it: params) {
+        if (it.first.compare(0, 13, "window_tuning")) {
+            shadow_params.insert(it);
+        }
+    }
+    shadow_params["batch_size"] = to_string(max<uint32_t>(1024, config.batch_size * window_tuning_sample_rate));
+    for (auto &window: window_tuning_candidates) {
+        auto shadow = new LRBCache();
+        window_tuning_shadows.emplace_back(shadow);
+        shadow->setSize(shadow_size);
+        shadow_params["memory_window"] = to_string(static_cast<uint32_t>(window * window_tuning_sample_rate));
+        shadow->init_with_params(shadow_params);
+    }
+    window_tuning_byte_miss_ratio.assign(window_tuning_n_candidate, -1);
+    window_tuning_segment_byte_miss.assign(window_tuning_n_candidate, 0);
+}
+
+void LRBCache::tune_window(const SimpleRequest &req) {
+    if (current_seq && !(current_seq % window_tuning_segment) && window_tuning_segment_byte_req) {
+        bool is_trained = true;
+        for (auto &shadow: window_tuning_shadows) {
+            is_trained = is_trained && shadow->booster;
+        }
+        //untrained shadows are all LRU: nothing to compare yet
+        if (is_trained) {
+            uint32_t best = 0;
+            for (uint32_t i = 0; i < window_tuning_n_candidate; ++i) {
+                double ratio = static_cast<double>(window_tuning_segment_byte_miss[i]) / window_tuning_segment_byte_req;
+                auto &smoothed = window_tuning_byte_miss_ratio[i];
+                smoothed = smoothed < 0 ? ratio : 0.5 * smoothed + 0.5 * ratio;
+                if (smoothed < window_tuning_byte_miss_ratio[best]) {
+                    best = i;
+                }
+            }
+            if (best != window_tuning_idx) {
+                window_tuning_idx += best > window_tuning_idx ? 1 : -1;
+                set_memory_window(window_tuning_candidates[window_tuning_idx]);
+                window_tuning_changes.emplace_back(current_seq, config.memory_window);
+            }
+        }
+        fill(window_tuning_segment_byte_miss.begin(), window_tuning_segment_byte_miss.end(), 0);
+        window_tuning_segment_byte_req = 0;
+    }
+
+    if (!window_tuning_sampler->sample(req.id)) {
+        return;
+    }
+    window_tuning_segment_byte_req += req.size;
+    for (uint32_t i = 0; i < window_tuning_n_candidate; ++i) {
+        auto &shadow = window_tuning_shadows[i];
+        //follow the live cache size, which the simulation may adjust
+        uint64_t shadow_size = _cacheSize * window_tuning_sample_rate;
+        if (shadow->_cacheSize != shadow_size) {
+            shadow->setSize(shadow_size);
+        }
+        if (!shadow->lookup(req)) {
+            window_tuning_segment_byte_miss[i] += req.size;
+            shadow->admit(req);
+        }
+    }
+}
+
+void LRBCache::set_memory_window(const uint32_t &memory_window) {
+    config.memory_window = memory_window;
+    config.init_edc();
+    //scanning backward, removal swaps in a tail meta that is already checked
+    for (uint32_t pos = out_cache_metas.size(); pos-- > 0;) {
+        if (current_seq - out_cache_metas[pos]._past_timestamp >= memory_window) {
+            forget(pos);
+        }
+    }
+    negative_candidate_queue = TimerWheel(memory_window);
+    for (uint32_t pos = 0; pos < out_cache_metas.size(); ++pos) {
+        negative_candidate_queue.insert(out_cache_metas[pos]._past_timestamp, pos);
     }
+    //cached scores are of the old features
+    model_seq = current_seq;
 }
 
 void LRBCache::admit(const SimpleRequest &req) {
@@ -313,13 +517,13 @@ void LRBCache::admit(const SimpleRequest &req) {
     if (it == key_map.end()) {
         //fresh insert
         key_map.insert({req.id, {0, (uint32_t) in_cache_metas.size()}});
-        auto lru_it = in_cache_lru_queue.request(req.id);
 #ifdef EVICTION_LOGGING
         AnnotatedRequest *_req = (AnnotatedRequest *) &req;
-        in_cache_metas.emplace_back(req.id, req.size, current_seq, req.extra_features, _req->_next_seq, lru_it);
+        in_cache_metas.emplace_back(req.id, req.size, current_seq, req.extra_features, _req->_next_seq, config);
 #else
-        in_cache_metas.emplace_back(req.id, req.size, current_seq, req.extra_features, lru_it);
+        in_cache_metas.emplace_back(req.id, req.size, current_seq, req.extra_features, config);
 #endif
+        in_cache_lru_queue.request(in_cache_metas.size() - 1);
         _currentSize += size;
         //this must be a fresh insert
 //        negative_candidate_queue.insert({(current_seq + memory_window)%memory_window, req.id});
@@ -330,14 +534,14 @@ void LRBCache::admit(const SimpleRequest &req) {
         //first move meta data, then modify hash table
         uint32_t tail0_pos = in_cache_metas.size();
         auto &meta = out_cache_metas[it->second.list_pos];
-        auto forget_timestamp = meta._past_timestamp % memory_window;
-        negative_candidate_queue->erase(forget_timestamp);
-        auto it_lru = in_cache_lru_queue.request(req.id);
-        in_cache_metas.emplace_back(out_cache_metas[it->second.list_pos], it_lru);
+        negative_candidate_queue.erase(meta._past_timestamp, it->second.list_pos);
+        in_cache_metas.emplace_back(out_cache_metas[it->second.list_pos]);
+        in_cache_lru_queue.request(tail0_pos);
         uint32_t tail1_pos = out_cache_metas.size() - 1;
         if (it->second.list_pos != tail1_pos) {
             //swap tail
             out_cache_metas[it->second.list_pos] = out_cache_metas[tail1_pos];
+            negative_candidate_queue.update(out_cache_metas[tail1_pos]._past_timestamp, tail1_pos, it->second.list_pos);
             key_map.find(out_cache_metas[tail1_pos]._key)->second.list_pos = it->second.list_pos;
         }
         out_cache_metas.pop_back();
@@ -355,130 +559,96 @@ void LRBCache::admit(const SimpleRequest &req) {
 }
 
 
-pair<uint64_t, uint32_t> LRBCache::rank() {
+bool LRBCache::rank() {
+    victims.clear();
     {
         //if not trained yet, or in_cache_lru past memory window, use LRU
-        auto &candidate_key = in_cache_lru_queue.dq.back();
-        auto it = key_map.find(candidate_key);
-        auto pos = it->second.list_pos;
+        auto pos = in_cache_lru_queue.tail;
         auto &meta = in_cache_metas[pos];
-        if ((!booster) || (memory_window <= current_seq - meta._past_timestamp)) {
+        if ((!booster) || (config.memory_window <= current_seq - meta._past_timestamp)) {
             //this use LRU force eviction, consider sampled a beyond boundary object
             if (booster) {
                 ++obj_distribution[1];
             }
-            return {meta._key, pos};
+            victims.emplace_back(meta._key, pos);
+            return false;
         }
     }
 
 
-    int32_t indptr[sample_rate + 1];
-    indptr[0] = 0;
-    int32_t indices[sample_rate * n_feature];
-    double data[sample_rate * n_feature];
-    int32_t past_timestamps[sample_rate];
-    uint32_t sizes[sample_rate];
-
-    unordered_set<uint64_t> key_set;
-    uint64_t keys[sample_rate];
-    uint32_t poses[sample_rate];
-    //next_past_timestamp, next_size = next_indptr - 1
+    auto &ws = rank_workspace;
+    float *data = ws.data.get();
+    uint32_t *sizes = ws.sizes.data();
+    uint64_t *keys = ws.keys.data();
+    uint32_t *poses = ws.poses.data();
+    double *scores = ws.scores.data();
+    uint32_t *predict_rows = ws.predict_rows.data();
+    ws.new_round();
 
-    unsigned int idx_feature = 0;
     unsigned int idx_row = 0;
+    unsigned int n_predict = 0;
+    //a small cache (e.g., a window tuning shadow) may hold fewer objects than sample_rate
+    const uint32_t n_sample = min<size_t>(sample_rate, in_cache_metas.size());
+    const uint32_t n_victim = min(max_evictions_per_inference, n_sample);
 
-    auto n_new_sample = sample_rate - idx_row;
-    while (idx_row != sample_rate) {
+    auto n_new_sample = n_sample - idx_row;
+    while (idx_row != n_sample) {
         uint32_t pos = _distribution(_generator) % in_cache_metas.size();
-        auto &meta = in_cache_metas[pos];
-        if (key_set.find(meta._key) != key_set.end()) {
+        //positions are unique per key
+        if (!ws.insert(pos)) {
             continue;
-        } else {
-            key_set.insert(meta._key);
         }
+        auto &meta = in_cache_metas[pos];
 #ifdef EVICTION_LOGGING
         meta.emplace_eviction_sample(current_seq);
 #endif
 
         keys[idx_row] = meta._key;
         poses[idx_row] = pos;
-        //fill in past_interval
-        indices[idx_feature] = 0;
-        data[idx_feature++] = current_seq - meta._past_timestamp;
-        past_timestamps[idx_row] = meta._past_timestamp;
-
-        uint8_t j = 0;
-        uint32_t this_past_distance = 0;
-        uint8_t n_within = 0;
-        if (meta._extra) {
-            for (j = 0; j < meta._extra->_past_distance_idx && j < max_n_past_distances; ++j) {
-                uint8_t past_distance_idx = (meta._extra->_past_distance_idx - 1 - j) % max_n_past_distances;
-                uint32_t &past_distance = meta._extra->_past_distances[past_distance_idx];
-                this_past_distance += past_distance;
-                indices[idx_feature] = j + 1;
-                data[idx_feature++] = past_distance;
-                if (this_past_distance < memory_window) {
-                    ++n_within;
-                }
-//                } else
-//                    break;
+        bool is_cached = false;
+        if (score_cache_staleness) {
+            ++n_score_lookup;
+            //a hit or a model swap voids the score, otherwise age it: the next request is that much closer
+            if (meta.score_seq > model_seq && current_seq - meta.score_seq <= score_cache_staleness) {
+                ++n_score_hit;
+                is_cached = true;
+                scores[idx_row] = log1p(max(expm1(static_cast<double>(meta.score)) -
+                                            (current_seq - meta.score_seq), 0.));
             }
         }
-
-        indices[idx_feature] = max_n_past_timestamps;
-        data[idx_feature++] = meta._size;
-        sizes[idx_row] = meta._size;
-
-        for (uint k = 0; k < n_extra_fields; ++k) {
-            indices[idx_feature] = max_n_past_timestamps + k + 1;
-            data[idx_feature++] = meta._extra_features[k];
+        if (!is_cached) {
+            meta.features(current_seq, &data[n_predict * config.n_feature], config);
+            predict_rows[n_predict++] = idx_row;
         }
-
-        indices[idx_feature] = max_n_past_timestamps + n_extra_fields + 1;
-        data[idx_feature++] = n_within;
-
-        for (uint8_t k = 0; k < n_edc_feature; ++k) {
-            indices[idx_feature] = max_n_past_timestamps + n_extra_fields + 2 + k;
-            uint32_t _distance_idx = min(uint32_t(current_seq - meta._past_timestamp) / edc_windows[k],
-                                         max_hash_edc_idx);
-            if (meta._extra)
-                data[idx_feature++] = meta._extra->_edc[k] * hash_edc[_distance_idx];
-            else
-                data[idx_feature++] = hash_edc[_distance_idx];
-        }
-        //remove future t
-        indptr[++idx_row] = idx_feature;
+        sizes[idx_row] = meta._size;
+        ++idx_row;
     }
 
-    int64_t len;
-    double scores[sample_rate];
+    double *predictions = ws.predictions.data();
     system_clock::time_point timeBegin;
     //sample to measure inference time
     if (!(current_seq % 10000))
         timeBegin = chrono::system_clock::now();
-    LGBM_BoosterPredictForCSR(booster,
-                              static_cast<void *>(indptr),
-                              C_API_DTYPE_INT32,
-                              indices,
-                              static_cast<void *>(data),
-                              C_API_DTYPE_FLOAT64,
-                              idx_row + 1,
-                              idx_feature,
-                              n_feature,  //remove future t
-                              C_API_PREDICT_NORMAL,
-                              0,
-                              inference_params,
-                              &len,
-                              scores);
+    if (n_predict) {
+        forest.predict(data, n_predict, config.n_feature, predictions);
+    }
     if (!(current_seq % 10000))
         inference_time = 0.95 * inference_time +
                          0.05 *
                          chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now() - timeBegin).count();
+    for (uint32_t i = 0; i < n_predict; ++i) {
+        scores[predict_rows[i]] = predictions[i];
+        if (score_cache_staleness) {
+            auto &meta = in_cache_metas[poses[predict_rows[i]]];
+            meta.score = static_cast<float>(predictions[i]);
+            meta.score_seq = current_seq;
+        }
+    }
 //    for (int i = 0; i < n_sample; ++i)
 //        result[i] -= (t - past_timestamps[i]);
-    for (int i = sample_rate - n_new_sample; i < sample_rate; ++i) {
+    for (int i = n_sample - n_new_sample; i < n_sample; ++i) {
         //only monitor at the end of change interval
-        if (scores[i] >= log1p(memory_window)) {
+        if (scores[i] >= log1p(config.memory_window)) {
             ++obj_distribution[1];
         } else {
             ++obj_distribution[0];
@@ -486,39 +656,36 @@ pair<uint64_t, uint32_t> LRBCache::rank() {
     }
 
     if (objective == object_miss_ratio) {
-        for (uint32_t i = 0; i < sample_rate; ++i)
+        for (uint32_t i = 0; i < n_sample; ++i)
             scores[i] *= sizes[i];
     }
 
-    vector<int> index(sample_rate, 0);
-    for (int i = 0; i < index.size(); ++i) {
-        index[i] = i;
+    //only the top n_victim need an order
+    uint32_t *index = ws.index.data();
+    if (n_victim == 1) {
+        index[0] = static_cast<uint32_t>(max_element(scores, scores + n_sample) - scores);
+    } else {
+        for (uint32_t i = 0; i < n_sample; ++i) {
+            index[i] = i;
+        }
+        partial_sort(index, index + n_victim, index + n_sample,
+                     [&](const uint32_t &a, const uint32_t &b) {
+                         return (scores[a] > scores[b]);
+                     }
+        );
     }
 
-    sort(index.begin(), index.end(),
-         [&](const int &a, const int &b) {
-             return (scores[a] > scores[b]);
-         }
-    );
-
 #ifdef EVICTION_LOGGING
     {
         if (start_train_logging) {
 //            training_and_prediction_logic_timestamps.emplace_back(current_seq / 65536);
-            for (int i = 0; i < sample_rate; ++i) {
-                int current_idx = indptr[i];
-                for (int p = 0; p < n_feature; ++p) {
-                    if (p == indices[current_idx]) {
-                        trainings_and_predictions.emplace_back(data[current_idx]);
-                        if (current_idx + 1 < indptr[i + 1])
-                            ++current_idx;
-                    } else
-                        trainings_and_predictions.emplace_back(NAN);
-                }
+            for (int i = 0; i < n_sample; ++i) {
+                trainings_and_predictions.insert(trainings_and_predictions.end(), data + i * config.n_feature,
+                                                 data + (i + 1) * config.n_feature);
                 uint32_t future_interval = future_timestamps.find(keys[i])->second - current_seq;
-                future_interval = min(2 * memory_window, future_interval);
+                future_interval = min(2 * config.memory_window, future_interval);
                 trainings_and_predictions.emplace_back(future_interval);
-                trainings_and_predictions.emplace_back(result[i]);
+                trainings_and_predictions.emplace_back(scores[i]);
                 trainings_and_predictions.emplace_back(current_seq);
                 trainings_and_predictions.emplace_back(1);
                 trainings_and_predictions.emplace_back(keys[i]);
@@ -527,13 +694,29 @@ pair<uint64_t, uint32_t> LRBCache::rank() {
     }
 #endif
 
-    return {keys[index[0]], poses[index[0]]};
+    for (uint i = 0; i < n_victim; ++i) {
+        victims.emplace_back(keys[index[i]], poses[index[i]]);
+    }
+    return true;
 }
 
 void LRBCache::evict() {
-    auto epair = rank();
-    uint64_t &key = epair.first;
-    uint32_t &old_pos = epair.second;
+    bool is_inference = rank();
+    evict(victims[0].first, victims[0].second);
+    uint n_eviction = 1;
+    for (; n_eviction < victims.size() && _currentSize > _cacheSize; ++n_eviction) {
+        //the evictions before may have moved the victim to fill their place
+        auto it = key_map.find(victims[n_eviction].first);
+        assert(it != key_map.end() && !it->second.list_idx);
+        evict(victims[n_eviction].first, it->second.list_pos);
+    }
+    if (is_inference) {
+        ++n_inference;
+        n_inference_eviction += n_eviction;
+    }
+}
+
+void LRBCache::evict(const uint64_t &key, const uint32_t &old_pos) {
 
 #ifdef EVICTION_LOGGING
     {
@@ -547,35 +730,34 @@ void LRBCache::evict() {
 #endif
 
     auto &meta = in_cache_metas[old_pos];
-    if (memory_window <= current_seq - meta._past_timestamp) {
+    if (config.memory_window <= current_seq - meta._past_timestamp) {
         //must be the tail of lru
-        if (!meta._sample_times.empty()) {
+        auto sample_it = sample_times.find(meta._key);
+        if (sample_it != sample_times.end()) {
             //mature
-            uint32_t future_distance = current_seq - meta._past_timestamp + memory_window;
-            for (auto &sample_time: meta._sample_times) {
+            uint32_t future_distance = current_seq - meta._past_timestamp + config.memory_window;
+            for (auto &sample_time: sample_it->second) {
                 //don't use label within the first forget window because the data is not static
                 training_data->emplace_back(meta, sample_time, future_distance, meta._key);
                 ++training_data_distribution[0];
             }
+            sample_times.erase(sample_it);
             //batch_size ~>= batch_size
-            if (training_data->labels.size() >= batch_size) {
+            if (training_data->labels.size() >= config.batch_size) {
                 train();
-                training_data->clear();
             }
-            meta._sample_times.clear();
-            meta._sample_times.shrink_to_fit();
         }
 
 #ifdef EVICTION_LOGGING
         //must be the tail of lru
         if (!meta._eviction_sample_times.empty()) {
             //mature
-            uint32_t future_distance = current_seq - meta._past_timestamp + memory_window;
+            uint32_t future_distance = current_seq - meta._past_timestamp + config.memory_window;
             for (auto &sample_time: meta._eviction_sample_times) {
                 //don't use label within the first forget window because the data is not static
                 eviction_training_data->emplace_back(meta, sample_time, future_distance, meta._key);
                 //training
-                if (eviction_training_data->labels.size() == batch_size) {
+                if (eviction_training_data->labels.size() == config.batch_size) {
                     eviction_training_data->clear();
                 }
             }
@@ -584,10 +766,7 @@ void LRBCache::evict() {
         }
 #endif
 
-        in_cache_lru_queue.dq.erase(meta.p_last_request);
-        meta.p_last_request = in_cache_lru_queue.dq.end();
-        //above is suppose to be below, but to make sure the action is correct
-//        in_cache_lru_queue.dq.pop_back();
+        in_cache_lru_queue.erase(old_pos);
         meta.free();
         _currentSize -= meta._size;
         key_map.erase(key);
@@ -596,23 +775,23 @@ void LRBCache::evict() {
         if (old_pos != activate_tail_idx) {
             //move tail
             in_cache_metas[old_pos] = in_cache_metas[activate_tail_idx];
+            in_cache_lru_queue.relocate(old_pos);
             key_map.find(in_cache_metas[activate_tail_idx]._key)->second.list_pos = old_pos;
         }
         in_cache_metas.pop_back();
         ++n_force_eviction;
     } else {
         //bring list 0 to list 1
-        in_cache_lru_queue.dq.erase(meta.p_last_request);
-        meta.p_last_request = in_cache_lru_queue.dq.end();
+        in_cache_lru_queue.erase(old_pos);
         _currentSize -= meta._size;
-        negative_candidate_queue->insert({meta._past_timestamp % memory_window, meta._key});
-
         uint32_t new_pos = out_cache_metas.size();
+        negative_candidate_queue.insert(meta._past_timestamp, new_pos);
         out_cache_metas.emplace_back(in_cache_metas[old_pos]);
         uint32_t activate_tail_idx = in_cache_metas.size() - 1;
         if (old_pos != activate_tail_idx) {
             //move tail
             in_cache_metas[old_pos] = in_cache_metas[activate_tail_idx];
+            in_cache_lru_queue.relocate(old_pos);
             key_map.find(in_cache_metas[activate_tail_idx]._key)->second.list_pos = old_pos;
         }
         in_cache_metas.pop_back();
@@ -621,6 +800,7 @@ void LRBCache::evict() {
 }
 
 void LRBCache::remove_from_outcache_metas(Meta &meta, unsigned int &pos, const uint64_t &key) {
+    negative_candidate_queue.erase(meta._past_timestamp, pos);
     //free the actual content
     meta.free();
     //TODO: can add a function to delete from a queue with (key, pos)
@@ -629,10 +809,266 @@ void LRBCache::remove_from_outcache_metas(Meta &meta, unsigned int &pos, const u
     if (pos != tail_pos) {
         //swap tail
         out_cache_metas[pos] = out_cache_metas[tail_pos];
+        negative_candidate_queue.update(out_cache_metas[tail_pos]._past_timestamp, tail_pos, pos);
         key_map.find(out_cache_metas[tail_pos]._key)->second.list_pos = pos;
     }
     out_cache_metas.pop_back();
     key_map.erase(key);
-    negative_candidate_queue->erase(current_seq % memory_window);
 }
 
+
+namespace {
+    //capacities are part of the reported metadata overhead, so they are restored as well
+    template<class T>
+    void write_vector_capacity(ostream &os, const vector<T> &v) {
+        write_vector(os, v);
+        write_pod(os, static_cast<uint64_t>(v.capacity()));
+    }
+
+    template<class T>
+    void read_vector_capacity(istream &is, vector<T> &v) {
+        uint64_t capacity;
+        read_vector(is, v);
+        read_pod(is, capacity);
+        if (capacity > v.capacity()) {
+            vector<T> reserved;
+            reserved.reserve(capacity);
+            reserved.assign(v.begin(), v.end());
+            v.swap(reserved);
+        }
+    }
+
+    void write_meta(ostream &os, const Meta &meta, const LRBConfig &config) {
+        write_pod(os, meta._key);
+        write_pod(os, meta._size);
+        write_pod(os, meta._past_timestamp);
+        for (uint i = 0; i < config.n_extra_fields; ++i)
+            write_pod(os, meta._extra_features[i]);
+        write_pod(os, static_cast<uint8_t>(meta._extra != nullptr));
+        if (meta._extra) {
+            write_pod(os, *meta._extra);
+        }
+    }
+
+    Meta read_meta(istream &is, const LRBConfig &config) {
+        uint64_t key;
+        uint32_t size, past_timestamp;
+        vector<uint16_t> extra_features(config.n_extra_fields);
+        read_pod(is, key);
+        read_pod(is, size);
+        read_pod(is, past_timestamp);
+        for (uint i = 0; i < config.n_extra_fields; ++i)
+            read_pod(is, extra_features[i]);
+        Meta meta(key, size, past_timestamp, extra_features, config);
+        uint8_t has_extra;
+        read_pod(is, has_extra);
+        if (has_extra) {
+            meta._extra = new MetaExtra(0, config);
+            read_pod(is, *meta._extra);
+        }
+        return meta;
+    }
+}
+
+void LRBCache::serialize(ostream &os) {
+#ifdef EVICTION_LOGGING
+    throw runtime_error("Error: checkpoint not supported with EVICTION_LOGGING");
+#endif
+    write_pod(os, config.memory_window);
+    write_pod(os, config.max_n_past_timestamps);
+    write_pod(os, config.n_extra_fields);
+
+    write_pod(os, current_seq);
+    write_pod(os, _currentSize);
+    //vector order matters: eviction and training samples are drawn by position
+    write_pod(os, static_cast<uint64_t>(in_cache_metas.size()));
+    for (auto &meta: in_cache_metas) {
+        write_meta(os, meta, config);
+        write_pod(os, meta.lru_prev);
+        write_pod(os, meta.lru_next);
+        write_pod(os, meta.score);
+        write_pod(os, meta.score_seq);
+    }
+    write_pod(os, in_cache_lru_queue.head);
+    write_pod(os, in_cache_lru_queue.tail);
+    write_pod(os, static_cast<uint64_t>(out_cache_metas.size()));
+    for (auto &meta: out_cache_metas)
+        write_meta(os, meta, config);
+    write_pod(os, static_cast<uint64_t>(sample_times.size()));
+    for (auto &it: sample_times) {
+        write_pod(os, it.first);
+        write_vector_capacity(os, it.second);
+    }
+
+    write_vector(os, training_data->labels);
+    write_vector(os, training_data->data);
+    //a batch still training is trained again on restore, and installed at the same seq
+    write_pod(os, static_cast<uint8_t>(training_thread.joinable()));
+    if (training_thread.joinable()) {
+        write_pod(os, model_install_seq);
+        write_vector(os, background_training_data->labels);
+        write_vector(os, background_training_data->data);
+        write_string(os, background_init_model);
+        write_string(os, background_init_head);
+    }
+
+    string model;
+    if (booster) {
+        model = model_to_string();
+    }
+    write_string(os, model);
+
+    write_pod(os, is_sampling);
+    write_pod(os, training_loss);
+    write_pod(os, n_force_eviction);
+    write_pod(os, n_inference);
+    write_pod(os, n_inference_eviction);
+    write_pod(os, model_seq);
+    write_pod(os, n_score_lookup);
+    write_pod(os, n_score_hit);
+    write_pod(os, training_time);
+    write_pod(os, inference_time);
+    write_pod(os, obj_distribution);
+    write_pod(os, training_data_distribution);
+    write_pod(os, n_retrain);
+    write_vector(os, segment_n_in);
+    write_vector(os, segment_n_out);
+    write_vector(os, segment_n_retrain);
+    write_vector(os, segment_positive_example_ratio);
+    write_vector(os, segment_percent_beyond);
+    write_streamable(os, _generator);
+    write_streamable(os, _distribution);
+
+    if (window_tuning) {
+        write_vector(os, window_tuning_candidates);
+        write_pod(os, window_tuning_idx);
+        write_vector(os, window_tuning_byte_miss_ratio);
+        write_vector(os, window_tuning_segment_byte_miss);
+        write_pod(os, window_tuning_segment_byte_req);
+        write_pod(os, static_cast<uint64_t>(window_tuning_changes.size()));
+        for (auto &it: window_tuning_changes) {
+            write_pod(os, it.first);
+            write_pod(os, it.second);
+        }
+        window_tuning_sampler->serialize(os);
+        for (auto &shadow: window_tuning_shadows) {
+            shadow->serialize(os);
+        }
+    }
+}
+
+void LRBCache::deserialize(istream &is) {
+    uint32_t _memory_window, _n_extra_fields;
+    uint8_t _max_n_past_timestamps;
+    read_pod(is, _memory_window);
+    read_pod(is, _max_n_past_timestamps);
+    read_pod(is, _n_extra_fields);
+    if ((!window_tuning && _memory_window != config.memory_window) ||
+        _max_n_past_timestamps != config.max_n_past_timestamps || _n_extra_fields != config.n_extra_fields) {
+        throw invalid_argument("error: checkpoint has a different memory_window, max_n_past_timestamps or "
+                               "n_extra_fields");
+    }
+    if (_memory_window != config.memory_window) {
+        //tuned away from the configured window before the checkpoint
+        set_memory_window(_memory_window);
+    }
+
+    read_pod(is, current_seq);
+    read_pod(is, _currentSize);
+    uint64_t n;
+    read_pod(is, n);
+    for (uint64_t i = 0; i < n; ++i) {
+        in_cache_metas.emplace_back(read_meta(is, config));
+        read_pod(is, in_cache_metas.back().lru_prev);
+        read_pod(is, in_cache_metas.back().lru_next);
+        read_pod(is, in_cache_metas.back().score);
+        read_pod(is, in_cache_metas.back().score_seq);
+        key_map.insert({in_cache_metas.back()._key, {0, (uint32_t) i}});
+    }
+    read_pod(is, in_cache_lru_queue.head);
+    read_pod(is, in_cache_lru_queue.tail);
+    read_pod(is, n);
+    for (uint64_t i = 0; i < n; ++i) {
+        out_cache_metas.emplace_back(read_meta(is, config));
+        auto &meta = out_cache_metas.back();
+        key_map.insert({meta._key, {1, (uint32_t) i}});
+        //out of cache metadata are exactly the forget table
+        negative_candidate_queue.insert(meta._past_timestamp, (uint32_t) i);
+    }
+    read_pod(is, n);
+    for (uint64_t i = 0; i < n; ++i) {
+        uint64_t key;
+        read_pod(is, key);
+        read_vector_capacity(is, sample_times[key]);
+    }
+
+    read_vector(is, training_data->labels);
+    read_vector(is, training_data->data);
+    uint8_t is_training;
+    read_pod(is, is_training);
+    if (is_training) {
+        if (!background_training_data) {
+            background_training_data = new TrainingData(config);
+        }
+        read_pod(is, model_install_seq);
+        read_vector(is, background_training_data->labels);
+        read_vector(is, background_training_data->data);
+        read_string(is, background_init_model);
+        read_string(is, background_init_head);
+        training_thread = thread(&LRBCache::fit, this, background_training_data);
+    }
+
+    string model;
+    read_string(is, model);
+    if (!model.empty()) {
+        int n_iteration;
+        if (LGBM_BoosterLoadModelFromString(model.c_str(), &n_iteration, &booster)) {
+            throw runtime_error("Exception loading model from checkpoint");
+        }
+        forest.compile(model);
+    }
+
+    read_pod(is, is_sampling);
+    read_pod(is, training_loss);
+    read_pod(is, n_force_eviction);
+    read_pod(is, n_inference);
+    read_pod(is, n_inference_eviction);
+    read_pod(is, model_seq);
+    read_pod(is, n_score_lookup);
+    read_pod(is, n_score_hit);
+    read_pod(is, training_time);
+    read_pod(is, inference_time);
+    read_pod(is, obj_distribution);
+    read_pod(is, training_data_distribution);
+    read_pod(is, n_retrain);
+    read_vector(is, segment_n_in);
+    read_vector(is, segment_n_out);
+    read_vector(is, segment_n_retrain);
+    read_vector(is, segment_positive_example_ratio);
+    read_vector(is, segment_percent_beyond);
+    read_streamable(is, _generator);
+    read_streamable(is, _distribution);
+
+    if (window_tuning) {
+        vector<uint32_t> candidates;
+        read_vector(is, candidates);
+        if (candidates != window_tuning_candidates) {
+            throw invalid_argument("error: checkpoint has different window_tuning candidates");
+        }
+        read_pod(is, window_tuning_idx);
+        read_vector(is, window_tuning_byte_miss_ratio);
+        read_vector(is, window_tuning_segment_byte_miss);
+        read_pod(is, window_tuning_segment_byte_req);
+        uint64_t n_change;
+        read_pod(is, n_change);
+        window_tuning_changes.resize(n_change);
+        for (auto &it: window_tuning_changes) {
+            read_pod(is, it.first);
+            read_pod(is, it.second);
+        }
+        window_tuning_sampler->deserialize(is);
+        for (auto &shadow: window_tuning_shadows) {
+            shadow->deserialize(is);
+        }
+    }
+}
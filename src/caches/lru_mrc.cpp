@@ -0,0 +1,157 @@
+//
+// One-pass exact LRU miss ratio curve.
+//
+
+#include "lru_mrc.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+using bsoncxx::builder::basic::kvp;
+using bsoncxx::builder::basic::sub_array;
+
+void LRUMRCCache::init_with_params(const map<string, string> &params) {
+    for (auto &it: params) {
+        if (it.first == "mrc_bins_per_octave") {
+            mrc_bins_per_octave = stoul(it.second);
+        } else {
+            cerr << "unrecognized parameter: " << it.first << endl;
+        }
+    }
+    if (!mrc_bins_per_octave) {
+        throw invalid_argument("error: mrc_bins_per_octave must be positive");
+    }
+
+    //cache sizes ceil(2^(i/mrc_bins_per_octave)), deduplicated
+    for (uint i = 0; i < 64 * mrc_bins_per_octave; ++i) {
+        auto boundary = static_cast<uint64_t>(ceil(powl(2.0L, static_cast<long double>(i) / mrc_bins_per_octave)));
+        if (bin_boundaries.empty() || boundary > bin_boundaries.back()) {
+            bin_boundaries.push_back(boundary);
+        }
+    }
+    bin_boundaries.push_back(UINT64_MAX);
+
+    const size_t initial_capacity = 1 << 20;
+    byte_tree.reset(initial_capacity);
+    object_tree.reset(initial_capacity);
+}
+
+size_t LRUMRCCache::bin_of(const uint64_t &distance) const {
+    return lower_bound(bin_boundaries.begin(), bin_boundaries.end(), distance) - bin_boundaries.begin();
+}
+
+void LRUMRCCache::compact() {
+    vector<pair<uint64_t, uint64_t>> pos_key;
+    pos_key.reserve(last_access.size());
+    for (auto &it: last_access) {
+        pos_key.emplace_back(it.second.pos, it.first);
+    }
+    sort(pos_key.begin(), pos_key.end());
+
+    const size_t capacity = max<size_t>(1 << 20, 2 * pos_key.size());
+    byte_tree.reset(capacity);
+    object_tree.reset(capacity);
+    for (uint64_t i = 0; i < pos_key.size(); ++i) {
+        auto &meta = last_access[pos_key[i].second];
+        meta.pos = i;
+        byte_tree.add(i, meta.size);
+        object_tree.add(i, 1);
+    }
+    next_pos = pos_key.size();
+}
+
+bool LRUMRCCache::lookup(const SimpleRequest &req) {
+    if (next_pos + 1 >= byte_tree.size()) {
+        compact();
+    }
+
+    const uint64_t size = req.size;
+    bool is_hit = false;
+    auto it = last_access.find(req.id);
+    if (it == last_access.end()) {
+        byte_hist.cold_byte_miss += size;
+        ++byte_hist.cold_object_miss;
+        object_hist.cold_byte_miss += size;
+        ++object_hist.cold_object_miss;
+        it = last_access.insert({req.id, {0, 0}}).first;
+    } else {
+        auto &meta = it->second;
+        //everything requested after the last access, plus the object itself
+        uint64_t byte_distance = total_bytes - byte_tree.prefix(meta.pos) + size;
+        uint64_t object_distance = last_access.size() - object_tree.prefix(meta.pos) + 1;
+        byte_hist.add(bin_of(byte_distance), size);
+        object_hist.add(bin_of(object_distance), size);
+        is_hit = byte_distance <= _cacheSize && size <= _cacheSize;
+
+        byte_tree.add(meta.pos, -static_cast<int64_t>(meta.size));
+        object_tree.add(meta.pos, -1);
+        total_bytes -= meta.size;
+    }
+
+    auto &meta = it->second;
+    meta.pos = next_pos++;
+    meta.size = size;
+    byte_tree.add(meta.pos, size);
+    object_tree.add(meta.pos, 1);
+    total_bytes += size;
+    //bytes LRU would hold, ignoring objects larger than the cache
+    _currentSize = min<uint64_t>(total_bytes, _cacheSize);
+    return is_hit;
+}
+
+void LRUMRCCache::update_stat_periodic() {
+    byte_segments.emplace_back(move(byte_hist));
+    object_segments.emplace_back(move(object_hist));
+    byte_hist = Histogram();
+    object_hist = Histogram();
+}
+
+void LRUMRCCache::append_curve(bsoncxx::builder::basic::document &doc, const string &size_key,
+                               const string &byte_miss_key, const string &object_miss_key,
+                               const vector<Histogram> &segments) const {
+    size_t n_bin = 0;
+    for (auto &segment: segments) {
+        n_bin = max(n_bin, segment.byte_miss.size());
+    }
+    //a request misses in cache size i iff its distance falls in a later bin: take suffix sums
+    vector<vector<int64_t>> byte_miss(n_bin, vector<int64_t>(segments.size()));
+    vector<vector<int64_t>> object_miss(n_bin, vector<int64_t>(segments.size()));
+    for (size_t s = 0; s < segments.size(); ++s) {
+        auto &segment = segments[s];
+        int64_t byte_suffix = segment.cold_byte_miss, object_suffix = segment.cold_object_miss;
+        for (size_t i = n_bin; i-- > 0;) {
+            byte_miss[i][s] = byte_suffix;
+            object_miss[i][s] = object_suffix;
+            if (i < segment.byte_miss.size()) {
+                byte_suffix += segment.byte_miss[i];
+                object_suffix += segment.object_miss[i];
+            }
+        }
+    }
+
+    doc.append(kvp(size_key, [&](sub_array child) {
+        for (size_t i = 0; i < n_bin; ++i)
+            child.append(static_cast<int64_t>(bin_boundaries[i]));
+    }));
+    doc.append(kvp(byte_miss_key, [&](sub_array child) {
+        for (auto &curve: byte_miss)
+            child.append([&curve](sub_array grandchild) {
+                for (auto &element: curve)
+                    grandchild.append(element);
+            });
+    }));
+    doc.append(kvp(object_miss_key, [&](sub_array child) {
+        for (auto &curve: object_miss)
+            child.append([&curve](sub_array grandchild) {
+                for (auto &element: curve)
+                    grandchild.append(element);
+            });
+    }));
+}
+
+void LRUMRCCache::update_stat(bsoncxx::builder::basic::document &doc) {
+    doc.append(kvp("mrc_bins_per_octave", to_string(mrc_bins_per_octave)));
+    append_curve(doc, "mrc_cache_size", "mrc_segment_byte_miss", "mrc_segment_object_miss", byte_segments);
+    append_curve(doc, "mrc_n_object", "mrc_object_segment_byte_miss", "mrc_object_segment_object_miss",
+                 object_segments);
+}
@@ -4,6 +4,7 @@
 #include <cassert>
 #include "lru_variants.h"
 #include "random_helper.h"
+#include "serialization.h"
 
 // golden section search helpers
 #define SHFT2(a,b,c) (a)=(b);(b)=(c);
@@ -170,6 +171,35 @@ bool LRUCache::exist(const int64_t &key) {
     return _cacheMap.find(key) != _cacheMap.end();
 }
 
+void LRUCache::serialize(std::ostream &os) {
+#ifdef EVICTION_LOGGING
+    throw runtime_error("Error: checkpoint not supported with EVICTION_LOGGING");
+#endif
+    write_pod(os, _currentSize);
+    write_pod(os, static_cast<uint64_t>(_cacheList.size()));
+    //most recent first
+    for (auto &obj: _cacheList) {
+        write_pod(os, obj);
+        write_pod(os, _size_map[obj]);
+    }
+}
+
+void LRUCache::deserialize(std::istream &is) {
+    uint64_t n;
+    read_pod(is, _currentSize);
+    read_pod(is, n);
+    _cacheList.clear();
+    _cacheMap.clear();
+    _size_map.clear();
+    for (uint64_t i = 0; i < n; ++i) {
+        uint64_t obj, size;
+        read_pod(is, obj);
+        read_pod(is, size);
+        _cacheMap[obj] = _cacheList.insert(_cacheList.end(), obj);
+        _size_map[obj] = size;
+    }
+}
+
 /*
   FIFO: First-In First-Out eviction
 */
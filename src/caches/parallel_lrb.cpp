@@ -4,7 +4,7 @@
 
 #include "parallel_lrb.h"
 
-void ParallelLRBCache::train() {
+void ParallelLRBModel::train() {
 //        auto timeBegin = std::chrono::system_clock::now();
     // create training dataset
     DatasetHandle trainData;
@@ -19,8 +19,8 @@ void ParallelLRBCache::train() {
             C_API_DTYPE_FLOAT64,
             background_training_data->indptr.size(),
             background_training_data->data.size(),
-            ParallelLRB::n_feature,  //remove future t
-            LRB_train_params,
+            config.n_feature,  //remove future t
+            train_params,
             nullptr,
             &trainData);
 
@@ -31,10 +31,10 @@ void ParallelLRBCache::train() {
                          C_API_DTYPE_FLOAT32);
 
     // init booster
-    LGBM_BoosterCreate(trainData, LRB_train_params, &background_booster);
+    LGBM_BoosterCreate(trainData, train_params, &background_booster);
 
     // train
-    for (int i = 0; i < stoi(LRB_train_params["num_iterations"]); i++) {
+    for (int i = 0; i < stoi(train_params["num_iterations"]); i++) {
         int isFinished;
         LGBM_BoosterUpdateOneIter(background_booster, &isFinished);
         if (isFinished) {
@@ -45,10 +45,19 @@ void ParallelLRBCache::train() {
 //        auto time1 = std::chrono::system_clock::now();
 
     //don't testing training in order to reduce model available latency
+    int64_t len;
+    LGBM_BoosterSaveModelToString(background_booster, 0, -1, 0, &len, nullptr);
+    string model(len, '\0');
+    LGBM_BoosterSaveModelToString(background_booster, 0, -1, len, &len, &model[0]);
+    //drop the terminating null
+    model.resize(len - 1);
+    auto background_forest = make_shared<CompiledForest>();
+    background_forest->compile(model);
+    atomic_store(&forest, shared_ptr<const CompiledForest>(background_forest));
     booster_mutex.lock();
     std::swap(booster, background_booster);
     booster_mutex.unlock();
-    if_trained = true;
+    ++n_retrain;
 
 //        int64_t len;
 //        std::vector<double > result(background_training_data->indptr.size()-1);
@@ -90,8 +99,9 @@ void ParallelLRBCache::sample() {
     auto n_l0 = static_cast<uint32_t>(in_cache_metas.size());
     auto n_l1 = static_cast<uint32_t>(out_cache_metas.size());
     //TODO: we should use n_l0 / (n_l0 + n_l1), but this makes byte miss ratio worse
-    auto r = rand();
-    if (r / (RAND_MAX + 1.) < static_cast<float>(n_l1) / (n_l0 + n_l1)) {
+    //per cache generator: rand() takes a global lock, contended by the shards of ShardedParallelLRB
+    auto r = uniform_real_distribution<>(0, 1)(_generator);
+    if (r < static_cast<float>(n_l1) / (n_l0 + n_l1)) {
         uint32_t pos = rand_idx % n_l0;
         auto &meta = in_cache_metas[pos];
         meta.emplace_sample(t_counter);
@@ -112,33 +122,25 @@ void ParallelLRBCache::async_lookup(const uint64_t &key) {
         //update past timestamps
         assert(meta._key == key);
         uint32_t last_timestamp = meta._past_timestamp;
-        uint32_t forget_timestamp = last_timestamp + ParallelLRB::memory_window;
         //if the key in out_metadata, it must also in forget table
-        assert((!list_idx) ||
-               (negative_candidate_queue.find(forget_timestamp % ParallelLRB::memory_window) !=
-                negative_candidate_queue.end()));
+        assert((!list_idx) || (negative_candidate_queue.contains(last_timestamp, list_pos)));
         //re-request
         if (!meta._sample_times.empty()) {
             //mature
-            training_data_mutex.lock();
             for (auto &sample_time: meta._sample_times) {
                 //don't use label within the first forget window because the data is not static
                 uint32_t future_distance = t_counter - sample_time;
                 training_data->emplace_back(meta, sample_time, future_distance);
             }
-            training_data_mutex.unlock();
+            flush_training_data();
             meta._sample_times.clear();
             meta._sample_times.shrink_to_fit();
         }
         //make this update after update training, otherwise the last timestamp will change
-        meta.update(t_counter);
+        meta.update(t_counter, config);
         if (list_idx) {
-            negative_candidate_queue.erase(forget_timestamp % ParallelLRB::memory_window);
-            negative_candidate_queue.insert(
-                    {(t_counter + ParallelLRB::memory_window) % ParallelLRB::memory_window, key});
-            assert(negative_candidate_queue.find(
-                    (t_counter + ParallelLRB::memory_window) % ParallelLRB::memory_window) !=
-                   negative_candidate_queue.end());
+            negative_candidate_queue.erase(last_timestamp, list_pos);
+            negative_candidate_queue.insert(t_counter, list_pos);
         } else {
             auto *p = dynamic_cast<ParallelInCacheMeta *>(&meta);
             p->p_last_request = in_cache_lru_queue.re_request(p->p_last_request);
@@ -155,30 +157,25 @@ void ParallelLRBCache::async_lookup(const uint64_t &key) {
 
 void ParallelLRBCache::forget() {
     /*
-     * forget happens exactly after the beginning of each time, without doing any other operations. For example, an
-     * object is request at time 0 with memory window = 5, and will be forgotten exactly at the start of time 5.
+     * forget happens after the beginning of each time, without doing any other operations. For example, an object is
+     * request at time 0 with memory window = 5, and will be forgotten at the start of time 5, or up to the bucket
+     * width of the forget table later.
      * */
-    //remove item from forget table, which is not going to be affect from update
-    auto it = negative_candidate_queue.find(t_counter % ParallelLRB::memory_window);
-    if (it != negative_candidate_queue.end()) {
-        auto forget_key = it->second;
-        auto pos = key_map.find(forget_key)->second.list_pos;
+    negative_candidate_queue.expire(t_counter, [this](const uint32_t &pos) {
         // Forget only happens at list 1
-        assert(key_map.find(forget_key)->second.list_idx);
-//        auto pos = meta_it->second.list_pos;
-//        bool meta_id = meta_it->second.list_idx;
         auto &meta = out_cache_metas[pos];
+        auto forget_key = meta._key;
+        assert(key_map.find(forget_key)->second.list_idx);
 
         //timeout mature
         if (!meta._sample_times.empty()) {
             //mature
-            uint32_t future_distance = ParallelLRB::memory_window * 2;
-            training_data_mutex.lock();
+            uint32_t future_distance = config.memory_window * 2;
             for (auto &sample_time: meta._sample_times) {
                 //don't use label within the first forget window because the data is not static
                 training_data->emplace_back(meta, sample_time, future_distance);
             }
-            training_data_mutex.unlock();
+            flush_training_data();
             meta._sample_times.clear();
             meta._sample_times.shrink_to_fit();
         }
@@ -191,6 +188,7 @@ void ParallelLRBCache::forget() {
         if (pos != tail_pos) {
             //swap tail
             out_cache_metas[pos] = out_cache_metas[tail_pos];
+            negative_candidate_queue.update(out_cache_metas[tail_pos]._past_timestamp, tail_pos, pos);
             key_map.find(out_cache_metas[tail_pos]._key)->second.list_pos = pos;
         }
         out_cache_metas.pop_back();
@@ -199,9 +197,7 @@ void ParallelLRBCache::forget() {
         size_map_mutex[shard_id].lock();
         size_map[shard_id].erase(forget_key);
         size_map_mutex[shard_id].unlock();
-        negative_candidate_queue.erase(t_counter % ParallelLRB::memory_window);
-
-    }
+    });
 }
 
 void ParallelLRBCache::async_admit(const uint64_t &key, const int64_t &size, const uint16_t *extra_features) {
@@ -215,7 +211,7 @@ void ParallelLRBCache::async_admit(const uint64_t &key, const int64_t &size, con
         size_map_mutex[shard_id].unlock();
 
         auto lru_it = in_cache_lru_queue.request(key);
-        in_cache_metas.emplace_back(key, size, t_counter, extra_features, lru_it);
+        in_cache_metas.emplace_back(key, size, t_counter, extra_features, lru_it, config);
         _currentSize += size;
         if (_currentSize <= _cacheSize)
             goto Lreturn;
@@ -227,14 +223,14 @@ void ParallelLRBCache::async_admit(const uint64_t &key, const int64_t &size, con
         //first move meta data, then modify hash table
         uint32_t tail0_pos = in_cache_metas.size();
         auto &meta = out_cache_metas[it->second.list_pos];
-        auto forget_timestamp = meta._past_timestamp + ParallelLRB::memory_window;
-        negative_candidate_queue.erase(forget_timestamp % ParallelLRB::memory_window);
+        negative_candidate_queue.erase(meta._past_timestamp, it->second.list_pos);
         auto it_lru = in_cache_lru_queue.request(key);
         in_cache_metas.emplace_back(out_cache_metas[it->second.list_pos], it_lru);
         uint32_t tail1_pos = out_cache_metas.size() - 1;
         if (it->second.list_pos != tail1_pos) {
             //swap tail
             out_cache_metas[it->second.list_pos] = out_cache_metas[tail1_pos];
+            negative_candidate_queue.update(out_cache_metas[tail1_pos]._past_timestamp, tail1_pos, it->second.list_pos);
             key_map.find(out_cache_metas[tail1_pos]._key)->second.list_pos = it->second.list_pos;
         }
         out_cache_metas.pop_back();
@@ -266,117 +262,66 @@ pair<uint64_t, uint32_t> ParallelLRBCache::rank() {
     auto it = key_map.find(candidate_key);
     auto pos = it->second.list_pos;
     auto &meta = in_cache_metas[pos];
-    if ((!if_trained) || (ParallelLRB::memory_window <= t_counter - meta._past_timestamp))
+    //hold the model for this ranking, the training thread may publish the next one meanwhile
+    auto forest = model->get_forest();
+    if ((!forest) || (config.memory_window <= t_counter - meta._past_timestamp))
         return {meta._key, pos};
 
-
-    int32_t indptr[sample_rate + 1];
-    indptr[0] = 0;
-    int32_t indices[sample_rate * ParallelLRB::n_feature];
-    double data[sample_rate * ParallelLRB::n_feature];
-    int32_t past_timestamps[sample_rate];
-
-    uint64_t keys[sample_rate];
-    uint32_t poses[sample_rate];
-    //next_past_timestamp, next_size = next_indptr - 1
-
-    unsigned int idx_feature = 0;
-    unsigned int idx_row = 0;
-    for (int i = 0; i < sample_rate; i++) {
+    fill(rank_rows.begin(), rank_rows.end(), 0);
+    for (uint32_t i = 0; i < sample_rate; i++) {
         uint32_t pos = _distribution(_generator) % in_cache_metas.size();
         auto &meta = in_cache_metas[pos];
+        double *row = &rank_rows[i * config.n_feature];
 
-        keys[i] = meta._key;
-        poses[i] = pos;
+        rank_keys[i] = meta._key;
+        rank_poses[i] = pos;
+        rank_past_timestamps[i] = meta._past_timestamp;
         //fill in past_interval
-        indices[idx_feature] = 0;
-        data[idx_feature++] = t_counter - meta._past_timestamp;
+        row[0] = t_counter - meta._past_timestamp;
 
         uint8_t j = 0;
         uint32_t this_past_distance = 0;
         uint8_t n_within = 0;
         if (meta._extra) {
-            for (j = 0; j < meta._extra->_past_distance_idx && j < ParallelLRB::max_n_past_distances; ++j) {
+            for (j = 0; j < meta._extra->_past_distance_idx && j < config.max_n_past_distances; ++j) {
                 uint8_t past_distance_idx =
-                        (meta._extra->_past_distance_idx - 1 - j) % ParallelLRB::max_n_past_distances;
+                        (meta._extra->_past_distance_idx - 1 - j) % config.max_n_past_distances;
                 uint32_t &past_distance = meta._extra->_past_distances[past_distance_idx];
                 this_past_distance += past_distance;
-                indices[idx_feature] = j + 1;
-                data[idx_feature++] = past_distance;
-                if (this_past_distance < ParallelLRB::memory_window) {
+                row[j + 1] = past_distance;
+                if (this_past_distance < config.memory_window) {
                     ++n_within;
                 }
-//                } else
-//                    break;
             }
         }
 
-        indices[idx_feature] = ParallelLRB::max_n_past_timestamps;
-        data[idx_feature++] = meta._size;
-//        sizes[idx_row] = meta._size;
+        row[config.max_n_past_timestamps] = meta._size;
 
-        for (uint k = 0; k < ParallelLRB::n_extra_fields; ++k) {
-            indices[idx_feature] = ParallelLRB::max_n_past_timestamps + k + 1;
-            data[idx_feature++] = meta._extra_features[k];
+        for (uint k = 0; k < config.n_extra_fields; ++k) {
+            row[config.max_n_past_timestamps + k + 1] = meta._extra_features[k];
         }
 
-        indices[idx_feature] = ParallelLRB::max_n_past_timestamps + ParallelLRB::n_extra_fields + 1;
-        data[idx_feature++] = n_within;
+        row[config.max_n_past_timestamps + config.n_extra_fields + 1] = n_within;
 
         for (uint8_t k = 0; k < ParallelLRB::n_edc_feature; ++k) {
-            indices[idx_feature] = ParallelLRB::max_n_past_timestamps + ParallelLRB::n_extra_fields + 2 + k;
-            uint32_t _distance_idx = min(uint32_t(t_counter - meta._past_timestamp) / ParallelLRB::edc_windows[k],
-                                         ParallelLRB::max_hash_edc_idx);
-            if (meta._extra)
-                data[idx_feature++] = meta._extra->_edc[k] * ParallelLRB::hash_edc[_distance_idx];
-            else
-                data[idx_feature++] = ParallelLRB::hash_edc[_distance_idx];
+            uint32_t _distance_idx = min(uint32_t(t_counter - meta._past_timestamp) / config.edc_windows[k],
+                                         config.max_hash_edc_idx);
+            double edc = meta._extra ? meta._extra->_edc[k] * config.hash_edc[_distance_idx]
+                                     : config.hash_edc[_distance_idx];
+            row[config.max_n_past_timestamps + config.n_extra_fields + 2 + k] = edc;
         }
-        //remove future t
-        indptr[++idx_row] = idx_feature;
     }
-    int64_t len;
-    std::vector<double> result(sample_rate);
-//    auto time_begin = std::chrono::system_clock::now();
-    booster_mutex.lock();
-    LGBM_BoosterPredictForCSR(booster,
-                              static_cast<void *>(indptr),
-                              C_API_DTYPE_INT32,
-                              indices,
-                              static_cast<void *>(data),
-                              C_API_DTYPE_FLOAT64,
-                              idx_row + 1,
-                              idx_feature,
-                              ParallelLRB::n_feature,  //remove future t
-                              C_API_PREDICT_NORMAL,
-                              0,
-                              LRB_inference_params,
-                              &len,
-                              result.data());
-    booster_mutex.unlock();
-
-//    auto time_end = std::chrono::system_clock::now();
-//    inference_time = 0.99 * inference_time + 0.01 * std::chrono::duration_cast<std::chrono::microseconds>(time_end - time_begin).count();
-//    for (int i = 0; i < sample_rate; ++i)
-//        result[i] -= (t - past_timestamps[i]);
-//    if (objective == object_hit_rate)
-//        for (uint32_t i = 0; i < n_sample; ++i)
-//            result[i] *= sizes[i];
-
-    double worst_score = result[0];
-    uint32_t worst_pos = poses[0];
-    uint64_t worst_key = keys[0];
-    uint64_t min_past_timestamp = past_timestamps[0];
-
-    for (int i = 1; i < sample_rate; ++i)
-        if (result[i] > worst_score || (result[i] == worst_score && (past_timestamps[i] < min_past_timestamp))) {
-            worst_score = result[i];
-            worst_pos = poses[i];
-            worst_key = keys[i];
-            min_past_timestamp = past_timestamps[i];
+    forest->predict(rank_rows.data(), sample_rate, config.n_feature, rank_scores.data());
+
+    //the worst: farthest predicted next request, then least recent
+    uint32_t worst = 0;
+    for (uint32_t i = 1; i < sample_rate; ++i)
+        if (rank_scores[i] > rank_scores[worst] ||
+            (rank_scores[i] == rank_scores[worst] && rank_past_timestamps[i] < rank_past_timestamps[worst])) {
+            worst = i;
         }
 
-    return {worst_key, worst_pos};
+    return {rank_keys[worst], rank_poses[worst]};
 }
 
 void ParallelLRBCache::evict() {
@@ -385,17 +330,16 @@ void ParallelLRBCache::evict() {
     uint32_t &old_pos = epair.second;
 
     auto &meta = in_cache_metas[old_pos];
-    if (ParallelLRB::memory_window <= t_counter - meta._past_timestamp) {
+    if (config.memory_window <= t_counter - meta._past_timestamp) {
         //must be the tail of lru
         if (!meta._sample_times.empty()) {
             //mature
-            uint32_t future_distance = t_counter - meta._past_timestamp + ParallelLRB::memory_window;
-            training_data_mutex.lock();
+            uint32_t future_distance = t_counter - meta._past_timestamp + config.memory_window;
             for (auto &sample_time: meta._sample_times) {
                 //don't use label within the first forget window because the data is not static
                 training_data->emplace_back(meta, sample_time, future_distance);
             }
-            training_data_mutex.unlock();
+            flush_training_data();
             meta._sample_times.clear();
             meta._sample_times.shrink_to_fit();
         }
@@ -427,10 +371,8 @@ void ParallelLRBCache::evict() {
         in_cache_lru_queue.dq.erase(meta.p_last_request);
         meta.p_last_request = in_cache_lru_queue.dq.end();
         _currentSize -= meta._size;
-        negative_candidate_queue.insert(
-                {(meta._past_timestamp + ParallelLRB::memory_window) % ParallelLRB::memory_window, meta._key});
-
         uint32_t new_pos = out_cache_metas.size();
+        negative_candidate_queue.insert(meta._past_timestamp, new_pos);
         out_cache_metas.emplace_back(in_cache_metas[old_pos]);
         uint32_t activate_tail_idx = in_cache_metas.size() - 1;
         if (old_pos != activate_tail_idx) {
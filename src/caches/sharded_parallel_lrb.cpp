@@ -0,0 +1,116 @@
+//
+// ParallelLRB sharded over several worker threads.
+//
+
+#include "sharded_parallel_lrb.h"
+
+void ShardedParallelLRBCache::init_with_params(const map<string, string> &params) {
+    LRBConfig config;
+    map<string, string> shard_params;
+    for (auto &it: params) {
+        if (it.first == "n_worker") {
+            n_worker = stoul(it.second);
+        } else if (it.first == "memory_window") {
+            config.memory_window = stoull(it.second);
+        } else if (it.first == "print_status") {
+            is_printing_status = static_cast<bool>(stoi(it.second));
+        } else {
+            shard_params.insert(it);
+        }
+    }
+    if (!n_worker) {
+        cerr << "error: n_worker must be positive" << endl;
+        abort();
+    }
+    uint32_t shard_memory_window = config.memory_window / n_worker;
+    if (shard_memory_window < pow(2, config.base_edc_window)) {
+        cerr << "error: memory_window / n_worker must be at least 2^" << (int) config.base_edc_window << endl;
+        abort();
+    }
+    shard_params["memory_window"] = to_string(shard_memory_window);
+    //this cache prints for all shards
+    shard_params["print_status"] = "0";
+
+    for (uint32_t i = 0; i < n_worker; ++i) {
+        auto shard = new ParallelLRBCache();
+        shards.emplace_back(shard);
+        shard->setSize(shard_size(i));
+        //the first shard creates the model
+        if (i) {
+            shard->model = shards[0]->model;
+        }
+        shard->init_with_params(shard_params);
+    }
+
+    if (is_printing_status) {
+        print_status_thread = std::thread(&ShardedParallelLRBCache::async_print_status, this);
+    }
+}
+
+void ShardedParallelLRBCache::setSize(const uint64_t &cs) {
+    _cacheSize = cs;
+    for (uint32_t i = 0; i < shards.size(); ++i) {
+        shards[i]->setSize(shard_size(i));
+    }
+}
+
+uint64_t ShardedParallelLRBCache::n_dequeued_op() {
+    uint64_t n = 0;
+    for (auto &shard: shards) {
+        n += shard->n_dequeued_op();
+    }
+    return n;
+}
+
+size_t ShardedParallelLRBCache::op_queue_depth() {
+    size_t n = 0;
+    for (auto &shard: shards) {
+        n += shard->op_queue_depth();
+    }
+    return n;
+}
+
+void ShardedParallelLRBCache::update_stat_periodic() {
+    //no lock because read fail doesn't hurt much
+    uint64_t current_size = 0;
+    for (auto &shard: shards) {
+        current_size += shard->getCurrentSize();
+    }
+    _currentSize = current_size;
+}
+
+void ShardedParallelLRBCache::update_stat(bsoncxx::v_noabi::builder::basic::document &doc) {
+    update_stat_periodic();
+    uint64_t n_metadata = 0;
+    for (auto &shard: shards) {
+        n_metadata += shard->key_map.size();
+    }
+    doc.append(kvp("n_worker", to_string(n_worker)));
+    doc.append(kvp("n_metadata", to_string(n_metadata)));
+    doc.append(kvp("op_dequeued", [this](sub_array child) {
+        for (auto &shard: shards)
+            child.append(to_string(shard->n_dequeued_op()));
+    }));
+    doc.append(kvp("op_queue_depth", [this](sub_array child) {
+        for (auto &shard: shards)
+            child.append(to_string(shard->op_queue_depth()));
+    }));
+    auto &model = shards[0]->model;
+    doc.append(kvp("n_retrain", to_string(model->n_retrain)));
+    auto importances = model->feature_importance();
+    doc.append(kvp("model_importance", [importances](sub_array child) {
+        for (const auto &element : importances)
+            child.append(element);
+    }));
+}
+
+void ShardedParallelLRBCache::print_stats() {
+    update_stat_periodic();
+    std::cerr << "cache size: " << _currentSize << "/" << _cacheSize << " (" << ((double) _currentSize) / _cacheSize
+              << ")" << std::endl;
+    std::cerr << "op queue depth / dequeued ops per shard:";
+    for (auto &shard: shards) {
+        std::cerr << " " << shard->op_queue_depth() << "/" << shard->n_dequeued_op();
+    }
+    std::cerr << std::endl << "n_training: " << shards[0]->model->n_pending_sample() << std::endl;
+}
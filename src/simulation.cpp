@@ -9,9 +9,17 @@
 #include <sstream>
 #include "utils.h"
 #include "rss.h"
+#include "serialization.h"
 #include <cstdint>
 #include <unordered_map>
 #include <numeric>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cmath>
+#include <cstring>
+#include <fstream>
 #include "bsoncxx/builder/basic/document.hpp"
 #include "bsoncxx/json.hpp"
 
@@ -22,7 +30,7 @@ using bsoncxx::builder::basic::sub_array;
 
 
 FrameWork::FrameWork(const vector<string> &trace_files, const string &cache_type, const uint64_t &cache_size,
-                     map<string, string> &params) {
+                     map<string, string> &params, const vector<shared_ptr<const DecodedTrace>> &decoded_traces) {
     _trace_files = trace_files;
     _cache_type = cache_type;
     _cache_size = cache_size;
@@ -53,6 +61,36 @@ FrameWork::FrameWork(const vector<string> &trace_files, const string &cache_type
         } else if (it->first == "real_time_segment_window") {
             real_time_segment_window = stoull((it->second));
             it = params.erase(it);
+        } else if (it->first == "annotate_n_threads") {
+            annotate_n_threads = stoul(it->second);
+            it = params.erase(it);
+        } else if (it->first == "annotate_memory_budget") {
+            annotate_memory_budget = stoull(it->second);
+            it = params.erase(it);
+        } else if (it->first == "prefetch") {
+            prefetch = static_cast<bool>(stoi(it->second));
+            it = params.erase(it);
+        } else if (it->first == "prefetch_batch_size") {
+            prefetch_batch_size = stoull(it->second);
+            it = params.erase(it);
+        } else if (it->first == "prefetch_n_batch") {
+            prefetch_n_batch = stoull(it->second);
+            it = params.erase(it);
+        } else if (it->first == "sample_ratio") {
+            sample_ratio = stod(it->second);
+            it = params.erase(it);
+        } else if (it->first == "sample_max_n_object") {
+            sample_max_n_object = stoull(it->second);
+            it = params.erase(it);
+        } else if (it->first == "checkpoint_file") {
+            checkpoint_file = it->second;
+            it = params.erase(it);
+        } else if (it->first == "checkpoint_seq") {
+            checkpoint_seq = stoll(it->second);
+            it = params.erase(it);
+        } else if (it->first == "restore_file") {
+            restore_file = it->second;
+            it = params.erase(it);
         } else if (it->first == "n_early_stop") {
             n_early_stop = stoll((it->second));
             ++it;
@@ -72,54 +110,123 @@ FrameWork::FrameWork(const vector<string> &trace_files, const string &cache_type
     if (_trace_files.empty()) {
         throw runtime_error("Error: Expecting at least one trace file.");
     }
-    for(auto&& _trace_file: _trace_files) {
-        if (is_offline) {
-            annotate(_trace_file, n_extra_fields);
-            _trace_file = _trace_file + ".ant";
-        }
-
-        std::ifstream infile;
-        infile.open(_trace_file);
-        if (!infile) {
-            cerr << "Exception opening/reading file " << _trace_file << endl;
-            exit(-1);
+    if (!decoded_traces.empty() && decoded_traces.size() != _trace_files.size()) {
+        throw invalid_argument("error: expecting one decoded trace per trace file");
+    }
+    for (size_t i = 0; i < _trace_files.size(); ++i) {
+        auto &_trace_file = _trace_files[i];
+        if (!decoded_traces.empty()) {
+            if (is_offline && !decoded_traces[i]->next_seq) {
+                throw invalid_argument("error: decoded trace " + _trace_file + " is not annotated");
+            }
+            readers.emplace_back(new DecodedTraceReader(decoded_traces[i]));
+        } else {
+            if (is_offline) {
+                annotate(_trace_file, n_extra_fields, annotate_n_threads, annotate_memory_budget);
+            }
+            readers.emplace_back(TraceReader::open(_trace_file, is_offline, n_extra_fields));
         }
-        auto&& in = infiles.emplace_back(std::move(infile));
-        if (!in) {
-            cerr << "Exception opening/reading file " << _trace_file << endl;
-            throw runtime_error("Exception opening/reading file " + _trace_file);
+        int64_t _t;
+        if (readers.back()->peek_time(_t)) {
+            reader_heap.emplace(_t, readers.size() - 1);
         }
     }
 
+    if ((!checkpoint_file.empty() || !restore_file.empty()) && bloom_filter) {
+        throw invalid_argument("error: bloom_filter can not be checkpointed");
+    }
+    if (!checkpoint_file.empty() && checkpoint_seq < 0) {
+        throw invalid_argument("error: checkpoint_file needs checkpoint_seq");
+    }
+
+    if (sample_ratio != 1 || sample_max_n_object) {
+        if (is_metadata_in_cache_size) {
+            throw invalid_argument("error: is_metadata_in_cache_size can not be used with sampling");
+        }
+        sampler.reset(new SpatialSampler(sample_ratio, sample_max_n_object));
+    }
 
     //set cache_type related
     // create cache
     webcache = move(Cache::create_unique(cache_type));
     if (webcache == nullptr) throw runtime_error("Error: cache type " + cache_type + " not implemented");
-    webcache->setSize(cache_size);
+    webcache->setSize(sampled_cache_size());
     webcache->init_with_params(params);
 
     adjust_real_time_offset();
     extra_features = vector<uint16_t>(n_extra_fields);
+    read_extra_features = vector<uint16_t>(n_extra_fields);
 }
 
 void FrameWork::adjust_real_time_offset() {
     // Zhenyu: not assume t start from any constant, so need to compute the first window
-    for(auto&& infile: infiles) {
-        if (is_offline) {
-                infile >> next_seq >> t;
-        } else {
-            infile >> t;
+    for (auto &&reader: readers) {
+        if (!reader->peek_time(t)) {
+            continue;
         }
         time_window_end =
                 real_time_segment_window * (t / real_time_segment_window + (t % real_time_segment_window != 0));
-        infile.clear();
-        infile.seekg(0, ios::beg);
     }
 }
 
 
+uint64_t FrameWork::sampled_cache_size() const {
+    if (!sampler) {
+        return _cache_size;
+    }
+    return max<uint64_t>(1, llround(_cache_size * sampler->ratio()));
+}
+
+void FrameWork::SampleStats::correct(int64_t &_byte_req, int64_t &_byte_miss, int64_t &_obj_req,
+                                     int64_t &_obj_miss) const {
+    double byte_req_sum = accumulate(byte_req_w.begin(), byte_req_w.end(), 0.);
+    double obj_req_sum = accumulate(obj_req_w.begin(), obj_req_w.end(), 0.);
+    _byte_miss = byte_req_sum > 0 ?
+                 llround(byte_req * accumulate(byte_miss_w.begin(), byte_miss_w.end(), 0.) / byte_req_sum) : 0;
+    _obj_miss = obj_req_sum > 0 ?
+                llround(obj_req * accumulate(obj_miss_w.begin(), obj_miss_w.end(), 0.) / obj_req_sum) : 0;
+    _byte_req = byte_req;
+    _obj_req = obj_req;
+}
+
+pair<double, double> FrameWork::SampleStats::miss_ratio_stderr() const {
+    auto stderr_of = [](const vector<double> &miss, const vector<double> &req) {
+        vector<double> ratios;
+        for (size_t i = 0; i < req.size(); ++i) {
+            if (req[i] > 0) {
+                ratios.push_back(miss[i] / req[i]);
+            }
+        }
+        if (ratios.size() < 2) {
+            return 0.;
+        }
+        double mean = accumulate(ratios.begin(), ratios.end(), 0.) / ratios.size();
+        double var = 0;
+        for (auto &r: ratios) {
+            var += (r - mean) * (r - mean);
+        }
+        var /= ratios.size() - 1;
+        return sqrt(var / ratios.size());
+    };
+    return {stderr_of(byte_miss_w, byte_req_w), stderr_of(obj_miss_w, obj_req_w)};
+}
+
+void FrameWork::SampleStats::add(const SampleStats &other) {
+    byte_req += other.byte_req;
+    obj_req += other.obj_req;
+    for (uint32_t i = 0; i < SpatialSampler::n_group; ++i) {
+        byte_req_w[i] += other.byte_req_w[i];
+        byte_miss_w[i] += other.byte_miss_w[i];
+        obj_req_w[i] += other.obj_req_w[i];
+        obj_miss_w[i] += other.obj_miss_w[i];
+    }
+}
+
 void FrameWork::update_real_time_stats() {
+    if (sampler) {
+        rt_sample_stats.correct(rt_byte_req, rt_byte_miss, rt_obj_req, rt_obj_miss);
+        rt_sample_stats = SampleStats();
+    }
     rt_seg_byte_miss.emplace_back(rt_byte_miss);
     rt_seg_byte_req.emplace_back(rt_byte_req);
     rt_seg_object_miss.emplace_back(rt_obj_miss);
@@ -153,6 +260,15 @@ void FrameWork::update_stats() {
 #ifndef NDEBUG
     cerr << "segment bmr: " << double(byte_miss) / byte_req << endl;
 #endif
+    if (sampler) {
+        auto error = sample_stats.miss_ratio_stderr();
+        seg_byte_miss_ratio_stderr.emplace_back(error.first);
+        seg_object_miss_ratio_stderr.emplace_back(error.second);
+        seg_sample_ratio.emplace_back(sampler->ratio());
+        sample_stats.correct(byte_req, byte_miss, obj_req, obj_miss);
+        total_sample_stats.add(sample_stats);
+        sample_stats = SampleStats();
+    }
     seg_byte_miss.emplace_back(byte_miss);
     seg_byte_req.emplace_back(byte_req);
     seg_object_miss.emplace_back(obj_miss);
@@ -182,6 +298,12 @@ void FrameWork::update_metrics_req(const int64_t &size) {
     rt_byte_req += size;
     ++obj_req;
     ++rt_obj_req;
+    if (sampler) {
+        for (auto stats: {&sample_stats, &rt_sample_stats}) {
+            stats->byte_req_w[sample_group] += size * sample_weight;
+            stats->obj_req_w[sample_group] += sample_weight;
+        }
+    }
 }
 
 void FrameWork::update_metrics_req(const int64_t &size, const std::vector<uint16_t> &extra_features) {
@@ -203,6 +325,12 @@ void FrameWork::update_metrics_miss(const int64_t &size) {
     rt_byte_miss += size;
     ++obj_miss;
     ++rt_obj_miss;
+    if (sampler) {
+        for (auto stats: {&sample_stats, &rt_sample_stats}) {
+            stats->byte_miss_w[sample_group] += size * sample_weight;
+            stats->obj_miss_w[sample_group] += sample_weight;
+        }
+    }
 }
 
 void FrameWork::update_metrics_miss(const int64_t &size, const std::vector<uint16_t> &extra_features) {
@@ -219,22 +347,300 @@ void FrameWork::update_metrics_miss(const int64_t &size, const std::vector<uint1
     this->update_metrics_miss(size);
 }
 
-bsoncxx::builder::basic::document FrameWork::simulate() {
-    cerr << "simulating" << endl;
-    unordered_map<uint64_t, uint32_t> future_timestamps;
-    vector<uint8_t> eviction_qualities;
-    vector<uint16_t> eviction_logic_timestamps;
+void FrameWork::start() {
     if (bloom_filter) {
         filter = new AkamaiBloomFilter;
     }
 
-    SimpleRequest *req;
     if (is_offline)
-        req = new AnnotatedRequest(0, 0, 0, 0, 0);
+        req.reset(new AnnotatedRequest(0, 0, 0, 0, 0));
     else
-        req = new SimpleRequest(0, 0, 0);
+        req.reset(new SimpleRequest(0, 0, 0));
     t_now = system_clock::now();
 
+    if (!restore_file.empty()) {
+        restore_checkpoint();
+    }
+}
+
+bool FrameWork::process(const TraceRecord &record) {
+    if (n_restored_to_skip) {
+        --n_restored_to_skip;
+        return true;
+    }
+    if (seq == n_early_stop)
+        return false;
+    if (static_cast<int64_t>(seq) == checkpoint_seq && !checkpoint_file.empty()) {
+        save_checkpoint();
+    }
+
+    next_seq = record.next_seq;
+    t = record.t;
+    id = record.id;
+    size = uni_size ? 1 : record.size;
+    for (uint i = 0; i < n_extra_fields; ++i)
+        extra_features[i] = record.extra_features[i];
+
+    while (t >= time_window_end) {
+        update_real_time_stats();
+    }
+    if (seq && !(seq % segment_window)) {
+        update_stats();
+    }
+
+    if (sampler) {
+        sample_stats.byte_req += size;
+        ++sample_stats.obj_req;
+        rt_sample_stats.byte_req += size;
+        ++rt_sample_stats.obj_req;
+        if (!sampler->sample(id)) {
+            ++seq;
+            return true;
+        }
+        //the fixed-size variant may have lowered the ratio
+        if (webcache->_cacheSize != sampled_cache_size()) {
+            webcache->setSize(sampled_cache_size());
+        }
+        sample_weight = 1 / sampler->ratio();
+        sample_group = SpatialSampler::group(id);
+    }
+
+    /* update_metric_req(byte_req, obj_req, size);
+    update_metric_req(rt_byte_req, rt_obj_req, size) */
+    update_metrics_req(size, extra_features);
+
+    if (is_offline)
+        dynamic_cast<AnnotatedRequest *>(req.get())->reinit(seq, id, size, next_seq, &extra_features);
+    else
+        req->reinit(seq, id, size, &extra_features);
+
+    bool is_admitting = true;
+    if (true == bloom_filter) {
+        bool exist_in_cache = webcache->exist(req->id);
+        //in cache object, not consider bloom_filter
+        if (false == exist_in_cache) {
+            is_admitting = filter->exist_or_insert(id);
+        }
+    }
+    if (is_admitting) {
+        bool is_hit = webcache->lookup(*req);
+        if (!is_hit) {
+            /* update_metric_req(byte_miss, obj_miss, size);
+            update_metric_req(rt_byte_miss, rt_obj_miss, size) */
+            update_metrics_miss(size, extra_features);
+            webcache->admit(*req);
+        }
+    } else {
+        /* update_metric_req(byte_miss, obj_miss, size);
+        update_metric_req(rt_byte_miss, rt_obj_miss, size) */
+        update_metrics_miss(size, extra_features);
+    }
+
+    ++seq;
+    return true;
+}
+
+bsoncxx::builder::basic::document FrameWork::finish() {
+    req.reset();
+    //for the residue segment of trace
+    update_real_time_stats();
+    update_stats();
+    return simulation_results();
+}
+
+namespace {
+    const char checkpoint_magic[8] = {'W', 'C', 'S', 'C', 'K', 'P', 'T', '\10'};
+
+    void write_stats(ostream &os, const FrameWork::Stats &stats) {
+        write_pod(os, stats.byte_req);
+        write_pod(os, stats.byte_miss);
+        write_pod(os, stats.obj_req);
+        write_pod(os, stats.obj_miss);
+        write_pod(os, stats.rt_byte_req);
+        write_pod(os, stats.rt_byte_miss);
+        write_pod(os, stats.rt_obj_req);
+        write_pod(os, stats.rt_obj_miss);
+        for (auto v: {&stats.seg_byte_req, &stats.seg_byte_miss, &stats.seg_object_req, &stats.seg_object_miss,
+                      &stats.seg_rss, &stats.seg_byte_in_cache, &stats.rt_seg_byte_req, &stats.rt_seg_byte_miss,
+                      &stats.rt_seg_object_req, &stats.rt_seg_object_miss, &stats.rt_seg_rss}) {
+            write_vector(os, *v);
+        }
+    }
+
+    void read_stats(istream &is, FrameWork::Stats &stats) {
+        read_pod(is, stats.byte_req);
+        read_pod(is, stats.byte_miss);
+        read_pod(is, stats.obj_req);
+        read_pod(is, stats.obj_miss);
+        read_pod(is, stats.rt_byte_req);
+        read_pod(is, stats.rt_byte_miss);
+        read_pod(is, stats.rt_obj_req);
+        read_pod(is, stats.rt_obj_miss);
+        for (auto v: {&stats.seg_byte_req, &stats.seg_byte_miss, &stats.seg_object_req, &stats.seg_object_miss,
+                      &stats.seg_rss, &stats.seg_byte_in_cache, &stats.rt_seg_byte_req, &stats.rt_seg_byte_miss,
+                      &stats.rt_seg_object_req, &stats.rt_seg_object_miss, &stats.rt_seg_rss}) {
+            read_vector(is, *v);
+        }
+    }
+
+    void write_sample_stats(ostream &os, const FrameWork::SampleStats &stats) {
+        write_pod(os, stats.byte_req);
+        write_pod(os, stats.obj_req);
+        write_vector(os, stats.byte_req_w);
+        write_vector(os, stats.byte_miss_w);
+        write_vector(os, stats.obj_req_w);
+        write_vector(os, stats.obj_miss_w);
+    }
+
+    void read_sample_stats(istream &is, FrameWork::SampleStats &stats) {
+        read_pod(is, stats.byte_req);
+        read_pod(is, stats.obj_req);
+        read_vector(is, stats.byte_req_w);
+        read_vector(is, stats.byte_miss_w);
+        read_vector(is, stats.obj_req_w);
+        read_vector(is, stats.obj_miss_w);
+    }
+}
+
+void FrameWork::save_checkpoint() {
+    auto tmp_file = checkpoint_file + ".tmp";
+    {
+        ofstream os(tmp_file, ios::binary | ios::trunc);
+        if (!os) {
+            throw runtime_error("Exception opening checkpoint file " + tmp_file);
+        }
+        os.write(checkpoint_magic, sizeof(checkpoint_magic));
+        write_string(os, _cache_type);
+        write_pod(os, _cache_size);
+        write_pod(os, seq);
+        write_pod(os, webcache->_cacheSize);
+        write_pod(os, time_window_end);
+
+        write_pod(os, byte_req);
+        write_pod(os, byte_miss);
+        write_pod(os, obj_req);
+        write_pod(os, obj_miss);
+        write_pod(os, rt_byte_req);
+        write_pod(os, rt_byte_miss);
+        write_pod(os, rt_obj_req);
+        write_pod(os, rt_obj_miss);
+        for (auto v: {&seg_byte_req, &seg_byte_miss, &seg_object_req, &seg_object_miss, &seg_rss, &seg_byte_in_cache,
+                      &rt_seg_byte_req, &rt_seg_byte_miss, &rt_seg_object_req, &rt_seg_object_miss, &rt_seg_rss}) {
+            write_vector(os, *v);
+        }
+        write_pod(os, static_cast<uint64_t>(stats_by_extra_feature.size()));
+        for (auto &it: stats_by_extra_feature) {
+            write_pod(os, it.first);
+            write_stats(os, it.second);
+        }
+
+        write_pod(os, static_cast<uint8_t>(sampler != nullptr));
+        if (sampler) {
+            sampler->serialize(os);
+            write_sample_stats(os, sample_stats);
+            write_sample_stats(os, rt_sample_stats);
+            write_sample_stats(os, total_sample_stats);
+            write_vector(os, seg_byte_miss_ratio_stderr);
+            write_vector(os, seg_object_miss_ratio_stderr);
+            write_vector(os, seg_sample_ratio);
+        }
+
+        webcache->serialize(os);
+        if (!os.flush()) {
+            throw runtime_error("Exception writing checkpoint file " + tmp_file);
+        }
+    }
+    if (rename(tmp_file.c_str(), checkpoint_file.c_str())) {
+        throw runtime_error("Exception renaming " + tmp_file + " to " + checkpoint_file + ": " + strerror(errno));
+    }
+    cerr << "checkpoint at seq " << seq << " written to " << checkpoint_file << endl;
+}
+
+void FrameWork::restore_checkpoint() {
+    ifstream is(restore_file, ios::binary);
+    if (!is) {
+        throw runtime_error("Exception opening checkpoint file " + restore_file);
+    }
+    char magic[sizeof(checkpoint_magic)];
+    if (!is.read(magic, sizeof(magic)) || memcmp(magic, checkpoint_magic, sizeof(magic))) {
+        throw runtime_error("Not a checkpoint file: " + restore_file);
+    }
+    string cache_type;
+    uint64_t cache_size, cache_size_now;
+    read_string(is, cache_type);
+    read_pod(is, cache_size);
+    if (cache_type != _cache_type || cache_size != _cache_size) {
+        throw invalid_argument("error: checkpoint is of " + cache_type + " " + to_string(cache_size) +
+                               ", can not restore " + _cache_type + " " + to_string(_cache_size));
+    }
+    read_pod(is, seq);
+    read_pod(is, cache_size_now);
+    webcache->setSize(cache_size_now);
+    read_pod(is, time_window_end);
+
+    read_pod(is, byte_req);
+    read_pod(is, byte_miss);
+    read_pod(is, obj_req);
+    read_pod(is, obj_miss);
+    read_pod(is, rt_byte_req);
+    read_pod(is, rt_byte_miss);
+    read_pod(is, rt_obj_req);
+    read_pod(is, rt_obj_miss);
+    for (auto v: {&seg_byte_req, &seg_byte_miss, &seg_object_req, &seg_object_miss, &seg_rss, &seg_byte_in_cache,
+                  &rt_seg_byte_req, &rt_seg_byte_miss, &rt_seg_object_req, &rt_seg_object_miss, &rt_seg_rss}) {
+        read_vector(is, *v);
+    }
+    uint64_t n;
+    read_pod(is, n);
+    stats_by_extra_feature.clear();
+    for (uint64_t i = 0; i < n; ++i) {
+        int64_t feature;
+        read_pod(is, feature);
+        read_stats(is, stats_by_extra_feature[feature]);
+    }
+
+    uint8_t has_sampler;
+    read_pod(is, has_sampler);
+    if (has_sampler != (sampler != nullptr)) {
+        throw invalid_argument("error: checkpoint and simulation must both or neither use sampling");
+    }
+    if (sampler) {
+        sampler->deserialize(is);
+        read_sample_stats(is, sample_stats);
+        read_sample_stats(is, rt_sample_stats);
+        read_sample_stats(is, total_sample_stats);
+        read_vector(is, seg_byte_miss_ratio_stderr);
+        read_vector(is, seg_object_miss_ratio_stderr);
+        read_vector(is, seg_sample_ratio);
+    }
+
+    webcache->deserialize(is);
+    n_restored_to_skip = seq;
+    cerr << "restored checkpoint at seq " << seq << " from " << restore_file << endl;
+}
+
+TracePrefetcher *FrameWork::start_reading() {
+    if (prefetch) {
+        prefetcher.reset(new TracePrefetcher([this](TraceRecord &record) { return read_trace(record); },
+                                             prefetch_batch_size, prefetch_n_batch));
+    }
+    return prefetcher.get();
+}
+
+void FrameWork::stop_reading() {
+    prefetcher.reset();
+    readers.clear();
+}
+
+bsoncxx::builder::basic::document FrameWork::simulate() {
+    cerr << "simulating" << endl;
+    start();
+
+    auto prefetcher = start_reading();
+    const vector<TraceRecord> *batch = nullptr;
+    size_t batch_pos = 0;
+    TraceRecord record;
+
     int64_t seq_start_counter = 0;
     while (true) {
         if (seq_start_counter++ < seq_start) {
@@ -243,61 +649,157 @@ bsoncxx::builder::basic::document FrameWork::simulate() {
         if (seq == n_early_stop)
             break;
 
-        bool ok = read_trace(next_seq, t, id , size);
-
-        if (!ok) {
-            break;
+        const TraceRecord *r;
+        if (prefetcher) {
+            if (!batch || batch_pos == batch->size()) {
+                batch = &prefetcher->next_batch();
+                batch_pos = 0;
+                if (batch->empty()) {
+                    break;
+                }
+            }
+            r = &(*batch)[batch_pos++];
+        } else {
+            if (!read_trace(record)) {
+                break;
+            }
+            r = &record;
         }
+        process(*r);
+    }
+    stop_reading();
 
-        while (t >= time_window_end) {
-            update_real_time_stats();
-        }
-        if (seq && !(seq % segment_window)) {
-            update_stats();
-        }
+    return finish();
+}
 
-        /* update_metric_req(byte_req, obj_req, size);
-        update_metric_req(rt_byte_req, rt_obj_req, size) */
-        update_metrics_req(size, extra_features);
+vector<bsoncxx::builder::basic::document>
+FrameWork::simulate_fan_out(vector<unique_ptr<FrameWork>> &frame_works, uint n_threads) {
+    if (frame_works.empty()) {
+        throw invalid_argument("error: no cache configuration to simulate");
+    }
+    //only one framework reads the trace. Pick one with next_seq if any configuration needs it
+    FrameWork *source = frame_works[0].get();
+    for (auto &frame_work: frame_works) {
+        if (frame_work->is_offline) {
+            source = frame_work.get();
+            break;
+        }
+    }
+    if (!n_threads) {
+        n_threads = max(1u, thread::hardware_concurrency());
+    }
+    const size_t n_worker = min<size_t>(n_threads, frame_works.size());
+    cerr << "simulating " << frame_works.size() << " configurations on " << n_worker << " threads" << endl;
 
-        if (is_offline)
-            dynamic_cast<AnnotatedRequest *>(req)->reinit(seq, id, size, next_seq, &extra_features);
-        else
-            req->reinit(seq, id, size, &extra_features);
+    for (auto &frame_work: frame_works) {
+        frame_work->start();
+    }
 
-        bool is_admitting = true;
-        if (true == bloom_filter) {
-            bool exist_in_cache = webcache->exist(req->id);
-            //in cache object, not consider bloom_filter
-            if (false == exist_in_cache) {
-                is_admitting = filter->exist_or_insert(id);
+    //each worker owns the frameworks i, i + n_worker, ... and runs them over every batch
+    mutex mtx;
+    condition_variable cv_batch, cv_done;
+    const vector<TraceRecord> *batch = nullptr;
+    uint64_t generation = 0;
+    size_t n_busy = 0;
+    bool finished = false;
+    vector<char> active(frame_works.size(), 1);
+    vector<exception_ptr> errors(n_worker);
+
+    auto worker = [&](const size_t &w) {
+        uint64_t seen_generation = 0;
+        while (true) {
+            const vector<TraceRecord> *current;
+            {
+                unique_lock<mutex> lock(mtx);
+                cv_batch.wait(lock, [&] { return finished || generation != seen_generation; });
+                if (generation == seen_generation) {
+                    return;
+                }
+                seen_generation = generation;
+                current = batch;
             }
-        }
-        if (is_admitting) {
-            bool is_hit = webcache->lookup(*req);
-            if (!is_hit) {
-                /* update_metric_req(byte_miss, obj_miss, size);
-                update_metric_req(rt_byte_miss, rt_obj_miss, size) */
-                update_metrics_miss(size, extra_features);
-                webcache->admit(*req);
+            try {
+                for (size_t i = w; i < frame_works.size(); i += n_worker) {
+                    if (!active[i]) {
+                        continue;
+                    }
+                    for (auto &record: *current) {
+                        if (!frame_works[i]->process(record)) {
+                            active[i] = 0;
+                            break;
+                        }
+                    }
+                }
+            } catch (...) {
+                errors[w] = current_exception();
+            }
+            lock_guard<mutex> lock(mtx);
+            if (!--n_busy) {
+                cv_done.notify_one();
             }
-        } else {
-            /* update_metric_req(byte_miss, obj_miss, size);
-            update_metric_req(rt_byte_miss, rt_obj_miss, size) */
-            update_metrics_miss(size, extra_features);
         }
-
-        ++seq;
+    };
+    vector<thread> threads;
+    for (size_t w = 0; w < n_worker; ++w) {
+        threads.emplace_back(worker, w);
     }
-    delete req;
-    //for the residue segment of trace
-    update_real_time_stats();
-    update_stats();
-    for(auto&& infile: infiles) {
-        infile.close();
+    auto stop_workers = [&]() {
+        {
+            lock_guard<mutex> lock(mtx);
+            finished = true;
+        }
+        cv_batch.notify_all();
+        for (auto &th: threads) {
+            th.join();
+        }
+    };
+
+    auto prefetcher = source->start_reading();
+    vector<TraceRecord> local_batch;
+    try {
+        while (true) {
+            if (prefetcher) {
+                batch = &prefetcher->next_batch();
+            } else {
+                local_batch.resize(source->prefetch_batch_size);
+                size_t n = 0;
+                while (n < local_batch.size() && source->read_trace(local_batch[n])) {
+                    ++n;
+                }
+                local_batch.resize(n);
+                batch = &local_batch;
+            }
+            if (batch->empty()) {
+                break;
+            }
+            {
+                unique_lock<mutex> lock(mtx);
+                ++generation;
+                n_busy = n_worker;
+                cv_batch.notify_all();
+                cv_done.wait(lock, [&] { return !n_busy; });
+            }
+            for (auto &e: errors) {
+                if (e) {
+                    rethrow_exception(e);
+                }
+            }
+            if (find(active.begin(), active.end(), 1) == active.end()) {
+                break;
+            }
+        }
+    } catch (...) {
+        stop_workers();
+        throw;
     }
+    stop_workers();
+    source->stop_reading();
 
-    return simulation_results();
+    vector<bsoncxx::builder::basic::document> results;
+    for (auto &frame_work: frame_works) {
+        results.emplace_back(frame_work->finish());
+    }
+    return results;
 }
 
 
@@ -409,102 +911,66 @@ bsoncxx::builder::basic::document FrameWork::simulation_results() {
         }
     }));
 
+    if (sampler) {
+        value_builder.append(kvp("final_sample_ratio", sampler->ratio()));
+        value_builder.append(kvp("no_warmup_byte_miss_ratio_stderr", total_sample_stats.miss_ratio_stderr().first));
+        value_builder.append(kvp("segment_sample_ratio", [this](sub_array child) {
+            for (const auto &element : seg_sample_ratio)
+                child.append(element);
+        }));
+        value_builder.append(kvp("segment_byte_miss_ratio_stderr", [this](sub_array child) {
+            for (const auto &element : seg_byte_miss_ratio_stderr)
+                child.append(element);
+        }));
+        value_builder.append(kvp("segment_object_miss_ratio_stderr", [this](sub_array child) {
+            for (const auto &element : seg_object_miss_ratio_stderr)
+                child.append(element);
+        }));
+    }
+
     webcache->update_stat(value_builder);
     return value_builder;
 }
 
-bool FrameWork::read_trace(int64_t &next_seq, int64_t &t, int64_t &id, int64_t &size) {
-
-    files_choosable.clear();
-    files_suitable_time.clear();
-    temp_input.clear();
-
-    // Remove unreadable input files
-    std::vector<std::ifstream> infiles_temp;
-    int file_i = 0;
-    for(auto&& infile: infiles) {
-        if(infile) {
-            infiles_temp.emplace_back(std::move(infile));
-        }
-        else {
-            //cout << "Dropping unreadable input file: " << file_i << endl;
-        }
-        ++file_i;
-    }
-    infiles.swap(infiles_temp);
-    infiles_temp.clear();
-
-    // Get time of each input file, track minimal time for later
-    size_t i = 0;
-    int64_t t_min = std::numeric_limits<int64_t>::max();
-    for(auto&& infile: infiles) {
-        int64_t t = std::numeric_limits<int64_t>::max();
-        int64_t next_seq = -1;
-
-        // Record starting position
-        auto pos = infile.tellg();
-
-        if(infile) {
-            files_choosable.push_back(i++);
-            if (is_offline) {
-                infile >> next_seq;
-            }
-
-            infile >> t;
-        }
-
-        if (t < t_min) {
-            t_min = t;
-        }
-
-        temp_input.emplace_back(TempInput{next_seq, t, pos});
-    }
-
-    // Prune choosable files to those with minimal time
-    for(const auto& i: files_choosable) {
-        if (temp_input[i].time == t_min) {
-            files_suitable_time.push_back(i);
-        }
+bool FrameWork::read_trace(TraceRecord &record) {
+    if (reader_heap.empty()) {
+        return false;
     }
 
-    if (files_suitable_time.empty()) {
-        return false;
+    // Files with minimal time. The heap pops ties in file order, so the random pick is the same as scanning all files
+    files_suitable_time.clear();
+    const int64_t t_min = reader_heap.top().first;
+    while (!reader_heap.empty() && reader_heap.top().first == t_min) {
+        files_suitable_time.push_back(reader_heap.top().second);
+        reader_heap.pop();
     }
 
     // Pick input file
     std::uniform_int_distribution<size_t> dist(0, files_suitable_time.size()-1);
     size_t choice_index = dist(gen);
     size_t choice = files_suitable_time[choice_index];
+    for (const auto& f: files_suitable_time) {
+        if (f != choice) {
+            reader_heap.emplace(t_min, f);
+        }
+    }
 
-    for(size_t i = 0; i < infiles.size(); ++i) {
-
-        auto&& infile = infiles[i];
-
-        if (i == choice) {
-            next_seq = temp_input[i].seq;
-            t = temp_input[i].time;
-
-            // Read id and size from chosen file
-            if (!(infile >> id >> size)) {
-                cerr << "Choice: " << choice << " from";
-                for (const auto& f: files_suitable_time) {
-                    cerr << " " << f;
-                }
-                cerr << endl;
-                return false;
-            }
-            
-            for (int i = 0; i < n_extra_fields; ++i)
-                infile >> extra_features[i];
-
-        } else {
-            // Seek back other files
-            infile.seekg(temp_input[i].pos);
+    auto &reader = readers[choice];
+    if (!reader->read(record.next_seq, record.t, record.id, record.size, read_extra_features)) {
+        cerr << "Choice: " << choice << " from";
+        for (const auto& f: files_suitable_time) {
+            cerr << " " << f;
         }
+        cerr << endl;
+        return false;
+    }
+    int64_t _t;
+    if (reader->peek_time(_t)) {
+        reader_heap.emplace(_t, choice);
     }
 
-    if (uni_size)
-        size = 1;
+    for (uint i = 0; i < n_extra_fields; ++i)
+        record.extra_features[i] = read_extra_features[i];
 
     return true;
 }
@@ -527,15 +993,20 @@ bsoncxx::builder::basic::document simulation(std::vector<string> trace_files, st
     }
 
     if (true == enable_trace_format_check) {
-        auto if_pass = trace_sanity_check(trace_files, params);
+        vector<TraceStats> stats;
+        auto if_pass = trace_sanity_check(trace_files, params, &stats);
         if (true == if_pass) {
             cerr << "pass sanity check" << endl;
         } else {
             throw std::runtime_error("fail sanity check");
         }
+        check_n_req(cache_type, stats);
     }
 
     if (cache_type == "Adaptive-TinyLFU") {
+        if (is_binary_trace(trace_files[0])) {
+            throw std::runtime_error("Adaptive-TinyLFU only reads text traces!");
+        }
         if (trace_files.size() == 1 ) {
             return _simulation_tinylfu(trace_files[0], cache_type, cache_size, params);
         } else {
@@ -545,3 +1016,63 @@ bsoncxx::builder::basic::document simulation(std::vector<string> trace_files, st
     else
         return _simulation(trace_files, cache_type, cache_size, params);
 }
+
+vector<bsoncxx::builder::basic::document> simulation(std::vector<string> trace_files,
+                                                     vector<SimulationConfig> configs) {
+    if (configs.size() == 1) {
+        auto &config = configs[0];
+        vector<bsoncxx::builder::basic::document> results;
+        results.emplace_back(simulation(trace_files, config.cache_type, config.cache_size, config.params));
+        return results;
+    }
+    if (configs.empty()) {
+        throw invalid_argument("error: no cache configuration to simulate");
+    }
+
+    int n_extra_fields = get_n_fields(trace_files) - 3;
+    uint n_threads = 0;
+    auto it = configs[0].params.find("fan_out_n_threads");
+    if (it != configs[0].params.end()) {
+        n_threads = stoul(it->second);
+    }
+    for (auto &config: configs) {
+        config.params.erase("fan_out_n_threads");
+        config.params["n_extra_fields"] = to_string(n_extra_fields);
+        if (config.cache_type == "Adaptive-TinyLFU") {
+            throw std::runtime_error("Adaptive-TinyLFU runs in a separate process and can not be fanned out");
+        }
+        if (config.params.count("checkpoint_file")) {
+            throw invalid_argument("error: checkpoint_file can only be written by a single configuration");
+        }
+        //the rss is of the whole process, so every cache would also pay for the others and the shared reader
+        auto metadata_it = config.params.find("is_metadata_in_cache_size");
+        if (metadata_it != config.params.end() && stoi(metadata_it->second)) {
+            throw invalid_argument("error: is_metadata_in_cache_size can only be used by a single configuration");
+        }
+    }
+
+    //the trace is shared, so its check only depends on the first configuration
+    auto &params = configs[0].params;
+    bool enable_trace_format_check = true;
+    if (params.find("enable_trace_format_check") != params.end()) {
+        enable_trace_format_check = stoi(params.find("enable_trace_format_check")->second);
+    }
+    if (true == enable_trace_format_check) {
+        vector<TraceStats> stats;
+        auto if_pass = trace_sanity_check(trace_files, params, &stats);
+        if (true == if_pass) {
+            cerr << "pass sanity check" << endl;
+        } else {
+            throw std::runtime_error("fail sanity check");
+        }
+        for (auto &config: configs) {
+            check_n_req(config.cache_type, stats);
+        }
+    }
+
+    vector<unique_ptr<FrameWork>> frame_works;
+    for (auto &config: configs) {
+        frame_works.emplace_back(new FrameWork(trace_files, config.cache_type, config.cache_size, config.params));
+    }
+    return FrameWork::simulate_fan_out(frame_works, n_threads);
+}
@@ -0,0 +1,61 @@
+//
+// Spatially hashed request sampling.
+//
+
+#include "spatial_sampler.h"
+#include "serialization.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+using namespace std;
+using namespace webcachesim;
+
+SpatialSampler::SpatialSampler(const double &sample_ratio, const uint64_t &max_n_object)
+        : max_n_object(max_n_object) {
+    if (!(sample_ratio > 0 && sample_ratio <= 1)) {
+        throw invalid_argument("error: sample_ratio must be in (0, 1]");
+    }
+    threshold = max<uint64_t>(1, llround(sample_ratio * modulus));
+}
+
+bool SpatialSampler::sample(const uint64_t &id) {
+    const uint64_t h = hash(id);
+    if (h >= threshold) {
+        return false;
+    }
+    if (!max_n_object || !tracked.insert(id).second) {
+        return true;
+    }
+    by_hash.emplace(h, id);
+    while (tracked.size() > max_n_object) {
+        threshold = by_hash.top().first;
+        while (!by_hash.empty() && by_hash.top().first >= threshold) {
+            tracked.erase(by_hash.top().second);
+            by_hash.pop();
+        }
+    }
+    return h < threshold;
+}
+
+void SpatialSampler::serialize(ostream &os) const {
+    write_pod(os, threshold);
+    write_pod(os, static_cast<uint64_t>(tracked.size()));
+    for (auto &id: tracked) {
+        write_pod(os, id);
+    }
+}
+
+void SpatialSampler::deserialize(istream &is) {
+    uint64_t n;
+    read_pod(is, threshold);
+    read_pod(is, n);
+    tracked.clear();
+    by_hash = decltype(by_hash)();
+    for (uint64_t i = 0; i < n; ++i) {
+        uint64_t id;
+        read_pod(is, id);
+        tracked.insert(id);
+        by_hash.emplace(hash(id), id);
+    }
+}
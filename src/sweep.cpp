@@ -0,0 +1,231 @@
+//
+// In-process parameter sweep.
+//
+
+#include "sweep.h"
+#include "simulation.h"
+#include "annotate.h"
+#include "trace_sanity_check.h"
+#include "utils.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include "bsoncxx/builder/basic/document.hpp"
+#include "bsoncxx/json.hpp"
+
+using namespace std;
+using namespace chrono;
+using bsoncxx::builder::basic::kvp;
+using bsoncxx::builder::basic::sub_array;
+
+namespace {
+    string current_timestamp() {
+        time_t now = system_clock::to_time_t(system_clock::now());
+        char buf[100] = {0};
+        strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&now));
+        return buf;
+    }
+
+    //same key as webcachesim_cli, so results of both can be compared
+    bsoncxx::builder::basic::document task_key(const SweepTask &task, bsoncxx::builder::basic::document &value) {
+        bsoncxx::builder::basic::document key;
+        for (auto &k: task.params) {
+            //don't store authentication information
+            if (k.first == "dburi") {
+                continue;
+            }
+            if (!unordered_set<string>({"dbcollection", "task_id", "enable_trace_format_check",
+                                        "fan_out_n_threads"}).count(k.first)) {
+                key.append(kvp(k.first, k.second));
+            } else {
+                value.append(kvp(k.first, k.second));
+            }
+        }
+        key.append(kvp("trace_file", [&task](sub_array child) {
+            child.append(task.trace_file);
+        }));
+        key.append(kvp("cache_type", task.cache_type));
+        key.append(kvp("cache_size", to_string(task.cache_size)));
+        return key;
+    }
+
+    struct PreparedTrace {
+        uint n_extra_fields;
+        shared_ptr<const DecodedTrace> trace;
+        //empty if the trace was not checked
+        vector<TraceStats> stats;
+    };
+
+    /*
+     * work-stealing pool: every worker pops its own tasks from the back of its deque, and steals from the front of
+     * the others' once it runs out
+     */
+    class SweepPool {
+    public:
+        SweepPool(const size_t &n_task, const size_t &n_worker) : queues(n_worker) {
+            //round-robin, so expensive configurations of the same trace end up on different workers
+            for (size_t i = 0; i < n_task; ++i) {
+                queues[i % n_worker].tasks.push_back(i);
+            }
+        }
+
+        //next task for worker w. Returns false once every task is taken
+        bool take(const size_t &w, size_t &task) {
+            for (size_t i = 0; i < queues.size(); ++i) {
+                auto &queue = queues[(w + i) % queues.size()];
+                lock_guard<mutex> lock(queue.mtx);
+                if (queue.tasks.empty()) {
+                    continue;
+                }
+                if (i == 0) {
+                    task = queue.tasks.back();
+                    queue.tasks.pop_back();
+                } else {
+                    task = queue.tasks.front();
+                    queue.tasks.pop_front();
+                }
+                return true;
+            }
+            return false;
+        }
+
+    private:
+        struct Queue {
+            mutex mtx;
+            deque<size_t> tasks;
+        };
+
+        vector<Queue> queues;
+    };
+}
+
+size_t sweep(const vector<SweepTask> &tasks, uint n_threads, const string &output_file) {
+    if (tasks.empty()) {
+        throw invalid_argument("error: no task to sweep");
+    }
+    for (auto &task: tasks) {
+        if (task.cache_type == "Adaptive-TinyLFU") {
+            throw invalid_argument("error: Adaptive-TinyLFU runs in a separate process and can not be swept");
+        }
+        if (task.params.count("checkpoint_file")) {
+            throw invalid_argument("error: checkpoint_file can not be written by a sweep");
+        }
+        //the rss of the process includes the decoded traces and every running task
+        auto metadata_it = task.params.find("is_metadata_in_cache_size");
+        if (metadata_it != task.params.end() && stoi(metadata_it->second)) {
+            throw invalid_argument("error: is_metadata_in_cache_size can not be used by a sweep");
+        }
+    }
+
+    ofstream output(output_file, ios::app);
+    if (!output) {
+        throw runtime_error("Exception opening file " + output_file);
+    }
+
+    //check, annotate and decode every trace once
+    unordered_map<string, PreparedTrace> traces;
+    for (auto &task: tasks) {
+        if (traces.count(task.trace_file)) {
+            continue;
+        }
+        const vector<string> trace_files = {task.trace_file};
+        uint n_extra_fields = get_n_fields(trace_files) - 3;
+        //the check only depends on the trace, so the first task's parameters decide whether to run it
+        auto params = task.params;
+        params["n_extra_fields"] = to_string(n_extra_fields);
+        bool enable_trace_format_check = true;
+        if (params.find("enable_trace_format_check") != params.end()) {
+            enable_trace_format_check = stoi(params.find("enable_trace_format_check")->second);
+        }
+        vector<TraceStats> stats;
+        if (enable_trace_format_check) {
+            if (!trace_sanity_check(trace_files, params, &stats)) {
+                throw runtime_error("fail sanity check: " + task.trace_file);
+            }
+            cerr << "pass sanity check: " << task.trace_file << endl;
+        }
+
+        bool is_annotated = false;
+        for (auto &other: tasks) {
+            if (other.trace_file == task.trace_file && FrameWork::offline_algorithms.count(other.cache_type)) {
+                is_annotated = true;
+                break;
+            }
+        }
+        if (is_annotated) {
+            uint annotate_n_threads = 0;
+            uint64_t annotate_memory_budget = 8ull * 1024 * 1024 * 1024;
+            if (params.count("annotate_n_threads")) {
+                annotate_n_threads = stoul(params["annotate_n_threads"]);
+            }
+            if (params.count("annotate_memory_budget")) {
+                annotate_memory_budget = stoull(params["annotate_memory_budget"]);
+            }
+            annotate(task.trace_file, n_extra_fields, annotate_n_threads, annotate_memory_budget);
+        }
+        cerr << "loading trace: " << task.trace_file << endl;
+        traces[task.trace_file] = {n_extra_fields, DecodedTrace::load(task.trace_file, is_annotated, n_extra_fields),
+                                   stats};
+    }
+
+    if (!n_threads) {
+        n_threads = max(1u, thread::hardware_concurrency());
+    }
+    const size_t n_worker = min<size_t>(n_threads, tasks.size());
+    cerr << "sweeping " << tasks.size() << " tasks on " << n_worker << " threads" << endl;
+
+    SweepPool pool(tasks.size(), n_worker);
+    mutex output_mtx;
+    atomic<size_t> n_failed(0);
+
+    auto worker = [&](const size_t &w) {
+        size_t i;
+        while (pool.take(w, i)) {
+            auto &task = tasks[i];
+            auto &prepared = traces.at(task.trace_file);
+            bsoncxx::builder::basic::document value;
+            auto key = task_key(task, value);
+            for (bsoncxx::document::element ele: key.view())
+                value.append(kvp(ele.key(), ele.get_value()));
+
+            auto time_begin = system_clock::now();
+            try {
+                check_n_req(task.cache_type, prepared.stats);
+                auto params = task.params;
+                params["n_extra_fields"] = to_string(prepared.n_extra_fields);
+                //reading a decoded trace is cheap, a prefetch thread per task would only compete with the pool
+                params.emplace("prefetch", "0");
+                FrameWork frame_work({task.trace_file}, task.cache_type, task.cache_size, params, {prepared.trace});
+                auto res = frame_work.simulate();
+                for (bsoncxx::document::element ele: res.view())
+                    value.append(kvp(ele.key(), ele.get_value()));
+            } catch (const exception &e) {
+                cerr << "error: task " << i << " failed: " << e.what() << endl;
+                value.append(kvp("error", string(e.what())));
+                ++n_failed;
+            }
+            auto simulation_time = duration_cast<seconds>(system_clock::now() - time_begin).count();
+            value.append(kvp("simulation_time", to_string(simulation_time)));
+            value.append(kvp("simulation_timestamp", current_timestamp()));
+
+            lock_guard<mutex> lock(output_mtx);
+            output << bsoncxx::to_json(value.view()) << endl;
+        }
+    };
+
+    vector<thread> threads;
+    for (size_t w = 0; w < n_worker; ++w) {
+        threads.emplace_back(worker, w);
+    }
+    for (auto &thread: threads) {
+        thread.join();
+    }
+    return n_failed;
+}
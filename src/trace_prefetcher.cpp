@@ -0,0 +1,94 @@
+//
+// Background trace reading for FrameWork.
+//
+
+#include "trace_prefetcher.h"
+#include <stdexcept>
+
+using namespace std;
+
+namespace webcachesim {
+
+    TracePrefetcher::TracePrefetcher(function<bool(TraceRecord &)> source, const size_t &batch_size,
+                                     const size_t &n_batch)
+            : source(move(source)), batch_size(batch_size) {
+        //one batch is held by the consumer, so at least one more is needed to overlap reading
+        if (batch_size == 0 || n_batch < 2) {
+            throw invalid_argument("error: prefetching needs batch_size > 0 and n_batch >= 2");
+        }
+        batches.resize(n_batch);
+        for (auto &batch: batches) {
+            batch.reserve(batch_size);
+        }
+        reader_thread = thread(&TracePrefetcher::run, this);
+    }
+
+    TracePrefetcher::~TracePrefetcher() {
+        {
+            lock_guard<mutex> lock(mtx);
+            stop = true;
+        }
+        cv_free.notify_all();
+        reader_thread.join();
+    }
+
+    void TracePrefetcher::run() {
+        const size_t n_batch = batches.size();
+        size_t tail = 0;
+        bool eof = false;
+        while (!eof) {
+            {
+                unique_lock<mutex> lock(mtx);
+                cv_free.wait(lock, [&] { return stop || n_ready + holding < n_batch; });
+                if (stop) {
+                    return;
+                }
+            }
+            //the tail slot is not visible to the consumer until published, so fill it without the lock
+            auto &batch = batches[tail];
+            batch.resize(batch_size);
+            size_t n = 0;
+            try {
+                while (n < batch_size && source(batch[n])) {
+                    ++n;
+                }
+            } catch (...) {
+                lock_guard<mutex> lock(mtx);
+                error = current_exception();
+                done = true;
+                cv_ready.notify_one();
+                return;
+            }
+            batch.resize(n);
+            eof = n < batch_size;
+
+            lock_guard<mutex> lock(mtx);
+            if (n) {
+                ++n_ready;
+                tail = (tail + 1) % n_batch;
+            }
+            done = eof;
+            cv_ready.notify_one();
+        }
+    }
+
+    const vector<TraceRecord> &TracePrefetcher::next_batch() {
+        static const vector<TraceRecord> empty_batch;
+        unique_lock<mutex> lock(mtx);
+        if (holding) {
+            head = (head + 1) % batches.size();
+            holding = false;
+            cv_free.notify_one();
+        }
+        cv_ready.wait(lock, [&] { return n_ready || done; });
+        if (!n_ready) {
+            if (error) {
+                rethrow_exception(error);
+            }
+            return empty_batch;
+        }
+        --n_ready;
+        holding = true;
+        return batches[head];
+    }
+}
@@ -0,0 +1,284 @@
+//
+// Per-file trace readers used by FrameWork.
+//
+
+#include "trace_reader.h"
+#include <stdexcept>
+
+using namespace std;
+
+namespace webcachesim {
+
+    unique_ptr<TraceReader> TraceReader::open(const string &trace_file, const bool &is_annotated,
+                                              const uint &n_extra_fields) {
+        unique_ptr<TraceReader> reader;
+        if (is_binary_trace(trace_file)) {
+            reader.reset(new BinaryTraceReader(trace_file, n_extra_fields));
+        } else {
+            reader.reset(new TextTraceReader(trace_file, n_extra_fields));
+        }
+        if (is_annotated) {
+            reader.reset(new AnnotatedTraceReader(move(reader), next_seq_file(trace_file)));
+        }
+        return reader;
+    }
+
+    TextTraceScanner::TextTraceScanner(const string &trace_file, size_t buffer_size)
+            : buffer(buffer_size) {
+        file = fopen(trace_file.c_str(), "r");
+        if (!file) {
+            throw runtime_error("Exception opening/reading file " + trace_file);
+        }
+    }
+
+    TextTraceScanner::TextTraceScanner(const string &trace_file, size_t buffer_size, uint64_t begin, uint64_t end)
+            : TextTraceScanner(trace_file, buffer_size) {
+        range_end = end;
+        if (!begin) {
+            return;
+        }
+        //a line belongs to this range only if the previous one ended before begin
+        if (fseeko(file, begin - 1, SEEK_SET)) {
+            throw runtime_error("Exception seeking in trace");
+        }
+        buffer_offset = begin - 1;
+        while (true) {
+            if (pos == this->end && !fill()) {
+                return;
+            }
+            if (buffer[pos++] == '\n') {
+                line_start = buffer_offset + pos;
+                return;
+            }
+        }
+    }
+
+    TextTraceScanner::~TextTraceScanner() {
+        fclose(file);
+    }
+
+    int TextTraceScanner::next_line(int64_t *fields, const int &max_fields) {
+        int n_fields = 0;
+        while (true) {
+            if (pos == end && !fill()) {
+                return n_fields;
+            }
+            char c = buffer[pos];
+            if (c == '\n') {
+                ++pos;
+                line_start = buffer_offset + pos;
+                if (n_fields) {
+                    return n_fields;
+                }
+            } else if (c == ' ' || c == '\t' || c == '\r') {
+                ++pos;
+            } else {
+                if (!n_fields && line_start >= range_end) {
+                    return 0;
+                }
+                int64_t v;
+                if (!parse_int(v)) {
+                    throw runtime_error("Malformed trace line " + to_string(n_line + 1));
+                }
+                if (n_fields < max_fields) {
+                    fields[n_fields] = v;
+                }
+                ++n_fields;
+                if (n_fields == 1) {
+                    ++n_line;
+                }
+            }
+        }
+    }
+
+    bool TextTraceScanner::fill() {
+        buffer_offset += end;
+        end = fread(buffer.data(), 1, buffer.size(), file);
+        pos = 0;
+        return end > 0;
+    }
+
+    bool TextTraceScanner::parse_int(int64_t &v) {
+        bool negative = false;
+        if (buffer[pos] == '-') {
+            negative = true;
+            ++pos;
+            if (pos == end && !fill()) {
+                return false;
+            }
+        }
+        uint64_t u = 0;
+        bool any = false;
+        while (true) {
+            if (pos == end && !fill()) {
+                break;
+            }
+            char c = buffer[pos];
+            if (c < '0' || c > '9') {
+                break;
+            }
+            u = u * 10 + (c - '0');
+            any = true;
+            ++pos;
+        }
+        v = negative ? -static_cast<int64_t>(u) : static_cast<int64_t>(u);
+        return any;
+    }
+
+    TextTraceReader::TextTraceReader(const string &trace_file, const uint &n_extra_fields)
+            : scanner(trace_file, buffer_size), n_extra_fields(n_extra_fields) {
+        if (n_extra_fields > max_n_extra_feature) {
+            throw runtime_error("Error: too many extra fields for " + trace_file);
+        }
+        advance();
+    }
+
+    void TextTraceReader::advance() {
+        const int n_expected = 3 + n_extra_fields;
+        int n = scanner.next_line(fields, n_expected);
+        has_next = n > 0;
+        if (has_next && n != n_expected) {
+            throw runtime_error("Error: expecting " + to_string(n_expected) + " fields per request, got " +
+                                to_string(n));
+        }
+    }
+
+    bool TextTraceReader::peek_time(int64_t &t) {
+        if (!has_next) {
+            return false;
+        }
+        t = fields[0];
+        return true;
+    }
+
+    bool TextTraceReader::read(int64_t &next_seq, int64_t &t, int64_t &id, int64_t &size,
+                               vector<uint16_t> &extra_features) {
+        if (!has_next) {
+            return false;
+        }
+        t = fields[0];
+        id = fields[1];
+        size = fields[2];
+        for (uint i = 0; i < n_extra_fields; ++i)
+            extra_features[i] = fields[3 + i];
+        advance();
+        return true;
+    }
+
+    BinaryTraceReader::BinaryTraceReader(const string &trace_file, const uint &n_extra_fields)
+            : trace(trace_file), n_extra_fields(n_extra_fields) {
+        if (trace.n_extra_fields() != n_extra_fields) {
+            throw runtime_error("Error: binary trace " + trace_file + " has " + to_string(trace.n_extra_fields()) +
+                                " extra fields, expecting " + to_string(n_extra_fields));
+        }
+    }
+
+    bool BinaryTraceReader::peek_time(int64_t &t) {
+        if (cursor >= trace.n_req()) {
+            return false;
+        }
+        t = trace.t[cursor];
+        return true;
+    }
+
+    bool BinaryTraceReader::read(int64_t &next_seq, int64_t &t, int64_t &id, int64_t &size,
+                                 vector<uint16_t> &extra_features) {
+        if (cursor >= trace.n_req()) {
+            return false;
+        }
+        t = trace.t[cursor];
+        id = trace.id[cursor];
+        size = trace.size[cursor];
+        for (uint i = 0; i < n_extra_fields; ++i)
+            extra_features[i] = trace.extra[i][cursor];
+        ++cursor;
+        return true;
+    }
+
+    AnnotatedTraceReader::AnnotatedTraceReader(unique_ptr<TraceReader> reader, const string &next_seq_file)
+            : reader(move(reader)), sidecar(next_seq_file) {}
+
+    bool AnnotatedTraceReader::read(int64_t &next_seq, int64_t &t, int64_t &id, int64_t &size,
+                                    vector<uint16_t> &extra_features) {
+        if (!reader->read(next_seq, t, id, size, extra_features)) {
+            return false;
+        }
+        if (cursor >= sidecar.n_req) {
+            throw runtime_error("Error: next_seq sidecar is shorter than the trace; remove it to re-annotate");
+        }
+        next_seq = sidecar.next_seq[cursor++];
+        return true;
+    }
+
+    shared_ptr<const DecodedTrace>
+    DecodedTrace::load(const string &trace_file, const bool &is_annotated, const uint &n_extra_fields) {
+        shared_ptr<DecodedTrace> trace(new DecodedTrace);
+        trace->n_extra_fields = n_extra_fields;
+        if (is_binary_trace(trace_file)) {
+            trace->mapped.reset(new MappedBinaryTrace(trace_file));
+            auto &mapped = *trace->mapped;
+            if (mapped.n_extra_fields() != n_extra_fields) {
+                throw runtime_error("Error: binary trace " + trace_file + " has " +
+                                    to_string(mapped.n_extra_fields()) + " extra fields, expecting " +
+                                    to_string(n_extra_fields));
+            }
+            trace->n_req = mapped.n_req();
+            trace->t = mapped.t;
+            trace->id = mapped.id;
+            trace->size = mapped.size;
+            for (uint i = 0; i < n_extra_fields; ++i)
+                trace->extra[i] = mapped.extra[i];
+        } else {
+            TextTraceReader reader(trace_file, n_extra_fields);
+            int64_t next_seq, t, id, size;
+            vector<uint16_t> extra_features(n_extra_fields);
+            while (reader.read(next_seq, t, id, size, extra_features)) {
+                trace->t_column.push_back(t);
+                trace->id_column.push_back(id);
+                //fits: the sanity check bounds sizes to uint32
+                trace->size_column.push_back(size);
+                for (uint i = 0; i < n_extra_fields; ++i)
+                    trace->extra_columns[i].push_back(extra_features[i]);
+            }
+            trace->n_req = trace->t_column.size();
+            trace->t = trace->t_column.data();
+            trace->id = trace->id_column.data();
+            trace->size = trace->size_column.data();
+            for (uint i = 0; i < n_extra_fields; ++i)
+                trace->extra[i] = trace->extra_columns[i].data();
+        }
+        if (is_annotated) {
+            trace->sidecar.reset(new MappedNextSeq(next_seq_file(trace_file)));
+            if (trace->sidecar->n_req < trace->n_req) {
+                throw runtime_error("Error: next_seq sidecar is shorter than the trace; remove it to re-annotate");
+            }
+            trace->next_seq = trace->sidecar->next_seq;
+        }
+        return trace;
+    }
+
+    bool DecodedTraceReader::peek_time(int64_t &t) {
+        if (cursor >= trace->n_req) {
+            return false;
+        }
+        t = trace->t[cursor];
+        return true;
+    }
+
+    bool DecodedTraceReader::read(int64_t &next_seq, int64_t &t, int64_t &id, int64_t &size,
+                                  vector<uint16_t> &extra_features) {
+        if (cursor >= trace->n_req) {
+            return false;
+        }
+        if (trace->next_seq) {
+            next_seq = trace->next_seq[cursor];
+        }
+        t = trace->t[cursor];
+        id = trace->id[cursor];
+        size = trace->size[cursor];
+        for (uint i = 0; i < trace->n_extra_fields; ++i)
+            extra_features[i] = trace->extra[i][cursor];
+        ++cursor;
+        return true;
+    }
+}
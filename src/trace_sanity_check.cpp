@@ -8,8 +8,18 @@
 #include <sstream>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
+#include <stdexcept>
+#include <thread>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "utils.h"
 #include "file_hash.h"
+#include "binary_trace.h"
+#include "trace_reader.h"
 #include "bsoncxx/builder/basic/document.hpp"
 #include "bsoncxx/json.hpp"
 #include "mongocxx/client.hpp"
@@ -17,12 +27,14 @@
 #include "mongocxx/uri.hpp"
 
 using namespace std;
+using namespace webcachesim;
 using bsoncxx::builder::basic::kvp;
 
 //max object size is 4GB
 const uint64_t max_obj_size = 0xffffffff;
-//max n req in a trace is 4 Billion
-const uint64_t max_n_req = 0xffffffff;
+//caches counting requests in 32-bit sequence numbers can simulate at most 4 Billion requests
+const uint64_t max_n_req_seq32 = 0xffffffff;
+const unordered_set<string> seq32_cache_types = {"LRB", "ParallelLRB", "ShardedParallelLRB"};
 //max n_extra_field = 4, as this field is statically allocated
 const int max_n_extra_fields = 4;
 //extra_value is uint16_t
@@ -31,7 +43,311 @@ const int max_extra = 0xffff;
 const string file_hash_collection = "file_hash";
 using bsoncxx::builder::basic::make_document;
 
-bool trace_sanity_check(const std::vector<string> &trace_files, map<string, string> &params) {
+namespace {
+    //per chunk, so a broken trace does not flood the log
+    const size_t max_reported_errors = 100;
+    //bump when the verdict changes for the same trace. 2: no limit on the number of requests
+    const int stats_cache_format = 2;
+
+    struct ChunkResult {
+        uint64_t n_req = 0;
+        uint64_t byte_req = 0;
+        bool pass = true;
+        //key -> size, sharded by key for the merge
+        vector<unordered_map<uint64_t, uint32_t>> size_maps;
+        //(request index within the chunk, message)
+        vector<pair<uint64_t, string>> errors;
+
+        void fail(const uint64_t &i, const string &msg) {
+            pass = false;
+            if (errors.size() < max_reported_errors) {
+                errors.emplace_back(i, msg);
+            }
+        }
+    };
+
+    inline size_t shard_of(const uint64_t &key, const size_t &n_shard) {
+        return ((key * 0x9E3779B97F4A7C15ull) >> 32) % n_shard;
+    }
+
+    void check_request(ChunkResult &res, const int &n_extra_fields, const uint64_t &key, const uint64_t &size,
+                       const uint64_t *extra_features) {
+        const uint64_t &i = res.n_req;
+        for (int j = 0; j < n_extra_fields; ++j) {
+            if (extra_features[j] > max_extra) {
+                res.fail(i, " extra " + to_string(j) + ":" + to_string(extra_features[j]) + " > max_extra " +
+                            to_string(max_extra));
+            }
+        }
+        if (size > max_obj_size) {
+            res.fail(i, " size " + to_string(size) + " > max_obj_size " + to_string(max_obj_size));
+        }
+        if (size == 0) {
+            res.fail(i, " size == 0");
+        }
+        auto &size_map = res.size_maps[shard_of(key, res.size_maps.size())];
+        auto it = size_map.find(key);
+        if (it == size_map.end()) {
+            size_map.insert({key, size});
+        } else if (it->second != size) {
+            res.fail(i, ", key: " + to_string(key) + " size inconsistent. Old size: " + to_string(it->second) +
+                        " new size: " + to_string(size));
+        }
+        res.byte_req += size;
+        ++res.n_req;
+    }
+
+    /*
+     * scan the trace on all cores: each thread checks a contiguous chunk, then the per-chunk size maps are merged
+     * shard by shard to find sizes inconsistent across chunks
+     */
+    TraceStats scan_trace(const string &trace_file, const int &n_extra_fields) {
+        const size_t n_thread = max(1u, thread::hardware_concurrency());
+        vector<ChunkResult> results(n_thread);
+        for (auto &res: results) {
+            res.size_maps.resize(n_thread);
+        }
+        vector<thread> threads;
+
+        if (is_binary_trace(trace_file)) {
+            MappedBinaryTrace trace(trace_file);
+            const uint64_t n = trace.n_req();
+            for (size_t c = 0; c < n_thread; ++c) {
+                threads.emplace_back([&, c] {
+                    auto &res = results[c];
+                    uint64_t extra_features[max_n_extra_feature];
+                    for (uint64_t i = n * c / n_thread; i < n * (c + 1) / n_thread; ++i) {
+                        for (int j = 0; j < n_extra_fields; ++j) {
+                            extra_features[j] = trace.extra[j][i];
+                        }
+                        check_request(res, n_extra_fields, trace.id[i], trace.size[i], extra_features);
+                    }
+                });
+            }
+            for (auto &th: threads) {
+                th.join();
+            }
+        } else {
+            struct stat st{};
+            if (stat(trace_file.c_str(), &st)) {
+                throw std::runtime_error("Exception opening file " + trace_file);
+            }
+            const uint64_t length = st.st_size;
+            const int n_expected = 3 + n_extra_fields;
+            for (size_t c = 0; c < n_thread; ++c) {
+                threads.emplace_back([&, c] {
+                    auto &res = results[c];
+                    try {
+                        TextTraceScanner scanner(trace_file, 1024 * 1024, length * c / n_thread,
+                                                 length * (c + 1) / n_thread);
+                        int64_t fields[3 + max_n_extra_feature];
+                        uint64_t extra_features[max_n_extra_feature];
+                        int n;
+                        while ((n = scanner.next_line(fields, n_expected))) {
+                            if (n != n_expected) {
+                                res.fail(res.n_req, " has " + to_string(n) + " fields, expecting " +
+                                                    to_string(n_expected));
+                            }
+                            for (int j = 0; j < n_extra_fields; ++j) {
+                                extra_features[j] = fields[3 + j];
+                            }
+                            check_request(res, n_extra_fields, fields[1], fields[2], extra_features);
+                        }
+                    } catch (const std::exception &e) {
+                        res.fail(res.n_req, string(" ") + e.what());
+                    }
+                });
+            }
+            for (auto &th: threads) {
+                th.join();
+            }
+        }
+
+        TraceStats stats;
+        stats.valid = true;
+        uint64_t byte_req = 0;
+        for (auto &res: results) {
+            for (auto &e: res.errors) {
+                cerr << "req: " << stats.n_req + e.first << e.second << endl;
+            }
+            stats.valid = stats.valid && res.pass;
+            stats.n_req += res.n_req;
+            byte_req += res.byte_req;
+        }
+
+        //merge chunks in trace order, so the first size seen is kept as in a sequential scan
+        vector<uint64_t> n_unique_obj(n_thread, 0), unique_bytes(n_thread, 0);
+        vector<bool> shard_pass(n_thread, true);
+        threads.clear();
+        for (size_t s = 0; s < n_thread; ++s) {
+            threads.emplace_back([&, s] {
+                auto &merged = results[0].size_maps[s];
+                for (size_t c = 1; c < n_thread; ++c) {
+                    auto &size_map = results[c].size_maps[s];
+                    for (auto &kv: size_map) {
+                        auto it = merged.insert(kv).first;
+                        if (it->second != kv.second) {
+                            //message order across shards is arbitrary, but a line is printed at once
+                            cerr << ("key: " + to_string(kv.first) + " size inconsistent. Old size: " +
+                                     to_string(it->second) + " new size: " + to_string(kv.second) + "\n");
+                            shard_pass[s] = false;
+                        }
+                    }
+                    unordered_map<uint64_t, uint32_t>().swap(size_map);
+                }
+                n_unique_obj[s] = merged.size();
+                for (auto &kv: merged) {
+                    unique_bytes[s] += kv.second;
+                }
+                unordered_map<uint64_t, uint32_t>().swap(merged);
+            });
+        }
+        for (auto &th: threads) {
+            th.join();
+        }
+        for (size_t s = 0; s < n_thread; ++s) {
+            stats.valid = stats.valid && shard_pass[s];
+            stats.n_unique_obj += n_unique_obj[s];
+            stats.unique_bytes += unique_bytes[s];
+        }
+
+        if (stats.n_req) {
+            stats.byte_million_req = static_cast<uint64_t>(static_cast<long double>(byte_req) * 1e6 / stats.n_req);
+        }
+        return stats;
+    }
+
+    /*
+     * local cache of sanity check results.
+     * Hashing the whole trace costs about as much as checking it, so the key hashes only its head and tail and relies
+     * on size and mtime to catch changes in between
+     */
+    struct TraceFingerprint {
+        uint64_t size;
+        int64_t mtime;
+        uint32_t hash;
+    };
+
+    TraceFingerprint get_fingerprint(const string &trace_file) {
+        const uint64_t sample_size = 1024 * 1024;
+        struct stat st{};
+        if (stat(trace_file.c_str(), &st)) {
+            throw std::runtime_error("Exception opening file " + trace_file);
+        }
+        TraceFingerprint fp{static_cast<uint64_t>(st.st_size),
+                            static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec, 0};
+        boost::crc_32_type result;
+        ifstream ifs(trace_file, ios_base::binary);
+        vector<char> buffer(sample_size);
+        ifs.read(buffer.data(), sample_size);
+        result.process_bytes(buffer.data(), ifs.gcount());
+        if (fp.size > 2 * sample_size) {
+            ifs.clear();
+            ifs.seekg(fp.size - sample_size);
+            ifs.read(buffer.data(), sample_size);
+            result.process_bytes(buffer.data(), ifs.gcount());
+        }
+        fp.hash = result.checksum();
+        return fp;
+    }
+
+    string get_stats_cache_dir() {
+        auto dir = getenv("WEBCACHESIM_CACHE_DIR");
+        if (dir) {
+            return dir;
+        }
+        auto home = getenv("HOME");
+        if (!home) {
+            return "";
+        }
+        return string(home) + "/.cache/webcachesim";
+    }
+
+    //one file per trace path
+    string get_stats_cache_file(const string &trace_file) {
+        auto dir = get_stats_cache_dir();
+        if (dir.empty()) {
+            return "";
+        }
+        char *abs_path = realpath(trace_file.c_str(), nullptr);
+        string path = abs_path ? abs_path : trace_file;
+        free(abs_path);
+        boost::crc_32_type result;
+        result.process_bytes(path.data(), path.size());
+        return dir + "/trace_stats_" + to_string(result.checksum());
+    }
+
+    bool load_cached_stats(const string &cache_file, const TraceFingerprint &fp, const int &n_extra_fields,
+                           TraceStats &stats) {
+        ifstream infile(cache_file);
+        if (!infile) {
+            return false;
+        }
+        map<string, string> kv;
+        string key, value;
+        while (infile >> key >> value) {
+            kv[key] = value;
+        }
+        try {
+            if (stoi(kv.at("format")) != stats_cache_format || stoull(kv.at("size")) != fp.size ||
+                stoll(kv.at("mtime")) != fp.mtime || stoul(kv.at("hash")) != fp.hash ||
+                stoi(kv.at("n_extra_fields")) != n_extra_fields) {
+                return false;
+            }
+            stats.valid = stoi(kv.at("valid"));
+            stats.n_req = stoull(kv.at("n_req"));
+            stats.n_unique_obj = stoull(kv.at("n_unique_obj"));
+            stats.unique_bytes = stoull(kv.at("unique_bytes"));
+            stats.byte_million_req = stoull(kv.at("byte_million_req"));
+        } catch (const std::exception &) {
+            //stale format
+            return false;
+        }
+        return true;
+    }
+
+    void store_cached_stats(const string &cache_file, const string &trace_file, const TraceFingerprint &fp,
+                            const int &n_extra_fields, const TraceStats &stats) {
+        //mkdir -p
+        auto dir = cache_file.substr(0, cache_file.rfind('/'));
+        for (size_t p = dir.find('/', 1); ; p = dir.find('/', p + 1)) {
+            auto sub = dir.substr(0, p);
+            if (mkdir(sub.c_str(), 0755) && errno != EEXIST) {
+                cerr << "warning: can not create trace stats cache dir " << sub << ": " << strerror(errno) << endl;
+                return;
+            }
+            if (p == string::npos) {
+                break;
+            }
+        }
+        auto tmp_file = cache_file + ".tmp." + to_string(getpid());
+        {
+            ofstream outfile(tmp_file);
+            if (!outfile) {
+                cerr << "warning: can not write trace stats cache " << tmp_file << endl;
+                return;
+            }
+            //filename is informational only. Paths with spaces are fine, as it is never parsed
+            outfile << "format " << stats_cache_format << "\n"
+                    << "size " << fp.size << "\n"
+                    << "mtime " << fp.mtime << "\n"
+                    << "hash " << fp.hash << "\n"
+                    << "n_extra_fields " << n_extra_fields << "\n"
+                    << "valid " << stats.valid << "\n"
+                    << "n_req " << stats.n_req << "\n"
+                    << "n_unique_obj " << stats.n_unique_obj << "\n"
+                    << "unique_bytes " << stats.unique_bytes << "\n"
+                    << "byte_million_req " << stats.byte_million_req << "\n"
+                    << "filename " << trace_file << "\n";
+        }
+        if (rename(tmp_file.c_str(), cache_file.c_str())) {
+            cerr << "warning: can not write trace stats cache " << cache_file << ": " << strerror(errno) << endl;
+        }
+    }
+}
+
+bool trace_sanity_check(const std::vector<string> &trace_files, map<string, string> &params,
+                        vector<TraceStats> *stats) {
     /*
      * cache the sanity check results
      * {hash: , filename: , valid: }
@@ -47,28 +363,29 @@ bool trace_sanity_check(const std::vector<string> &trace_files, map<string, stri
                 mongocxx::client client = mongocxx::client{mongocxx::uri(params["dburi"])};
                 auto db = client[mongocxx::uri(params["dburi"]).database()];
                 auto cursor = db[file_hash_collection].find_one(make_document(kvp("hash", to_string(hash))));
-                if (cursor && !(cursor->view().empty())) {
-                    auto a = cursor->view().find("valid")->get_utf8().value.to_string();
-                    if ("1" == a) {
-                        cerr<<"sanity check pass by querying cache"<<endl;
-                        return true;
-                    } else {
-                        cerr<<"sanity check fail by querying cache"<<endl;
-                        return false;
+                //results of an older format are checked again below, which replaces them
+                if (cursor && !(cursor->view().empty()) && cursor->view().find("format") != cursor->view().end() &&
+                    cursor->view()["format"].get_utf8().value.to_string() == to_string(stats_cache_format)) {
+                    auto view = cursor->view();
+                    auto get = [&view](const string &key) { return view[key].get_utf8().value.to_string(); };
+                    TraceStats trace_stats;
+                    trace_stats.valid = ("1" == get("valid"));
+                    trace_stats.n_req = stoull(get("n_req"));
+                    trace_stats.n_unique_obj = stoull(get("n_unique_obj"));
+                    trace_stats.unique_bytes = stoull(get("unique_bytes"));
+                    trace_stats.byte_million_req = stoull(get("byte_million_req"));
+                    cerr << "sanity check " << (trace_stats.valid ? "pass" : "fail") << " by querying cache" << endl;
+                    if_pass = if_pass && trace_stats.valid;
+                    if (stats) {
+                        stats->push_back(trace_stats);
                     }
+                    continue;
                 }
             } catch (const std::exception &xcp) {
                 throw std::runtime_error("warning: db connection failed: " + string(xcp.what()));
             }
         }
 
-        cerr << "running sanity check on trace: " << trace_file << endl;
-
-        ifstream infile(trace_file);
-        if (!infile) {
-            throw std::runtime_error("Exception opening file " + trace_file);
-        }
-
         auto it = params.find("n_extra_fields");
         if (it == params.end()) {
             throw std::runtime_error("n_extra_fields not available");
@@ -78,55 +395,32 @@ bool trace_sanity_check(const std::vector<string> &trace_files, map<string, stri
         if (n_extra_fields > max_n_extra_fields) {
             cerr<<"error: n_extra_fields "<<n_extra_fields<<" > max_n_extra_fields "<<max_n_extra_fields<<endl;
             if_pass = false;
-        }
-        cerr<<"n_extra_fields: "<<n_extra_fields<<endl;
-
-        uint64_t t, key, size;
-        vector<uint64_t > extra_features(n_extra_fields);
-        //key -> size
-        unordered_map<uint64_t, uint32_t> size_map;
-        uint64_t n_req = 0;
-
-        while (infile >> t >> key >> size) {
-            for (int i = 0; i < n_extra_fields; ++i) {
-                infile >> extra_features[i];
-            }
-
-            for (int i = 0; i < n_extra_fields; ++i) {
-                if (extra_features[i] > max_extra) {
-                    cerr<<"req: "<<n_req<<" extra "<<i<<":"<<extra_features[i]<<" > max_extra "<<max_extra<<endl;
-                    if_pass = false;
-                }
-            }
-
-            //check
-            if (size > max_obj_size) {
-                cerr<<"req: "<<n_req<<" size "<<size<<" > max_obj_size "<<max_obj_size<<endl;
-                if_pass = false;
-            }
-            if (size == 0) {
-                cerr<<"req: "<<n_req<<" size == 0"<<endl;
-                if_pass = false;
+            if (stats) {
+                stats->emplace_back();
             }
+            continue;
+        }
 
-            auto it = size_map.find(key);
-            if (it == size_map.end()) {
-                size_map.insert({key, size});
-            } else {
-                if (it->second != size) {
-                    cerr<<"req: "<<n_req<<", key: "  <<key<<" size inconsistent. Old size: "<<it->second<<" new size: "<<size<<endl;
-                    if_pass = false;
-                }
-            }
-            if (!(n_req%1000000)) {
-                cerr<<"n_req: "<<n_req<<endl;
+        TraceStats trace_stats;
+        auto fp = get_fingerprint(trace_file);
+        auto cache_file = get_stats_cache_file(trace_file);
+        if (!cache_file.empty() && load_cached_stats(cache_file, fp, n_extra_fields, trace_stats)) {
+            cerr << "sanity check " << (trace_stats.valid ? "pass" : "fail") << " by local cache " << cache_file
+                 << endl;
+        } else {
+            cerr << "running sanity check on trace: " << trace_file << endl;
+            cerr << "n_extra_fields: " << n_extra_fields << endl;
+            trace_stats = scan_trace(trace_file, n_extra_fields);
+            if (!cache_file.empty()) {
+                store_cached_stats(cache_file, trace_file, fp, n_extra_fields, trace_stats);
             }
-            ++n_req;
         }
-
-        if (n_req > max_n_req) {
-            cerr<<"n_req "<<n_req<<" > max_n_req "<<max_n_req<<endl;
-            if_pass = false;
+        cerr << "n_req: " << trace_stats.n_req << " n_unique_obj: " << trace_stats.n_unique_obj
+             << " unique_bytes: " << trace_stats.unique_bytes << " byte_million_req: " << trace_stats.byte_million_req
+             << endl;
+        if_pass = if_pass && trace_stats.valid;
+        if (stats) {
+            stats->push_back(trace_stats);
         }
 
         if (params.find("dburi") != params.end()) {
@@ -135,7 +429,12 @@ bool trace_sanity_check(const std::vector<string> &trace_files, map<string, stri
             bsoncxx::builder::basic::document value_builder{};
             key_builder.append(kvp("hash", to_string(hash)));
             value_builder.append(kvp("filename", trace_file));
-            value_builder.append(kvp("valid", to_string(if_pass)));
+            value_builder.append(kvp("valid", to_string(trace_stats.valid)));
+            value_builder.append(kvp("format", to_string(stats_cache_format)));
+            value_builder.append(kvp("n_req", to_string(trace_stats.n_req)));
+            value_builder.append(kvp("n_unique_obj", to_string(trace_stats.n_unique_obj)));
+            value_builder.append(kvp("unique_bytes", to_string(trace_stats.unique_bytes)));
+            value_builder.append(kvp("byte_million_req", to_string(trace_stats.byte_million_req)));
             for (bsoncxx::document::element ele: key_builder.view()) {
                 value_builder.append(kvp(ele.key(), ele.get_value()));
             }
@@ -148,9 +447,20 @@ bool trace_sanity_check(const std::vector<string> &trace_files, map<string, stri
                 throw std::runtime_error("warning: db connection failed: " + string(xcp.what()));
             }
         }
-
-        infile.close();
     }
     return if_pass;
 }
 
+void check_n_req(const string &cache_type, const vector<TraceStats> &stats) {
+    if (!seq32_cache_types.count(cache_type)) {
+        return;
+    }
+    uint64_t n_req = 0;
+    for (auto &trace_stats: stats) {
+        n_req += trace_stats.n_req;
+    }
+    if (n_req > max_n_req_seq32) {
+        throw invalid_argument("error: " + cache_type + " can simulate at most " + to_string(max_n_req_seq32) +
+                               " requests, got " + to_string(n_req));
+    }
+}